@@ -0,0 +1,171 @@
+#! /bin/sh
+# Exercise the yaffs2 incremental checkpoint log on a simulated NAND chip.
+#
+#   yaffs2-checkpoint-test.sh latency [counts...]
+#	For each file count, fill a fresh file system, unmount it (full
+#	checkpoint), remount, change a few files and unmount again (delta).
+#	Prints the unmount and checkpoint times the kernel logs for both.
+#
+#   yaffs2-checkpoint-test.sh recovery [files]
+#	Takes flash images at two points, mounts each on a fresh chip and
+#	checks the contents:
+#	  - after a base checkpoint and two synced deltas: must mount from
+#	    the checkpoint and match the last sync exactly;
+#	  - after further writes that are fsync()ed but never sync()ed, so no
+#	    checkpoint covers them: the log must have been marked stale, so it
+#	    must mount from a scan, and match the fsync()ed state exactly.
+#
+# Needs root, nandsim, yaffs2 and mtd-utils (flash_erase or flash_eraseall,
+# nanddump, nandwrite). Any mtd devices already present shift the numbering;
+# set MTD to the nandsim one. Nothing but the nandsim chip is written.
+
+set -e
+me=`basename $0`
+mtd=${MTD:-0}
+mnt=${MNT:-/tmp/yaffs2-test}
+work=${WORK:-/tmp/yaffs2-test.work}
+chars=/dev/mtd$mtd
+blockdev=/dev/mtdblock$mtd
+changed=10
+
+die() {
+	echo "$me: $*" 1>&2
+	exit 1
+}
+
+# 128MiB, 2KiB pages, 64 byte OOB
+load_nandsim() {
+	rmmod nandsim 2>/dev/null || true
+	modprobe nandsim first_id_byte=0x20 second_id_byte=0xaa \
+		third_id_byte=0x00 fourth_id_byte=0x15 || die "no nandsim"
+	test -c $chars || die "$chars missing, set MTD"
+}
+
+erase() {
+	if which flash_erase >/dev/null 2>&1; then
+		flash_erase -q $chars 0 0
+	else
+		flash_eraseall -q $chars
+	fi
+}
+
+# mtd-utils changed nanddump's default from "with OOB" to "without"
+dump() {
+	if nanddump --help 2>&1 | grep -q -- --oob; then
+		nanddump -q --oob -f "$1" $chars
+	else
+		nanddump -q -f "$1" $chars
+	fi
+}
+
+restore() {
+	erase
+	nandwrite -q -o $chars "$1"
+}
+
+mount_fs() {
+	mkdir -p $mnt
+	dmesg -c >/dev/null
+	mount -t yaffs2 $blockdev $mnt
+}
+
+umount_fs() {
+	dmesg -c >/dev/null
+	umount $mnt
+}
+
+# fill_files <first> <last> <tag>
+fill_files() {
+	i=$1
+	while [ $i -le $2 ]; do
+		echo "$3 $i `date +%s%N`" > $mnt/f$i
+		i=$((i + 1))
+	done
+}
+
+# fsync_files <first> <last> <tag>: on NAND, but no checkpoint
+fsync_files() {
+	i=$1
+	while [ $i -le $2 ]; do
+		echo "$3 $i `date +%s%N`" |
+			dd of=$mnt/f$i conv=fsync 2>/dev/null
+		i=$((i + 1))
+	done
+}
+
+manifest() {
+	(cd $mnt && md5sum f* | sort -k 2)
+}
+
+latency() {
+	counts=${*:-"100 1000 5000 20000"}
+	printf "%8s %14s %14s %14s %14s\n" files full-umount-ms full-ckpt-ms \
+		delta-umount-ms delta-ckpt-ms
+	for n in $counts; do
+		load_nandsim
+		erase
+		mount_fs
+		fill_files 1 $n base
+		umount_fs
+		full=`dmesg | sed -n 's/.*unmounted in \([0-9]*\) ms, checkpoint full in \([0-9]*\) ms.*/\1 \2/p'`
+		mount_fs
+		fill_files 1 $changed changed
+		umount_fs
+		delta=`dmesg | sed -n 's/.*unmounted in \([0-9]*\) ms, checkpoint delta in \([0-9]*\) ms.*/\1 \2/p'`
+		test -n "$full" -a -n "$delta" || die "no unmount line for $n files"
+		printf "%8s %14s %14s %14s %14s\n" $n $full $delta
+	done
+}
+
+check_mount() {
+	grep_from=$1
+	restore "$2"
+	mount_fs
+	dmesg | grep -q "mounted in .* from $grep_from" ||
+		die "image $2 did not mount from $grep_from"
+}
+
+recovery() {
+	n=${1:-1000}
+	rm -rf $work
+	mkdir -p $work
+	load_nandsim
+	erase
+
+	# base checkpoint, then two synced deltas
+	mount_fs
+	fill_files 1 $n base
+	sync
+	umount_fs
+	mount_fs
+	fill_files 1 $changed delta1
+	rm $mnt/f$n
+	sync
+	fill_files $((changed + 1)) $((changed * 2)) delta2
+	sync
+	manifest > $work/synced
+	dump $work/synced.img
+
+	# writes past the checkpoint: the log must be marked stale
+	fsync_files 1 $((changed * 2)) fsynced
+	manifest > $work/fsynced
+	dump $work/fsynced.img
+	umount $mnt
+
+	check_mount checkpoint $work/synced.img
+	manifest | diff -u $work/synced - || die "checkpoint log lost changes"
+	umount $mnt
+	echo "synced image: mounted from checkpoint, contents match"
+
+	check_mount scan $work/fsynced.img
+	manifest | diff -u $work/fsynced - || die "scan lost fsync()ed changes"
+	umount $mnt
+	echo "fsynced image: mounted from scan, contents match"
+}
+
+test `id -u` = 0 || die "must be root"
+case "$1" in
+latency)	shift; latency "$@" ;;
+recovery)	shift; recovery "$@" ;;
+*)		die "usage: $me latency [counts...] | recovery [files]" ;;
+esac
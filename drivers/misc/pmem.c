@@ -23,9 +23,13 @@
 #include <linux/android_pmem.h>
 #include <linux/mempolicy.h>
 #include <linux/sched.h>
+#include <linux/bitmap.h>
+#include <linux/moduleparam.h>
+#include <linux/dma-mapping.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 #include <asm/cacheflush.h>
+#include <asm/outercache.h>
 
 #define PMEM_MAX_DEVICES 10
 #define PMEM_MAX_ORDER 128
@@ -84,6 +88,14 @@ struct pmem_bits {
 	unsigned order:7;		/* size of the region in pmem space */
 };
 
+/* bitmap allocator: one per page, meaningful at the first page of an
+ * allocation */
+struct pmem_alloc {
+	unsigned len:31;		/* pages in the allocation */
+	unsigned fixed:1;		/* physical address handed out, the
+					 * allocation can no longer move */
+};
+
 struct pmem_region_node {
 	struct pmem_region region;
 	struct list_head list;
@@ -116,8 +128,17 @@ struct pmem_info {
 	/* the bitmap for the region indicating which entries are allocated
 	 * and which are free */
 	struct pmem_bits *bitmap;
+	/* PMEM_ALLOCATORTYPE_BITMAP: a bit per page set while it is allocated
+	 * and the length of each allocation, instead of bitmap above */
+	unsigned long *alloc_bitmap;
+	struct pmem_alloc *allocs;
+	/* compaction stats, protected by bitmap_sem */
+	unsigned long compactions;
+	unsigned long pages_moved;
 	/* indicates the region should not be managed with an allocator */
 	unsigned no_allocator;
+	/* one of PMEM_ALLOCATORTYPE_* */
+	unsigned allocator_type;
 	/* indicates maps of this region should be cached, if a mix of
 	 * cached and uncached is desired, set this and open the device with
 	 * O_SYNC to get an uncached region */
@@ -152,6 +173,10 @@ struct pmem_info {
 static struct pmem_info pmem[PMEM_MAX_DEVICES];
 static int id_count;
 
+/* compact a bitmap allocator device and retry when an allocation fails */
+static int compact_on_failure = 1;
+module_param(compact_on_failure, int, S_IRUGO | S_IWUSR);
+
 #define PMEM_IS_FREE(id, index) !(pmem[id].bitmap[index].allocated)
 #define PMEM_ORDER(id, index) pmem[id].bitmap[index].order
 #define PMEM_BUDDY_INDEX(id, index) (index ^ (1 << PMEM_ORDER(id, index)))
@@ -168,6 +193,8 @@ static int id_count;
 #define PMEM_IS_PAGE_ALIGNED(addr) (!((addr) & (~PAGE_MASK)))
 #define PMEM_IS_SUBMAP(data) ((data->flags & PMEM_FLAGS_SUBMAP) && \
 	(!(data->flags & PMEM_FLAGS_UNSUBMAP)))
+#define PMEM_IS_BITMAP(id) (!pmem[id].no_allocator && \
+	pmem[id].allocator_type == PMEM_ALLOCATORTYPE_BITMAP)
 
 static int pmem_release(struct inode *, struct file *);
 static int pmem_mmap(struct file *, struct vm_area_struct *);
@@ -242,6 +269,13 @@ static int pmem_free(int id, int index)
 		pmem[id].allocated = 0;
 		return 0;
 	}
+	if (PMEM_IS_BITMAP(id)) {
+		bitmap_clear(pmem[id].alloc_bitmap, index,
+			     pmem[id].allocs[index].len);
+		pmem[id].allocs[index].len = 0;
+		pmem[id].allocs[index].fixed = 0;
+		return 0;
+	}
 	/* clean up the bitmap, merging any buddies */
 	pmem[id].bitmap[curr].allocated = 0;
 	/* find a slots buddy Buddy# = Slot# ^ (1 << order)
@@ -377,6 +411,45 @@ static unsigned long pmem_order(unsigned long len)
 	return i;
 }
 
+static int pmem_allocate_bitmap(int id, unsigned long len)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	unsigned long *map = pmem[id].alloc_bitmap;
+	unsigned long num = pmem[id].num_entries;
+	unsigned long npages = (len + PMEM_MIN_ALLOC - 1) / PMEM_MIN_ALLOC;
+	unsigned long start, end = 0, run, best_len = ULONG_MAX;
+	int best_fit = -1;
+
+	if (!npages || npages > num)
+		return -1;
+
+	/* best fit: the smallest free run the allocation fits in, so big
+	 * runs stay available for big buffers */
+	while (end < num) {
+		start = find_next_zero_bit(map, num, end);
+		if (start >= num)
+			break;
+		end = find_next_bit(map, num, start);
+		run = end - start;
+		if (run >= npages && run < best_len) {
+			best_fit = start;
+			best_len = run;
+			if (run == npages)
+				break;
+		}
+	}
+
+	if (best_fit < 0) {
+		printk("pmem: no space left to allocate!\n");
+		return -1;
+	}
+
+	bitmap_set(map, best_fit, npages);
+	pmem[id].allocs[best_fit].len = npages;
+	pmem[id].allocs[best_fit].fixed = 0;
+	return best_fit;
+}
+
 static int pmem_allocate(int id, unsigned long len)
 {
 	/* caller should hold the write lock on pmem_sem! */
@@ -394,6 +467,9 @@ static int pmem_allocate(int id, unsigned long len)
 		return len;
 	}
 
+	if (PMEM_IS_BITMAP(id))
+		return pmem_allocate_bitmap(id, len);
+
 	if (order > PMEM_MAX_ORDER)
 		return -1;
 	DLOG("order %lx\n", order);
@@ -439,6 +515,113 @@ static int pmem_allocate(int id, unsigned long len)
 	return best_fit;
 }
 
+/* Slide one allocation down into the lowest free run that holds it.
+ * Caller should hold data->sem and the write lock on pmem_sem.
+ * Returns the number of pages moved.
+ */
+static unsigned long pmem_move(int id, struct pmem_data *data)
+{
+	unsigned long *map = pmem[id].alloc_bitmap;
+	int index = data->index;
+	unsigned long npages = pmem[id].allocs[index].len;
+	unsigned long start;
+	void *src, *dst;
+
+	bitmap_clear(map, index, npages);
+	start = bitmap_find_next_zero_area(map, index + npages, 0, npages, 0);
+	if (start >= index) {
+		bitmap_set(map, index, npages);
+		return 0;
+	}
+	bitmap_set(map, start, npages);
+
+	src = (void *)pmem[id].vbase + PMEM_OFFSET(index);
+	dst = (void *)pmem[id].vbase + PMEM_OFFSET(start);
+	memmove(dst, src, npages * PMEM_MIN_ALLOC);
+	if (pmem[id].cached) {
+		/* dst is below src, so this covers both; no dirty line of
+		 * the freed source may be written back over its next owner
+		 */
+		dmac_flush_range(dst, src + npages * PMEM_MIN_ALLOC);
+		outer_flush_range(PMEM_START_ADDR(id, start),
+				  PMEM_START_ADDR(id, index) +
+				  npages * PMEM_MIN_ALLOC);
+	}
+
+	pmem[id].allocs[start] = pmem[id].allocs[index];
+	pmem[id].allocs[index].len = 0;
+	data->index = start;
+	DLOG("moved %lu pages from %d to %lu\n", npages, index, start);
+	return npages;
+}
+
+/* Move every allocation nobody can have the physical address of (never
+ * mmaped, connected to or looked up) towards the start of the region,
+ * merging the holes between them. Files that are busy are skipped rather
+ * than waited for, so this can run from the allocation path.
+ * Returns the number of pages moved.
+ */
+static unsigned long pmem_compact(int id)
+{
+	struct pmem_data *data;
+	unsigned long moved = 0;
+
+	if (down_trylock(&pmem[id].data_list_sem))
+		return 0;
+
+	list_for_each_entry(data, &pmem[id].data_list, list) {
+		if (!down_write_trylock(&data->sem))
+			continue;
+		if (data->index >= 0 && !(data->flags & PMEM_FLAGS_CONNECTED)) {
+			down_write(&pmem[id].bitmap_sem);
+			if (!pmem[id].allocs[data->index].fixed)
+				moved += pmem_move(id, data);
+			up_write(&pmem[id].bitmap_sem);
+		}
+		up_write(&data->sem);
+	}
+	up(&pmem[id].data_list_sem);
+
+	down_write(&pmem[id].bitmap_sem);
+	pmem[id].compactions++;
+	pmem[id].pages_moved += moved;
+	up_write(&pmem[id].bitmap_sem);
+
+	return moved;
+}
+
+/* Allocate, compacting once and retrying if a bitmap allocator device has
+ * no free run large enough. Takes pmem_sem.
+ */
+static int pmem_get_allocation(int id, unsigned long len)
+{
+	int index;
+
+	down_write(&pmem[id].bitmap_sem);
+	index = pmem_allocate(id, len);
+	up_write(&pmem[id].bitmap_sem);
+
+	if (index < 0 && PMEM_IS_BITMAP(id) && compact_on_failure &&
+	    pmem_compact(id)) {
+		down_write(&pmem[id].bitmap_sem);
+		index = pmem_allocate(id, len);
+		up_write(&pmem[id].bitmap_sem);
+	}
+	return index;
+}
+
+/* Once its physical address may be known outside the driver, an
+ * allocation has to stay where it is. Caller should hold data->sem.
+ */
+static void pmem_fix(int id, int index)
+{
+	if (!PMEM_IS_BITMAP(id) || index < 0)
+		return;
+	down_write(&pmem[id].bitmap_sem);
+	pmem[id].allocs[index].fixed = 1;
+	up_write(&pmem[id].bitmap_sem);
+}
+
 static pgprot_t phys_mem_access_prot(struct file *file, pgprot_t vma_prot)
 {
 	int id = get_id(file);
@@ -471,6 +654,8 @@ static unsigned long pmem_len(int id, struct pmem_data *data)
 {
 	if (pmem[id].no_allocator)
 		return data->index;
+	else if (PMEM_IS_BITMAP(id))
+		return pmem[id].allocs[data->index].len * PMEM_MIN_ALLOC;
 	else
 		return PMEM_LEN(id, data->index);
 }
@@ -606,9 +791,7 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 	}
 	/* if file->private_data == unalloced, alloc*/
 	if (data && data->index == -1) {
-		down_write(&pmem[id].bitmap_sem);
-		index = pmem_allocate(id, vma->vm_end - vma->vm_start);
-		up_write(&pmem[id].bitmap_sem);
+		index = pmem_get_allocation(id, vma->vm_end - vma->vm_start);
 		data->index = index;
 	}
 	/* either no space was available or an error occured */
@@ -617,6 +800,7 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 		printk("pmem: could not find allocation for map.\n");
 		goto error;
 	}
+	pmem_fix(id, data->index);
 
 	if (pmem_len(id, data) < vma_size) {
 #if PMEM_DEBUG
@@ -723,6 +907,7 @@ int get_pmem_addr(struct file *file, unsigned long *start,
 	id = get_id(file);
 
 	down_read(&data->sem);
+	pmem_fix(id, data->index);
 	*start = pmem_start_addr(id, data);
 	*len = pmem_len(id, data);
 	*vstart = (unsigned long)pmem_start_vaddr(id, data);
@@ -780,45 +965,82 @@ void put_pmem_file(struct file *file)
 	fput(file);
 }
 
-void flush_pmem_file(struct file *file, unsigned long offset, unsigned long len)
+/* Do cache maintenance 'cmd' (one of the PMEM_CACHE_* ioctls) on part of
+ * a file's allocation, through the kernel mapping for the inner caches
+ * and by physical address for the outer cache. A connected file may only
+ * touch the regions its master has mapped into it.
+ */
+static int pmem_cache_maint(struct file *file, unsigned int cmd,
+			    unsigned long offset, unsigned long len)
 {
 	struct pmem_data *data;
-	int id;
-	void *vaddr;
 	struct pmem_region_node *region_node;
 	struct list_head *elt;
-	void *flush_start, *flush_end;
+	unsigned long total, paddr;
+	void *vaddr;
+	int id, ret = 0;
 
-	if (!is_pmem_file(file) || !has_allocation(file)) {
-		return;
-	}
+	if (!is_pmem_file(file) || !has_allocation(file))
+		return -EINVAL;
 
 	id = get_id(file);
 	data = (struct pmem_data *)file->private_data;
 	if (!pmem[id].cached || file->f_flags & O_SYNC)
-		return;
+		return 0;
 
 	down_read(&data->sem);
-	vaddr = pmem_start_vaddr(id, data);
-	/* if this isn't a submmapped file, flush the whole thing */
-	if (unlikely(!(data->flags & PMEM_FLAGS_CONNECTED))) {
-		dmac_flush_range(vaddr, vaddr + pmem_len(id, data));
+	total = pmem_len(id, data);
+	if (!len) {
+		offset = 0;
+		len = total;
+	}
+	if (offset > total || len > total - offset) {
+		ret = -EINVAL;
 		goto end;
 	}
-	/* otherwise, flush the region of the file we are drawing */
-	list_for_each(elt, &data->region_list) {
-		region_node = list_entry(elt, struct pmem_region_node, list);
-		if ((offset >= region_node->region.offset) &&
-		    ((offset + len) <= (region_node->region.offset +
-			region_node->region.len))) {
-			flush_start = vaddr + region_node->region.offset;
-			flush_end = flush_start + region_node->region.len;
-			dmac_flush_range(flush_start, flush_end);
-			break;
+
+	if (data->flags & PMEM_FLAGS_CONNECTED) {
+		ret = -EINVAL;
+		list_for_each(elt, &data->region_list) {
+			region_node = list_entry(elt, struct pmem_region_node,
+						 list);
+			if ((offset >= region_node->region.offset) &&
+			    ((offset + len) <= (region_node->region.offset +
+				region_node->region.len))) {
+				ret = 0;
+				break;
+			}
 		}
+		if (ret)
+			goto end;
+	}
+
+	vaddr = pmem_start_vaddr(id, data) + offset;
+	paddr = pmem_start_addr(id, data) + offset;
+
+	switch (cmd) {
+	case PMEM_CACHE_FLUSH:
+		dmac_flush_range(vaddr, vaddr + len);
+		outer_flush_range(paddr, paddr + len);
+		break;
+	case PMEM_CACHE_CLEAN:
+		dmac_map_area(vaddr, len, DMA_TO_DEVICE);
+		outer_clean_range(paddr, paddr + len);
+		break;
+	case PMEM_CACHE_INVALIDATE:
+		/* outer first, or the inner cache could refill stale lines */
+		outer_inv_range(paddr, paddr + len);
+		dmac_unmap_area(vaddr, len, DMA_FROM_DEVICE);
+		break;
 	}
 end:
 	up_read(&data->sem);
+	return ret;
+}
+
+void flush_pmem_file(struct file *file, unsigned long offset, unsigned long len)
+{
+	pmem_cache_maint(file, PMEM_CACHE_FLUSH, offset, len);
 }
 
 static int pmem_connect(unsigned long connect, struct file *file)
@@ -851,7 +1073,12 @@ static int pmem_connect(unsigned long connect, struct file *file)
 		ret = -EINVAL;
 		goto err_bad_file;
 	}
+	/* bitmap_sem keeps the source from being compacted while we look */
+	down_write(&pmem[get_id(file)].bitmap_sem);
 	data->index = src_data->index;
+	if (PMEM_IS_BITMAP(get_id(file)))
+		pmem[get_id(file)].allocs[data->index].fixed = 1;
+	up_write(&pmem[get_id(file)].bitmap_sem);
 	data->flags |= PMEM_FLAGS_CONNECTED;
 	data->master_fd = connect;
 	data->master_file = src_file;
@@ -1056,14 +1283,16 @@ static void pmem_get_size(struct pmem_region *region, struct file *file)
 	struct pmem_data *data = (struct pmem_data *)file->private_data;
 	int id = get_id(file);
 
+	down_read(&data->sem);
 	if (!has_allocation(file)) {
 		region->offset = 0;
 		region->len = 0;
-		return;
 	} else {
+		pmem_fix(id, data->index);
 		region->offset = pmem_start_addr(id, data);
 		region->len = pmem_len(id, data);
 	}
+	up_read(&data->sem);
 	DLOG("offset %lx len %lx\n", region->offset, region->len);
 }
 
@@ -1078,14 +1307,7 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		{
 			struct pmem_region region;
 			DLOG("get_phys\n");
-			if (!has_allocation(file)) {
-				region.offset = 0;
-				region.len = 0;
-			} else {
-				data = (struct pmem_data *)file->private_data;
-				region.offset = pmem_start_addr(id, data);
-				region.len = pmem_len(id, data);
-			}
+			pmem_get_size(&region, file);
 			printk(KERN_INFO "pmem: request for physical address of pmem region "
 					"from process %d.\n", current->pid);
 			if (copy_to_user((void __user *)arg, &region,
@@ -1140,7 +1362,7 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			if (has_allocation(file))
 				return -EINVAL;
 			data = (struct pmem_data *)file->private_data;
-			data->index = pmem_allocate(id, arg);
+			data->index = pmem_get_allocation(id, arg);
 			break;
 		}
 	case PMEM_CONNECT:
@@ -1148,14 +1370,16 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		return pmem_connect(arg, file);
 		break;
 	case PMEM_CACHE_FLUSH:
+	case PMEM_CACHE_INVALIDATE:
+	case PMEM_CACHE_CLEAN:
 		{
 			struct pmem_region region;
-			DLOG("flush\n");
+			DLOG("cache maintenance %x\n", cmd);
 			if (copy_from_user(&region, (void __user *)arg,
 					   sizeof(struct pmem_region)))
 				return -EFAULT;
-			flush_pmem_file(file, region.offset, region.len);
-			break;
+			return pmem_cache_maint(file, cmd, region.offset,
+						region.len);
 		}
 	default:
 		if (pmem[id].ioctl)
@@ -1215,6 +1439,115 @@ static struct file_operations debug_fops = {
 	.read = debug_read,
 	.open = debug_open,
 };
+
+struct pmem_frag {
+	unsigned long free;
+	unsigned long runs;
+	unsigned long largest;
+	/* free runs of 2^n up to 2^(n+1) - 1 pages */
+	unsigned long hist[BITS_PER_LONG];
+};
+
+static void pmem_frag_add(struct pmem_frag *frag, unsigned long run)
+{
+	if (!run)
+		return;
+	frag->free += run;
+	frag->runs++;
+	frag->largest = max(frag->largest, run);
+	frag->hist[fls(run) - 1]++;
+}
+
+static ssize_t debug_frag_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	int id = (int)file->private_data;
+	unsigned long num = pmem[id].num_entries;
+	unsigned long start, end = 0, curr = 0, run = 0;
+	unsigned long allocs = 0, fixed = 0;
+	struct pmem_frag *frag;
+	const int debug_bufmax = 2048;
+	char *buffer;
+	int i, n;
+	ssize_t ret;
+
+	frag = kzalloc(sizeof(*frag), GFP_KERNEL);
+	buffer = kmalloc(debug_bufmax, GFP_KERNEL);
+	if (!frag || !buffer) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	down_read(&pmem[id].bitmap_sem);
+	if (pmem[id].no_allocator) {
+		if (!pmem[id].allocated)
+			pmem_frag_add(frag, num);
+	} else if (PMEM_IS_BITMAP(id)) {
+		while (end < num) {
+			start = find_next_zero_bit(pmem[id].alloc_bitmap, num,
+						   end);
+			if (start >= num)
+				break;
+			end = find_next_bit(pmem[id].alloc_bitmap, num, start);
+			pmem_frag_add(frag, end - start);
+		}
+		for (curr = 0; curr < num; curr++) {
+			if (pmem[id].allocs[curr].len) {
+				allocs++;
+				fixed += pmem[id].allocs[curr].fixed;
+			}
+		}
+	} else {
+		/* neighbouring free buddies of different orders form one run */
+		while (curr < num) {
+			if (PMEM_IS_FREE(id, curr)) {
+				run += 1 << PMEM_ORDER(id, curr);
+			} else {
+				pmem_frag_add(frag, run);
+				run = 0;
+				allocs++;
+			}
+			curr = PMEM_NEXT_INDEX(id, curr);
+		}
+		pmem_frag_add(frag, run);
+	}
+
+	n = scnprintf(buffer, debug_bufmax,
+		      "allocator: %s\n"
+		      "total pages: %lu\n"
+		      "free pages: %lu\n"
+		      "allocations: %lu (%lu fixed)\n"
+		      "free runs: %lu\n"
+		      "largest free run: %lu pages\n"
+		      "fragmentation: %lu%%\n"
+		      "compactions: %lu (%lu pages moved)\n",
+		      pmem[id].no_allocator ? "none" :
+		      PMEM_IS_BITMAP(id) ? "bitmap" : "buddy",
+		      num, frag->free, allocs, fixed, frag->runs,
+		      frag->largest, frag->free ?
+		      100 - frag->largest * 100 / frag->free : 0,
+		      pmem[id].compactions, pmem[id].pages_moved);
+	up_read(&pmem[id].bitmap_sem);
+
+	n += scnprintf(buffer + n, debug_bufmax - n, "free runs by size:\n");
+	for (i = 0; i < BITS_PER_LONG; i++) {
+		if (frag->hist[i])
+			n += scnprintf(buffer + n, debug_bufmax - n,
+				       "  %lu+ pages: %lu\n", 1UL << i,
+				       frag->hist[i]);
+	}
+
+	ret = simple_read_from_buffer(buf, count, ppos, buffer, n);
+out:
+	kfree(buffer);
+	kfree(frag);
+	return ret;
+}
+
+static struct file_operations debug_frag_fops = {
+	.read = debug_frag_read,
+	.open = debug_open,
+};
 #endif
 
 #if 0
@@ -1231,9 +1564,13 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	int err = 0;
 	int i, index = 0;
 	int id = id_count;
+#if PMEM_DEBUG
+	char frag_name[32];
+#endif
 	id_count++;
 
 	pmem[id].no_allocator = pdata->no_allocator;
+	pmem[id].allocator_type = pdata->allocator_type;
 	pmem[id].cached = pdata->cached;
 	pmem[id].buffered = pdata->buffered;
 	pmem[id].base = pdata->start;
@@ -1255,6 +1592,17 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	}
 	pmem[id].num_entries = pmem[id].size / PMEM_MIN_ALLOC;
 
+	if (PMEM_IS_BITMAP(id)) {
+		pmem[id].alloc_bitmap = kzalloc(BITS_TO_LONGS(
+				pmem[id].num_entries) * sizeof(long),
+				GFP_KERNEL);
+		pmem[id].allocs = kzalloc(pmem[id].num_entries *
+				sizeof(struct pmem_alloc), GFP_KERNEL);
+		if (!pmem[id].alloc_bitmap || !pmem[id].allocs)
+			goto err_no_mem_for_metadata;
+		goto remap;
+	}
+
 	pmem[id].bitmap = kmalloc(pmem[id].num_entries *
 				  sizeof(struct pmem_bits), GFP_KERNEL);
 	if (!pmem[id].bitmap)
@@ -1270,6 +1618,7 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 		}
 	}
 
+remap:
 	if (pmem[id].cached)
 		pmem[id].vbase = ioremap_cached(pmem[id].base,
 						pmem[id].size);
@@ -1291,11 +1640,16 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 #if PMEM_DEBUG
 	debugfs_create_file(pdata->name, S_IFREG | S_IRUGO, NULL, (void *)id,
 			    &debug_fops);
+	snprintf(frag_name, sizeof(frag_name), "%s_frag", pdata->name);
+	debugfs_create_file(frag_name, S_IFREG | S_IRUGO, NULL, (void *)id,
+			    &debug_frag_fops);
 #endif
 	return 0;
 error_cant_remap:
-	kfree(pmem[id].bitmap);
 err_no_mem_for_metadata:
+	kfree(pmem[id].bitmap);
+	kfree(pmem[id].alloc_bitmap);
+	kfree(pmem[id].allocs);
 	misc_deregister(&pmem[id].dev);
 err_cant_register_device:
 	return -1;
@@ -27,6 +27,8 @@
 #include <linux/tty_flip.h>
 #include <linux/irq.h>
 #include <linux/poll.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <asm/io.h>
 #include <asm/irq.h>
 #include <mach/regs-gpio.h>
@@ -133,9 +135,6 @@ struct pdp_info {
 	/* Device flags */
 	unsigned		flags;
 
-	/* Tx packet buffer */
-	u8		*tx_buf;
-
 	/* App device interface */
 	union {
 		/* Virtual serial interface */
@@ -168,6 +167,7 @@ static inline void check_pdp_table(char*, int);
 
 #define DRIVER_NAME 		"DPRAM"
 #define DRIVER_PROC_ENTRY	"driver/dpram"
+#define LOOPBACK_PROC_ENTRY	"driver/dpram_loopback"
 #define DRIVER_MAJOR_NUM	250
 
 #ifdef _DEBUG
@@ -223,6 +223,37 @@ static int unreceived_semaphore = 0;
 static int phone_sync = 0;
 static int dump_on = 0;
 
+/* PDA->PHONE raw channel statistics, shown in /proc/driver/dpram */
+static struct {
+	unsigned long	bytes;
+	unsigned long	frames;
+	unsigned long	batches;
+	unsigned long	interrupts;
+	unsigned long	ring_full;
+} raw_tx_stat;
+
+/*
+ * PHONE->PDA raw channel. Received frames are polled from a tasklet with a
+ * budget, and SEND_R interrupts which come in while a poll is pending don't
+ * schedule another one.
+ */
+static int raw_rx_budget = 64;
+module_param(raw_rx_budget, int, 0644);
+MODULE_PARM_DESC(raw_rx_budget, "PDP frames read from the raw ring per tasklet run");
+
+static DEFINE_SPINLOCK(raw_rx_lock);
+static int raw_rx_polling;
+
+static struct {
+	unsigned long	interrupts;	/* SEND_R interrupts */
+	unsigned long	mitigated;	/* of those, while a poll was pending */
+	unsigned long	polls;
+	unsigned long	repolls;	/* polls which used up the budget */
+	unsigned long	frames;
+	unsigned long	bytes;
+	unsigned long	copies;		/* copies out of OneDRAM into tty buffers */
+} raw_rx_stat;
+
 static int dpram_phone_getstatus(void);
 #define DPRAM_VBASE dpram_base
 static struct tty_driver *dpram_tty_driver;
@@ -441,6 +472,22 @@ static void send_interrupt_to_phone(u16 irq_mask)
 }
 #endif
 
+/*
+ * The out head is only ever written by us, so a single read of it is good
+ * enough while it matches what we wrote last time; only when it doesn't is
+ * it read again the slow, verified way. The tail is the phone's and may be
+ * changing under us, so it is always read verified.
+ */
+static inline void dpram_read_out_head_tail(dpram_device_t *device,
+		u16 *head, u16 *tail)
+{
+	READ_FROM_DPRAM(head, device->out_head_addr, sizeof(*head));
+	if (*head != device->out_head_saved)
+		READ_FROM_DPRAM_VERIFY(head, device->out_head_addr, sizeof(*head));
+
+	READ_FROM_DPRAM_VERIFY(tail, device->out_tail_addr, sizeof(*tail));
+}
+
 static int dpram_write(dpram_device_t *device,
 		const unsigned char *buf, int len)
 {
@@ -470,8 +517,7 @@ static int dpram_write(dpram_device_t *device,
 		return -EINTR;
 	}
 
-	READ_FROM_DPRAM_VERIFY(&head, device->out_head_addr, sizeof(head));
-	READ_FROM_DPRAM_VERIFY(&tail, device->out_tail_addr, sizeof(tail));
+	dpram_read_out_head_tail(device, &head, &tail);
 
 //printk(KERN_ERR "%s, head: %d, tail: %d\n", __func__, head, tail);
 
@@ -526,6 +572,11 @@ static int dpram_write(dpram_device_t *device,
 	if (len > retval)
 		irq_mask |= device->mask_req_ack;
 
+	if (device == &dpram_table[RAW_INDEX]) {
+		raw_tx_stat.bytes += retval;
+		raw_tx_stat.interrupts++;
+	}
+
 	onedram_release_lock(__func__);
 //	send_interrupt_to_phone(irq_mask);
 	send_interrupt_to_phone_with_semaphore(irq_mask);
@@ -537,6 +588,104 @@ static int dpram_write(dpram_device_t *device,
 	
 }
 
+/* copy into the out ring at *head, wrapping at the end. room is checked by the caller. */
+static inline void dpram_ring_put(dpram_device_t *device, u16 *head,
+		const void *buf, int size)
+{
+	int size1 = device->out_buff_size - *head;
+
+	if (size1 > size)
+		size1 = size;
+
+	WRITE_TO_DPRAM(device->out_buff_addr + *head, buf, size1);
+	if (size > size1)
+		WRITE_TO_DPRAM(device->out_buff_addr, (const u8 *)buf + size1, size - size1);
+
+	*head = (u16)((*head + size) % device->out_buff_size);
+}
+
+/*
+ * Write as many whole PDP frames of data as fit into the raw out ring, all
+ * under one semaphore hold and with one interrupt to the phone. The frame
+ * header and trailer are written around the payload, which goes straight
+ * from the caller's buffer into OneDRAM without being assembled first.
+ * Returns the number of data bytes taken, which may be short of len when
+ * the ring is full; the phone is then asked for a RES_ACK_R.
+ */
+static int dpram_write_pdp(dpram_device_t *device, u8 id,
+		const u8 *data, int len)
+{
+	u8 prologue[1 + sizeof(struct pdp_hdr)];
+	struct pdp_hdr *hdr = (struct pdp_hdr *)(prologue + 1);
+	const u8 epilogue = 0x7e;
+	const int overhead = sizeof(prologue) + sizeof(epilogue);
+	int room, nbytes;
+	int retval = 0;
+	int frames = 0;
+	u16 head, tail;
+	u16 irq_mask;
+
+	if(!onedram_get_semaphore(__func__)) {
+		return -EINTR;
+	}
+
+	if(onedram_lock_with_semaphore(__func__) < 0) {
+		return -EINTR;
+	}
+
+	dpram_read_out_head_tail(device, &head, &tail);
+	room = (tail + device->out_buff_size - head - 1) % device->out_buff_size;
+
+	prologue[0] = 0x7f;
+	hdr->id = id;
+	hdr->control = 0;
+
+	while (retval < len) {
+		nbytes = len - retval;
+		if (nbytes > MAX_PDP_DATA_LEN)
+			nbytes = MAX_PDP_DATA_LEN;
+
+		if (room < nbytes + overhead)
+			break;
+
+		hdr->len = nbytes + sizeof(struct pdp_hdr);
+
+		dpram_ring_put(device, &head, prologue, sizeof(prologue));
+		dpram_ring_put(device, &head, data + retval, nbytes);
+		dpram_ring_put(device, &head, &epilogue, 1);
+
+		room -= nbytes + overhead;
+		retval += nbytes;
+		frames++;
+	}
+
+	if (frames)
+		WRITE_TO_DPRAM_VERIFY(device->out_head_addr, &head, sizeof(head));
+
+	device->out_head_saved = head;
+	device->out_tail_saved = tail;
+
+	irq_mask = INT_MASK_VALID;
+
+	if (frames)
+		irq_mask |= device->mask_send;
+
+	if (len > retval) {
+		irq_mask |= device->mask_req_ack;
+		raw_tx_stat.ring_full++;
+	}
+
+	raw_tx_stat.bytes += retval;
+	raw_tx_stat.frames += frames;
+	raw_tx_stat.batches++;
+	raw_tx_stat.interrupts++;
+
+	onedram_release_lock(__func__);
+	send_interrupt_to_phone_with_semaphore(irq_mask);
+
+	return retval;
+}
+
 static inline int dpram_tty_insert_data(dpram_device_t *device, const u8 *psrc, u16 size)
 {
 #define CLUSTER_SEGMENT	1500
@@ -653,8 +802,16 @@ static int dpram_read_fmt(dpram_device_t *device, const u16 non_cmd)
 	
 }
 
-static int dpram_read_raw(dpram_device_t *device, const u16 non_cmd)
+/*
+ * Read at most budget PDP frames from the raw ring and pass them to their
+ * serial devices. Each tty is pushed once at the end rather than per frame.
+ * Returns the number of frames read.
+ */
+static int dpram_read_raw(dpram_device_t *device, const u16 non_cmd, int budget)
 {
+	struct pdp_info *pushed[MAX_PDP_CONTEXT];
+	int npushed = 0;
+	int frames = 0;
 	int retval = 0;
 	int retval_add = 0;
 	int size = 0;
@@ -703,7 +860,7 @@ static int dpram_read_raw(dpram_device_t *device, const u16 non_cmd)
 		read_offset = 0;
 //		printk(KERN_ERR "=====> %s,  head: %d, tail: %d, size: %d\n", __func__, head, tail, size);
 
-		while(size){			
+		while(size && frames < budget){
 			READ_FROM_DPRAM(&ch, device->in_buff_addr +((u16)(tail + read_offset) % device->in_buff_size), sizeof(ch));
 
 			if(ch == 0x7f) {
@@ -714,9 +871,7 @@ static int dpram_read_raw(dpram_device_t *device, const u16 non_cmd)
 				printk(KERN_ERR "buff addr: %x\n", (device->in_buff_addr));
 				printk(KERN_ERR "read addr: %x\n", (device->in_buff_addr + ((u16)(tail + read_offset) % device->in_buff_size)));
 
-				dpram_drop_data(device);
-				onedram_release_lock(__func__);
-				return -1;
+				goto drop;
 			}
 
 			len_high = len_low = id = control = 0;
@@ -738,11 +893,7 @@ static int dpram_read_raw(dpram_device_t *device, const u16 non_cmd)
 				printk(KERN_ERR "[OneDram] %s uups..\n", __func__);
 				printk(KERN_ERR "%s, %d read_offset: %d, len: %d hdr.id: %d\n", __func__, __LINE__, read_offset, len, hdr.id);
 
-				dpram_drop_data(device);
-				onedram_release_lock(__func__);
-				return -1;
-
-
+				goto drop;
 			}
 			dev = pdp_get_dev(hdr.id);
 //			printk(KERN_ERR "%s, %d read_offset: %d, len: %d hdr.id: %d\n", __func__, __LINE__, read_offset, len, hdr.id);
@@ -750,9 +901,7 @@ static int dpram_read_raw(dpram_device_t *device, const u16 non_cmd)
 			if(!dev) {
 				printk(KERN_ERR "[OneDram] %s failed.. NULL dev detected \n", __func__);
 				check_pdp_table(__func__, __LINE__);
-				dpram_drop_data(device);
-				onedram_release_lock(__func__);
-				return -1;
+				goto drop;
 			}
 
 				
@@ -760,14 +909,20 @@ static int dpram_read_raw(dpram_device_t *device, const u16 non_cmd)
 			
 				if((u16)(tail + read_offset) % device->in_buff_size + len < device->in_buff_size) {
 					ret = tty_insert_flip_string(dev->vs_dev.tty, (u8 *)(DPRAM_VBASE + (device->in_buff_addr + (u16)(tail + read_offset) % device->in_buff_size)), len);
-					tty_flip_buffer_push(dev->vs_dev.tty);
+					raw_rx_stat.copies++;
 				}else {
 					pre_data_size = device->in_buff_size - (tail + read_offset); 
 					ret = tty_insert_flip_string(dev->vs_dev.tty, (u8 *)(DPRAM_VBASE + (device->in_buff_addr + tail + read_offset)), pre_data_size);
 					ret += tty_insert_flip_string(dev->vs_dev.tty, (u8 *)(DPRAM_VBASE + (device->in_buff_addr)),len - pre_data_size);
-					tty_flip_buffer_push(dev->vs_dev.tty);
+					raw_rx_stat.copies += 2;
 //					printk(KERN_ERR "=====> pre_data_size: %d, len-pre_data_size: %d, ret: %d\n", pre_data_size, len- pre_data_size, ret);
 				}
+
+				for (i = 0; i < npushed; i++)
+					if (pushed[i] == dev)
+						break;
+				if (i == npushed)
+					pushed[npushed++] = dev;
 			}
 			else {
 				printk(KERN_ERR "[%s]failed.. tty channel(id:%d) is not opened.\n", __func__, dev->id);
@@ -778,9 +933,7 @@ static int dpram_read_raw(dpram_device_t *device, const u16 non_cmd)
 				printk(KERN_ERR "[OneDram] %s failed.. (tty_insert_flip_string) drop byte: %d\n", __func__, size);
 				printk(KERN_ERR "buff addr: %x\n", (device->in_buff_addr));
 				printk(KERN_ERR "read addr: %x\n", (device->in_buff_addr + ((u16)(tail + read_offset) % device->in_buff_size)));
-				dpram_drop_data(device);
-				onedram_release_lock(__func__);
-				return -1;
+				goto drop;
 			}
 			
 			read_offset += ret;
@@ -793,13 +946,12 @@ static int dpram_read_raw(dpram_device_t *device, const u16 non_cmd)
 				printk(KERN_ERR "[OneDram] %s failed.. Last byte: %d, drop byte: %d\n", __func__, ch, size);
 				printk(KERN_ERR "buff addr: %x\n", (device->in_buff_addr));
 				printk(KERN_ERR "read addr: %x\n", (device->in_buff_addr + ((u16)(tail + read_offset) % device->in_buff_size)));
-				dpram_drop_data(device);
-				onedram_release_lock(__func__);
-				return -1;
+				goto drop;
 			}
 
 			size -= (ret + sizeof(struct pdp_hdr) + 2);
 			retval += (ret + sizeof(struct pdp_hdr) + 2);
+			frames++;
 //			printk(KERN_ERR "%s, %d retval= %d, read_offset: %d, size: %d\n", __func__, __LINE__, retval, read_offset, size);
 
 			if(size < 0) {
@@ -824,8 +976,23 @@ static int dpram_read_raw(dpram_device_t *device, const u16 non_cmd)
 	if (non_cmd & device->mask_req_ack) 	
 		send_interrupt_to_phone_with_semaphore(INT_NON_COMMAND(device->mask_res_ack));
 
-	return retval;
-	
+	for (i = 0; i < npushed; i++)
+		tty_flip_buffer_push(pushed[i]->vs_dev.tty);
+
+	raw_rx_stat.frames += frames;
+	raw_rx_stat.bytes += retval;
+
+	return frames;
+
+drop:
+	dpram_drop_data(device);
+	onedram_release_lock(__func__);
+
+	/* frames already inserted before the bad one still go up */
+	for (i = 0; i < npushed; i++)
+		tty_flip_buffer_push(pushed[i]->vs_dev.tty);
+
+	return -1;
 }
 #ifdef _ENABLE_ERROR_DEVICE
 void request_phone_reset()
@@ -1301,6 +1468,9 @@ static int dpram_read_proc(char *page, char **start, off_t off,
 	int rih, rit, roh, rot;
 	int sem;
 
+	/* in hundredths */
+	unsigned long frames_per_int = 0, copies_per_frame = 0;
+
 #ifdef _ENABLE_ERROR_DEVICE
 	char buf[DPRAM_ERR_MSG_LEN];
 	unsigned long flags;
@@ -1339,6 +1509,11 @@ static int dpram_read_proc(char *page, char **start, off_t off,
 	in_interrupt = *onedram_mailboxAB;
 	out_interrupt = *onedram_mailboxBA;
 
+	if (raw_rx_stat.interrupts)
+		frames_per_int = div64_u64((u64)raw_rx_stat.frames * 100, raw_rx_stat.interrupts);
+	if (raw_rx_stat.frames)
+		copies_per_frame = div64_u64((u64)raw_rx_stat.copies * 100, raw_rx_stat.frames);
+
 #ifdef _ENABLE_ERROR_DEVICE
 	memset((void *)buf, '\0', DPRAM_ERR_MSG_LEN);
 	local_irq_save(flags);
@@ -1378,6 +1553,21 @@ static int dpram_read_proc(char *page, char **start, off_t off,
 			"| PHONE->PDA MAILBOX\t| 0x%04x\n"
 			"| PDA->PHONE MAILBOX\t| 0x%04x\n"
 			"-------------------------------------\n"
+			"| RAW TX BYTES\t\t| %lu\n"
+			"| RAW TX PDP FRAMES\t| %lu\n"
+			"| RAW TX PDP BATCHES\t| %lu\n"
+			"| RAW TX INTERRUPTS\t| %lu\n"
+			"| RAW TX RING FULL\t| %lu\n"
+			"-------------------------------------\n"
+			"| RAW RX INTERRUPTS\t| %lu\n"
+			"| RAW RX MITIGATED\t| %lu\n"
+			"| RAW RX POLLS\t\t| %lu\n"
+			"| RAW RX REPOLLS\t| %lu\n"
+			"| RAW RX FRAMES\t\t| %lu\n"
+			"| RAW RX BYTES\t\t| %lu\n"
+			"| RAW RX FRAMES/INT\t| %lu.%02lu\n"
+			"| RAW RX COPIES/FRAME\t| %lu.%02lu\n"
+			"-------------------------------------\n"
 #ifdef _ENABLE_ERROR_DEVICE
 			"| LAST PHONE ERR MSG\t| %s\n"
 #endif	/* _ENABLE_ERROR_DEVICE */
@@ -1393,6 +1583,13 @@ static int dpram_read_proc(char *page, char **start, off_t off,
 			fih, fit, foh, fot, 
 			rih, rit, roh, rot,
 			in_interrupt, out_interrupt,
+			raw_tx_stat.bytes, raw_tx_stat.frames, raw_tx_stat.batches,
+			raw_tx_stat.interrupts, raw_tx_stat.ring_full,
+			raw_rx_stat.interrupts, raw_rx_stat.mitigated,
+			raw_rx_stat.polls, raw_rx_stat.repolls,
+			raw_rx_stat.frames, raw_rx_stat.bytes,
+			frames_per_int / 100, frames_per_int % 100,
+			copies_per_frame / 100, copies_per_frame % 100,
 
 #ifdef _ENABLE_ERROR_DEVICE
 			(buf[0] != '\0' ? buf : "NONE"),
@@ -1412,6 +1609,139 @@ static int dpram_read_proc(char *page, char **start, off_t off,
 
 	return len;
 }
+
+#ifdef CONFIG_DEBUG_BENCH
+/*
+ * Raw channel throughput test. Writing a size in KB to
+ * /proc/driver/dpram_loopback pushes that much data through
+ * dpram_write_pdp() on PDP context loopback_pdp_id, which the phone's test
+ * firmware loops back, and reading it shows the result.
+ */
+static int loopback_pdp_id = 31;
+module_param(loopback_pdp_id, int, 0644);
+MODULE_PARM_DESC(loopback_pdp_id, "PDP context used by the raw channel loopback test");
+
+#define LOOPBACK_CHUNK		(MAX_PDP_DATA_LEN * 8)
+#define LOOPBACK_MAX_STALLS	1000	/* ms to wait for the phone to drain the ring */
+
+static struct {
+	unsigned long	bytes;
+	unsigned long	interrupts;
+	unsigned long	ring_full;
+	s64		usecs;
+	int		error;
+} loopback_result;
+
+static DEFINE_MUTEX(loopback_lock);
+
+static int dpram_loopback_read_proc(char *page, char **start, off_t off,
+		int count, int *eof, void *data)
+{
+	char *p = page;
+	u64 mbps100 = 0, irqs_per_mb = 0;
+	int len;
+
+	mutex_lock(&loopback_lock);
+
+	if (loopback_result.usecs > 0)
+		mbps100 = div64_u64((u64)loopback_result.bytes * 100, loopback_result.usecs);
+	if (loopback_result.bytes)
+		irqs_per_mb = div64_u64((u64)loopback_result.interrupts << 20, loopback_result.bytes);
+
+	p += sprintf(p,
+			"bytes\t\t%lu\n"
+			"usecs\t\t%lld\n"
+			"MB/s\t\t%llu.%02llu\n"
+			"interrupts\t%lu\n"
+			"interrupts/MB\t%llu\n"
+			"ring full\t%lu\n"
+			"error\t\t%d\n",
+			loopback_result.bytes, loopback_result.usecs,
+			div_u64(mbps100, 100), mbps100 - div_u64(mbps100, 100) * 100,
+			loopback_result.interrupts, irqs_per_mb,
+			loopback_result.ring_full, loopback_result.error);
+
+	mutex_unlock(&loopback_lock);
+
+	len = (p - page) - off;
+	if (len < 0) {
+		len = 0;
+	}
+
+	*eof = (len <= count) ? 1 : 0;
+	*start = page + off;
+
+	return len;
+}
+
+static int dpram_loopback_write_proc(struct file *file, const char __user *buffer,
+		unsigned long count, void *data)
+{
+	dpram_device_t *device = &dpram_table[RAW_INDEX];
+	unsigned long total, done = 0, irqs, full;
+	char kbuf[16];
+	u8 *pattern;
+	ktime_t start;
+	int stalls = 0;
+	int ret = 0;
+	int i;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, buffer, count))
+		return -EFAULT;
+	kbuf[count] = '\0';
+
+	total = simple_strtoul(kbuf, NULL, 0) << 10;
+	if (!total)
+		return -EINVAL;
+
+	pattern = kmalloc(LOOPBACK_CHUNK, GFP_KERNEL);
+	if (!pattern)
+		return -ENOMEM;
+
+	for (i = 0; i < LOOPBACK_CHUNK; i++)
+		pattern[i] = (u8)i;
+
+	mutex_lock(&loopback_lock);
+
+	irqs = raw_tx_stat.interrupts;
+	full = raw_tx_stat.ring_full;
+	start = ktime_get();
+
+	while (done < total) {
+		int len = min_t(unsigned long, total - done, LOOPBACK_CHUNK);
+
+		ret = dpram_write_pdp(device, loopback_pdp_id, pattern, len);
+		if (ret < 0)
+			break;
+
+		if (ret == 0) {
+			if (++stalls > LOOPBACK_MAX_STALLS) {
+				ret = -ETIMEDOUT;
+				break;
+			}
+			msleep(1);
+			continue;
+		}
+
+		stalls = 0;
+		done += ret;
+	}
+
+	loopback_result.usecs = ktime_us_delta(ktime_get(), start);
+	loopback_result.bytes = done;
+	loopback_result.interrupts = raw_tx_stat.interrupts - irqs;
+	loopback_result.ring_full = raw_tx_stat.ring_full - full;
+	loopback_result.error = (ret < 0) ? ret : 0;
+
+	mutex_unlock(&loopback_lock);
+
+	kfree(pattern);
+
+	return (ret < 0) ? ret : count;
+}
+#endif /* CONFIG_DEBUG_BENCH */
 #endif /* CONFIG_PROC_FS */
 
 /* dpram tty file operations. */
@@ -1675,6 +2005,18 @@ static void res_ack_tasklet_handler(unsigned long data)
 
 		wake_up_interruptible(&tty->write_wait);
 	}
+
+	/* the PDP serial devices share the raw ring, dpram_write_pdp() may have left them waiting */
+	if (device == &dpram_table[RAW_INDEX]) {
+		int slot;
+
+		for (slot = 0; slot < MAX_PDP_CONTEXT; slot++) {
+			struct pdp_info *dev = pdp_table[slot];
+
+			if (dev && dev->vs_dev.refcount && dev->vs_dev.tty)
+				tty_wakeup(dev->vs_dev.tty);
+		}
+	}
 }
 
 static void fmt_rcv_tasklet_handler(unsigned long data)
@@ -1717,16 +2059,56 @@ static void raw_rcv_tasklet_handler(unsigned long data)
 	dpram_tasklet_data_t *tasklet_data = (dpram_tasklet_data_t *)data;
 
 	dpram_device_t *device = tasklet_data->device;
-	u16 non_cmd = tasklet_data->non_cmd;
+	u16 non_cmd;
+	unsigned long flags;
 
+	int budget = max(raw_rx_budget, 1);
 	int ret = 0;
-	
-	while (dpram_get_read_available(device)) {
-		ret = dpram_read_raw(device, non_cmd);
-		if (ret < 0) {
-			printk(KERN_ERR "%s, dpram_read failed\n", __func__);
-			/* TODO: ... wrong.. */
+	int work = 0;
+
+	spin_lock_irqsave(&raw_rx_lock, flags);
+	non_cmd = tasklet_data->non_cmd;
+	tasklet_data->non_cmd = 0;
+	spin_unlock_irqrestore(&raw_rx_lock, flags);
+
+	raw_rx_stat.polls++;
+
+	while (work < budget && dpram_get_read_available(device)) {
+		ret = dpram_read_raw(device, non_cmd, budget - work);
+		if (ret <= 0) {
+			if (ret < 0)
+				printk(KERN_ERR "%s, dpram_read failed\n", __func__);
+			break;
+		}
+		work += ret;
+		/* RES_ACK_R goes out once, with the first frames read */
+		non_cmd &= ~device->mask_req_ack;
+	}
+
+	/* the frames asked about were read by an earlier run */
+	if (non_cmd & device->mask_req_ack)
+		send_interrupt_to_phone_with_semaphore(INT_NON_COMMAND(device->mask_res_ack));
+
+	if (work >= budget) {
+		/* leave the rest to another run, other softirqs get their turn */
+		raw_rx_stat.repolls++;
+		tasklet_hi_schedule(&raw_send_tasklet);
+		return;
+	}
+
+	spin_lock_irqsave(&raw_rx_lock, flags);
+	raw_rx_polling = 0;
+	non_cmd = tasklet_data->non_cmd;
+	spin_unlock_irqrestore(&raw_rx_lock, flags);
+
+	/* an interrupt which came in before polling was cleared has been swallowed */
+	if ((non_cmd & device->mask_req_ack) || dpram_get_read_available(device)) {
+		spin_lock_irqsave(&raw_rx_lock, flags);
+		if (!raw_rx_polling) {
+			raw_rx_polling = 1;
+			tasklet_hi_schedule(&raw_send_tasklet);
 		}
+		spin_unlock_irqrestore(&raw_rx_lock, flags);
 	}
 }
 
@@ -1926,11 +2308,22 @@ static void non_command_handler(u16 non_cmd)
 		tasklet_schedule(&fmt_send_tasklet);
 	}
 	if (non_cmd & INT_MASK_SEND_R) {
+		unsigned long flags;
+
+		spin_lock_irqsave(&raw_rx_lock, flags);
+		raw_rx_stat.interrupts++;
 		dpram_tasklet_data[RAW_INDEX].device = &dpram_table[RAW_INDEX];
-		dpram_tasklet_data[RAW_INDEX].non_cmd = non_cmd;
+		dpram_tasklet_data[RAW_INDEX].non_cmd |= non_cmd;
 		raw_send_tasklet.data = (unsigned long)&dpram_tasklet_data[RAW_INDEX];
-		/* @LDK@ raw buffer op. -> soft irq level. */
-		tasklet_hi_schedule(&raw_send_tasklet);
+		if (raw_rx_polling) {
+			/* the pending poll reads this data too */
+			raw_rx_stat.mitigated++;
+		} else {
+			raw_rx_polling = 1;
+			/* @LDK@ raw buffer op. -> soft irq level. */
+			tasklet_hi_schedule(&raw_send_tasklet);
+		}
+		spin_unlock_irqrestore(&raw_rx_lock, flags);
 	}
 
 	if (non_cmd & INT_MASK_RES_ACK_F) {
@@ -2263,44 +2656,14 @@ static void vs_close(struct tty_struct *tty, struct file *filp)
 static int pdp_mux(struct pdp_info *dev, const void *data, size_t len   )
 {
 	int ret;
-	size_t nbytes;
-	u8 *tx_buf;
-	struct pdp_hdr *hdr;
-	const u8 *buf;
 
-	tx_buf = dev->tx_buf;
-	hdr = (struct pdp_hdr *)(tx_buf + 1);
-	buf = data;
+	ret = dpram_write_pdp(&dpram_table[RAW_INDEX], dev->id, data, len);
 
-	hdr->id = dev->id;
-	hdr->control = 0;
-
-	while (len) {
-		if (len > MAX_PDP_DATA_LEN) {
-			nbytes = MAX_PDP_DATA_LEN;
-		} else {
-			nbytes = len;
-		}
-		hdr->len = nbytes + sizeof(struct pdp_hdr);
-
-		tx_buf[0] = 0x7f;
-		
-		memcpy(tx_buf + 1 + sizeof(struct pdp_hdr), buf,  nbytes);
-		
-		tx_buf[1 + hdr->len] = 0x7e;
-
-//		printk(KERN_ERR "hdr->id: %d, hdr->len: %d\n", hdr->id, hdr->len);
-		
-		ret = dpram_write(&dpram_table[RAW_INDEX], tx_buf, hdr->len + 2);
-
-		if (ret < 0) {
-			printk(KERN_ERR "write_to_dpram() failed: %d\n", ret);
-			return ret;
-		}
-		buf += nbytes;
-		len -= nbytes;
+	if (ret < 0) {
+		printk(KERN_ERR "dpram_write_pdp() failed: %d\n", ret);
 	}
-	return 0;
+
+	return ret;
 }
 
 
@@ -2310,12 +2673,9 @@ static int vs_write(struct tty_struct *tty,
 	int ret;
 	struct pdp_info *dev = (struct pdp_info *)tty->driver_data;
 
+	/* a short count makes the line discipline wait for the RES_ACK_R wakeup */
 	ret = pdp_mux(dev, buf, count);
 
-	if (ret == 0) {
-		ret = count;
-	}
-
 	return ret;
 }
 
@@ -2468,7 +2828,7 @@ static int pdp_activate(pdp_arg_t *pdp_arg, unsigned type, unsigned flags)
 
 	printk(KERN_ERR "%s, id: %d\n", __func__, pdp_arg->id);
 
-	dev = kmalloc(sizeof(struct pdp_info) + MAX_PDP_PACKET_LEN, GFP_KERNEL);
+	dev = kmalloc(sizeof(struct pdp_info), GFP_KERNEL);
 	if (dev == NULL) {
 		printk(KERN_ERR "out of memory\n");
 		return -ENOMEM;
@@ -2479,7 +2839,6 @@ static int pdp_activate(pdp_arg_t *pdp_arg, unsigned type, unsigned flags)
 
 	dev->type = type;
 	dev->flags = flags;
-	dev->tx_buf = (u8 *)(dev + 1);
 
 	if (type == DEV_TYPE_SERIAL) {
 		init_MUTEX(&dev->vs_dev.write_lock);
@@ -2747,6 +3106,17 @@ static int __devinit dpram_probe(struct platform_device *dev)
 	}
 #ifdef CONFIG_PROC_FS
 	create_proc_read_entry(DRIVER_PROC_ENTRY, 0, 0, dpram_read_proc, NULL);
+#ifdef CONFIG_DEBUG_BENCH
+	{
+		struct proc_dir_entry *ent;
+
+		ent = create_proc_entry(LOOPBACK_PROC_ENTRY, 0600, NULL);
+		if (ent) {
+			ent->read_proc = dpram_loopback_read_proc;
+			ent->write_proc = dpram_loopback_write_proc;
+		}
+	}
+#endif
 #endif	/* CONFIG_PROC_FS */
 
 	/* @LDK@ check out missing interrupt from the phone */
@@ -2774,6 +3144,13 @@ static int __devexit dpram_remove(struct platform_device *dev)
 
 	kill_tasklets();
 
+#ifdef CONFIG_PROC_FS
+#ifdef CONFIG_DEBUG_BENCH
+	remove_proc_entry(LOOPBACK_PROC_ENTRY, NULL);
+#endif
+	remove_proc_entry(DRIVER_PROC_ENTRY, NULL);
+#endif	/* CONFIG_PROC_FS */
+
 	return 0;
 }
 
@@ -36,12 +36,19 @@
 
 #include "binder.h"
 
+/*
+ * binder_lock still protects the node/ref trees, the todo lists and the
+ * thread state of every proc.  Only the buffer allocator is split out,
+ * under proc->alloc_lock; binder_transaction() drops binder_lock around
+ * the allocation and parcel copy while the target holds a tmp_ref.
+ */
 static DEFINE_MUTEX(binder_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
+static DECLARE_WAIT_QUEUE_HEAD(binder_tmp_ref_wait);
 
 static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
@@ -80,6 +87,10 @@ BINDER_DEBUG_ENTRY(proc);
 
 #define BINDER_SMALL_BUF_SIZE (PAGE_SIZE * 64)
 
+/* free buffers are kept in power-of-two size classes, 32 bytes to 4M */
+#define BINDER_MIN_CLASS_SHIFT              5
+#define BINDER_FREE_CLASSES                 (22 - BINDER_MIN_CLASS_SHIFT + 1)
+
 enum {
 	BINDER_DEBUG_USER_ERROR             = 1U << 0,
 	BINDER_DEBUG_FAILED_TRANSACTION     = 1U << 1,
@@ -105,6 +116,10 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+static int binder_page_cache_max = 8;
+module_param_named(page_cache_max, binder_page_cache_max,
+		   int, S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -134,6 +149,15 @@ module_param_call(stop_on_user_error, binder_set_stop_on_user_error,
 			binder_stop_on_user_error = 2; \
 	} while (0)
 
+enum binder_alloc_stat_types {
+	BINDER_ALLOC_CLASS_HIT,
+	BINDER_ALLOC_CLASS_MISS,
+	BINDER_ALLOC_PAGE_CACHE_HIT,
+	BINDER_ALLOC_PAGE_MAP,
+	BINDER_ALLOC_PAGE_UNMAP,
+	BINDER_ALLOC_STAT_COUNT
+};
+
 enum binder_stat_types {
 	BINDER_STAT_PROC,
 	BINDER_STAT_THREAD,
@@ -150,6 +174,7 @@ struct binder_stats {
 	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
 	int obj_created[BINDER_STAT_COUNT];
 	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t alloc[BINDER_ALLOC_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
@@ -258,8 +283,10 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct list_head free_entry; /* free entry by size class */
+		struct rb_node rb_node; /* allocated entry by address */
+	};
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
@@ -294,9 +321,12 @@ struct binder_proc {
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
+	struct mutex alloc_lock;
 	struct list_head buffers;
-	struct rb_root free_buffers;
+	struct list_head free_buffers[BINDER_FREE_CLASSES];
+	unsigned long free_classes;
 	struct rb_root allocated_buffers;
+	int cached_pages;
 	size_t free_async_space;
 
 	struct page **pages;
@@ -312,6 +342,8 @@ struct binder_proc {
 	int ready_threads;
 	long default_priority;
 	struct dentry *debugfs_entry;
+	int tmp_ref;
+	int is_dead;
 };
 
 enum {
@@ -525,14 +557,22 @@ static size_t binder_buffer_size(struct binder_proc *proc,
 			struct binder_buffer, entry) - (size_t)buffer->data;
 }
 
+static int binder_size_class(size_t size)
+{
+	int class = fls(size) - 1 - BINDER_MIN_CLASS_SHIFT;
+
+	if (class < 0)
+		return 0;
+	if (class >= BINDER_FREE_CLASSES)
+		return BINDER_FREE_CLASSES - 1;
+	return class;
+}
+
 static void binder_insert_free_buffer(struct binder_proc *proc,
 				      struct binder_buffer *new_buffer)
 {
-	struct rb_node **p = &proc->free_buffers.rb_node;
-	struct rb_node *parent = NULL;
-	struct binder_buffer *buffer;
-	size_t buffer_size;
 	size_t new_buffer_size;
+	int class;
 
 	BUG_ON(!new_buffer->free);
 
@@ -542,20 +582,29 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 		     "binder: %d: add free buffer, size %zd, "
 		     "at %p\n", proc->pid, new_buffer_size, new_buffer);
 
-	while (*p) {
-		parent = *p;
-		buffer = rb_entry(parent, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
+	class = binder_size_class(new_buffer_size);
+	list_add(&new_buffer->free_entry, &proc->free_buffers[class]);
+	__set_bit(class, &proc->free_classes);
+}
 
-		buffer_size = binder_buffer_size(proc, buffer);
+/* must be called before the size of buffer changes */
+static void binder_erase_free_buffer(struct binder_proc *proc,
+				     struct binder_buffer *buffer)
+{
+	int class = binder_size_class(binder_buffer_size(proc, buffer));
 
-		if (new_buffer_size < buffer_size)
-			p = &parent->rb_left;
-		else
-			p = &parent->rb_right;
-	}
-	rb_link_node(&new_buffer->rb_node, parent, p);
-	rb_insert_color(&new_buffer->rb_node, &proc->free_buffers);
+	BUG_ON(!buffer->free);
+	list_del(&buffer->free_entry);
+	if (list_empty(&proc->free_buffers[class]))
+		__clear_bit(class, &proc->free_classes);
+}
+
+static inline void binder_alloc_stat(struct binder_proc *proc,
+				     enum binder_alloc_stat_types type)
+{
+	/* only proc->alloc_lock is held here; other procs bump the globals too */
+	atomic_inc(&binder_stats.alloc[type]);
+	atomic_inc(&proc->stats.alloc[type]);
 }
 
 static void binder_insert_allocated_buffer(struct binder_proc *proc,
@@ -586,13 +635,15 @@ static void binder_insert_allocated_buffer(struct binder_proc *proc,
 static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 						  void __user *user_ptr)
 {
-	struct rb_node *n = proc->allocated_buffers.rb_node;
+	struct rb_node *n;
 	struct binder_buffer *buffer;
 	struct binder_buffer *kern_ptr;
 
 	kern_ptr = user_ptr - proc->user_buffer_offset
 		- offsetof(struct binder_buffer, data);
 
+	mutex_lock(&proc->alloc_lock);
+	n = proc->allocated_buffers.rb_node;
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(buffer->free);
@@ -601,9 +652,12 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 			n = n->rb_left;
 		else if (kern_ptr > buffer)
 			n = n->rb_right;
-		else
+		else {
+			mutex_unlock(&proc->alloc_lock);
 			return buffer;
+		}
 	}
+	mutex_unlock(&proc->alloc_lock);
 	return NULL;
 }
 
@@ -612,6 +666,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    struct vm_area_struct *vma)
 {
 	void *page_addr;
+	void *cache_start = start;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
 	struct page **page;
@@ -624,6 +679,28 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
+	/*
+	 * Up to page_cache_max freed pages per proc stay mapped, so that
+	 * small buffers can reuse them without going through
+	 * map_vm_area() and vm_insert_page() (and mmap_sem) again.
+	 */
+	if (allocate == 0) {
+		while (start < end &&
+		       proc->cached_pages < binder_page_cache_max) {
+			proc->cached_pages++;
+			start += PAGE_SIZE;
+		}
+	} else {
+		while (start < end &&
+		       proc->pages[(start - proc->buffer) / PAGE_SIZE]) {
+			proc->cached_pages--;
+			binder_alloc_stat(proc, BINDER_ALLOC_PAGE_CACHE_HIT);
+			start += PAGE_SIZE;
+		}
+	}
+	if (end <= start)
+		return 0;
+
 	if (vma)
 		mm = NULL;
 	else
@@ -648,7 +725,12 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
+		if (*page) {
+			/* left mapped by an earlier free */
+			proc->cached_pages--;
+			binder_alloc_stat(proc, BINDER_ALLOC_PAGE_CACHE_HIT);
+			continue;
+		}
 		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
 		if (*page == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -675,6 +757,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 			goto err_vm_insert_page_failed;
 		}
 		/* vm_insert_page does not seem to increment the refcount */
+		binder_alloc_stat(proc, BINDER_ALLOC_PAGE_MAP);
 	}
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -686,6 +769,7 @@ free_range:
 	for (page_addr = end - PAGE_SIZE; page_addr >= start;
 	     page_addr -= PAGE_SIZE) {
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		binder_alloc_stat(proc, BINDER_ALLOC_PAGE_UNMAP);
 		if (vma)
 			zap_page_range(vma, (uintptr_t)page_addr +
 				proc->user_buffer_offset, PAGE_SIZE, NULL);
@@ -698,6 +782,10 @@ err_alloc_page_failed:
 		;
 	}
 err_no_vma:
+	if (allocate) {
+		/* the cached pages we skipped over are still unused */
+		proc->cached_pages += (start - cache_start) / PAGE_SIZE;
+	}
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
@@ -705,14 +793,15 @@ err_no_vma:
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+static struct binder_buffer *__binder_alloc_buf(struct binder_proc *proc,
+						size_t data_size,
+						size_t offsets_size,
+						int is_async)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
-	struct binder_buffer *buffer;
+	struct binder_buffer *buffer = NULL;
+	struct binder_buffer *tmp;
 	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
+	int class;
 	void *has_page_addr;
 	void *end_page_addr;
 	size_t size;
@@ -740,30 +829,33 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
-	while (n) {
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
-		buffer_size = binder_buffer_size(proc, buffer);
-
-		if (size < buffer_size) {
-			best_fit = n;
-			n = n->rb_left;
-		} else if (size > buffer_size)
-			n = n->rb_right;
-		else {
-			best_fit = n;
+	/*
+	 * First fit within the size class of the request; failing that,
+	 * any buffer from the next non-empty class is large enough.
+	 */
+	class = binder_size_class(size);
+	list_for_each_entry(tmp, &proc->free_buffers[class], free_entry) {
+		BUG_ON(!tmp->free);
+		if (binder_buffer_size(proc, tmp) >= size) {
+			buffer = tmp;
 			break;
 		}
 	}
-	if (best_fit == NULL) {
-		 printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
- 	               "no address space. buffer_size=%d\n", proc->pid, size, buffer_size);
-		return NULL;
-	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
-		buffer_size = binder_buffer_size(proc, buffer);
+	if (buffer) {
+		binder_alloc_stat(proc, BINDER_ALLOC_CLASS_HIT);
+	} else {
+		class = find_next_bit(&proc->free_classes,
+				      BINDER_FREE_CLASSES, class + 1);
+		if (class >= BINDER_FREE_CLASSES) {
+			printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd "
+			       "failed, no address space\n", proc->pid, size);
+			return NULL;
+		}
+		buffer = list_first_entry(&proc->free_buffers[class],
+					  struct binder_buffer, free_entry);
+		binder_alloc_stat(proc, BINDER_ALLOC_CLASS_MISS);
 	}
+	buffer_size = binder_buffer_size(proc, buffer);
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got buff"
@@ -771,7 +863,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
-	if (n == NULL) {
+	if (buffer_size != size) {
 		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
 			buffer_size = size; /* no room for other buffers */
 		else
@@ -785,8 +877,11 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
 		return NULL;
 
-	rb_erase(best_fit, &proc->free_buffers);
+	binder_erase_free_buffer(proc, buffer);
 	buffer->free = 0;
+	buffer->allow_user_free = 0;
+	buffer->transaction = NULL;
+	buffer->target_node = NULL;
 	binder_insert_allocated_buffer(proc, buffer);
 	if (buffer_size != size) {
 		struct binder_buffer *new_buffer = (void *)buffer->data + size;
@@ -811,6 +906,23 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+/*
+ * The allocator state of a proc is protected by proc->alloc_lock rather
+ * than binder_lock, so that mapping pages for a new transaction buffer
+ * does not hold up every other binder user in the system.
+ */
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = __binder_alloc_buf(proc, data_size, offsets_size, is_async);
+	mutex_unlock(&proc->alloc_lock);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -868,8 +980,8 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void __binder_free_buf(struct binder_proc *proc,
+			      struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
@@ -907,7 +1019,7 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *next = list_entry(buffer->entry.next,
 						struct binder_buffer, entry);
 		if (next->free) {
-			rb_erase(&next->rb_node, &proc->free_buffers);
+			binder_erase_free_buffer(proc, next);
 			binder_delete_free_buffer(proc, next);
 		}
 	}
@@ -915,14 +1027,22 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *prev = list_entry(buffer->entry.prev,
 						struct binder_buffer, entry);
 		if (prev->free) {
+			binder_erase_free_buffer(proc, prev);
 			binder_delete_free_buffer(proc, buffer);
-			rb_erase(&prev->rb_node, &proc->free_buffers);
 			buffer = prev;
 		}
 	}
 	binder_insert_free_buffer(proc, buffer);
 }
 
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	__binder_free_buf(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   void __user *ptr)
 {
@@ -1375,6 +1495,26 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+static struct binder_thread *binder_find_target_thread(
+	struct binder_thread *thread, struct binder_proc *target_proc)
+{
+	struct binder_transaction *tmp;
+	struct binder_thread *target_thread = NULL;
+
+	for (tmp = thread->transaction_stack; tmp; tmp = tmp->from_parent) {
+		if (tmp->from && tmp->from->proc == target_proc)
+			target_thread = tmp->from;
+	}
+	return target_thread;
+}
+
+static void binder_proc_dec_tmp_ref(struct binder_proc *proc)
+{
+	BUG_ON(proc->tmp_ref <= 0);
+	if (--proc->tmp_ref == 0 && proc->is_dead)
+		wake_up(&binder_tmp_ref_wait);
+}
+
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
 			       struct binder_transaction_data *tr, int reply)
@@ -1481,13 +1621,15 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
-			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
-				tmp = tmp->from_parent;
-			}
+			target_thread = binder_find_target_thread(thread,
+								  target_proc);
 		}
 	}
+	if (target_proc->is_dead) {
+		return_error = BR_DEAD_REPLY;
+		goto err_dead_binder;
+	}
+	target_proc->tmp_ref++;
 	if (target_thread) {
 		e->to_thread = target_thread->pid;
 		target_list = &target_thread->todo;
@@ -1543,33 +1685,66 @@ static void binder_transaction(struct binder_proc *proc,
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
+	if (target_node)
+		binder_inc_node(target_node, 1, 0, NULL);
+
+	/*
+	 * Nothing else can see t or its buffer until it is queued below, and
+	 * target_proc is pinned by tmp_ref, so allocate the buffer and copy
+	 * the parcel in without holding binder_lock.
+	 */
+	mutex_unlock(&binder_lock);
+
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
+		mutex_lock(&binder_lock);
+		if (target_node)
+			binder_dec_node(target_node, 1, 0);
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
 	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
+		mutex_lock(&binder_lock);
 		binder_user_error("binder: %d:%d got transaction with invalid "
 			"data ptr\n", proc->pid, thread->pid);
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
 	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
+		mutex_lock(&binder_lock);
 		binder_user_error("binder: %d:%d got transaction with invalid "
 			"offsets ptr\n", proc->pid, thread->pid);
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
+	mutex_lock(&binder_lock);
+
+	/* the target threads may have exited while we were unlocked */
+	if (reply) {
+		target_thread = in_reply_to->from;
+		if (target_thread == NULL) {
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_target;
+		}
+	} else if (target_thread) {
+		target_thread = binder_find_target_thread(thread, target_proc);
+		if (target_thread) {
+			target_list = &target_thread->todo;
+			target_wait = &target_thread->wait;
+		} else {
+			target_list = &target_proc->todo;
+			target_wait = &target_proc->wait;
+		}
+		t->to_thread = target_thread;
+	}
+
 	if (!IS_ALIGNED(tr->offsets_size, sizeof(size_t))) {
 		binder_user_error("binder: %d:%d got transaction with "
 			"invalid offsets size, %zd\n",
@@ -1738,6 +1913,7 @@ static void binder_transaction(struct binder_proc *proc,
 	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	binder_proc_dec_tmp_ref(target_proc);
 	return;
 
 err_get_unused_fd_failed:
@@ -1749,6 +1925,7 @@ err_binder_new_node_failed:
 err_bad_object_type:
 err_bad_offset:
 err_copy_data_failed:
+err_dead_target:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
@@ -1759,6 +1936,7 @@ err_alloc_tcomplete_failed:
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 err_alloc_t_failed:
+	binder_proc_dec_tmp_ref(target_proc);
 err_bad_call_stack:
 err_empty_call_stack:
 err_dead_binder:
@@ -2842,6 +3020,10 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		failure_string = "alloc small buf";
 		goto err_alloc_small_buf_failed;
 	}
+	/*
+	 * No alloc_lock needed here: binder_alloc_buf() refuses to touch
+	 * the allocator until proc->vma is set below.
+	 */
 	buffer = proc->buffer;
 	INIT_LIST_HEAD(&proc->buffers);
 	list_add(&buffer->entry, &proc->buffers);
@@ -2873,6 +3055,7 @@ err_bad_arg:
 static int binder_open(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc;
+	int i;
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE, "binder_open: %d:%d\n",
 		     current->group_leader->pid, current->pid);
@@ -2884,6 +3067,9 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
+	mutex_init(&proc->alloc_lock);
+	for (i = 0; i < BINDER_FREE_CLASSES; i++)
+		INIT_LIST_HEAD(&proc->free_buffers[i]);
 	proc->default_priority = task_nice(current);
 	mutex_lock(&binder_lock);
 	binder_stats_created(BINDER_STAT_PROC);
@@ -3013,6 +3199,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 	binder_release_work(&proc->todo);
 	buffers = 0;
 
+	mutex_lock(&proc->alloc_lock);
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
 							rb_node);
@@ -3025,9 +3212,10 @@ static void binder_deferred_release(struct binder_proc *proc)
 			       proc->pid, t->debug_id);
 			/*BUG();*/
 		}
-		binder_free_buf(proc, buffer);
+		__binder_free_buf(proc, buffer);
 		buffers++;
 	}
+	mutex_unlock(&proc->alloc_lock);
 
 	binder_stats_deleted(BINDER_STAT_PROC);
 
@@ -3095,8 +3283,17 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_FLUSH)
 			binder_deferred_flush(proc);
 
-		if (defer & BINDER_DEFERRED_RELEASE)
+		if (defer & BINDER_DEFERRED_RELEASE) {
+			/*
+			 * Refuse new transactions, then wait for the ones
+			 * copying into our buffers without binder_lock.
+			 */
+			proc->is_dead = 1;
+			mutex_unlock(&binder_lock);
+			wait_event(binder_tmp_ref_wait, proc->tmp_ref == 0);
+			mutex_lock(&binder_lock);
 			binder_deferred_release(proc); /* frees proc */
+		}
 
 		mutex_unlock(&binder_lock);
 		if (files)
@@ -3279,9 +3476,11 @@ static void print_binder_proc(struct seq_file *m,
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
 	}
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
 				    rb_entry(n, struct binder_buffer, rb_node));
+	mutex_unlock(&proc->alloc_lock);
 	list_for_each_entry(w, &proc->todo, entry)
 		print_binder_work(m, "  ", "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
@@ -3343,6 +3542,14 @@ static const char *binder_objstat_strings[] = {
 	"transaction_complete"
 };
 
+static const char *binder_alloc_stat_strings[] = {
+	"alloc_class_hit",
+	"alloc_class_miss",
+	"alloc_page_cache_hit",
+	"alloc_page_map",
+	"alloc_page_unmap"
+};
+
 static void print_binder_stats(struct seq_file *m, const char *prefix,
 			       struct binder_stats *stats)
 {
@@ -3375,6 +3582,16 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 				stats->obj_created[i] - stats->obj_deleted[i],
 				stats->obj_created[i]);
 	}
+
+	BUILD_BUG_ON(ARRAY_SIZE(stats->alloc) !=
+		     ARRAY_SIZE(binder_alloc_stat_strings));
+	for (i = 0; i < ARRAY_SIZE(stats->alloc); i++) {
+		int count = atomic_read(&stats->alloc[i]);
+
+		if (count)
+			seq_printf(m, "%s%s: %d\n", prefix,
+				   binder_alloc_stat_strings[i], count);
+	}
 }
 
 static void print_binder_proc_stats(struct seq_file *m,
@@ -3411,9 +3628,12 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
 	seq_printf(m, "  buffers: %d\n", count);
+	seq_printf(m, "  cached pages: %d\n", proc->cached_pages);
+	mutex_unlock(&proc->alloc_lock);
 
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
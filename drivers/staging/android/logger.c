@@ -20,11 +20,16 @@
 #include <linux/sched.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/kthread.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/time.h>
+#include <linux/vmalloc.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -94,30 +99,42 @@ static char klog_buf[256];
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. The offsets and the reader list are
+ * protected by the spinlock 'lock'.
+ *
+ * Writers only hold 'lock' to reserve room for their entry; the payload is
+ * copied in afterwards without it. Readers see the log up to 'c_off', the end
+ * of the oldest run of completed entries.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
+	wait_queue_head_t	commit_wq; /* writers waiting for room */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	spinlock_t		lock;	/* lock protecting offsets */
+	size_t			w_off;	/* current write (reserve) offset */
+	size_t			c_off;	/* end of the committed entries */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	u32			head_pos; /* 'head' counted since boot */
+	u32			tail_pos; /* 'c_off' counted since boot */
+	struct logger_mmap_info	*info;	/* page shared with mmap() */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The offset is protected by log->lock; 'mutex'
+ * serializes readers sharing the file and protects 'buf'.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* serializes read() on this file */
+	unsigned char		*buf;	/* entry copied out under log->lock */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -150,7 +167,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -169,15 +186,46 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * Entries reserved but not yet committed carry LOGGER_ENTRY_PENDING in their
+ * header's __pad, in the ring itself. Readers never see it: 'c_off' does not
+ * move past a pending entry, and committing an entry clears the mark.
+ */
+#define LOGGER_ENTRY_PENDING	1
+
+/*
+ * get_entry_pad / set_entry_pad - access the __pad field of the entry
+ * starting at 'off', which may wrap around the end of the log.
+ *
+ * Caller needs to hold log->lock.
+ */
+static __u16 get_entry_pad(struct logger_log *log, size_t off)
+{
+	size_t pad = off + offsetof(struct logger_entry, __pad);
+	__u16 val;
+
+	((char *) &val)[0] = log->buffer[logger_offset(pad)];
+	((char *) &val)[1] = log->buffer[logger_offset(pad + 1)];
+	return val;
+}
+
+static void set_entry_pad(struct logger_log *log, size_t off, __u16 val)
+{
+	size_t pad = off + offsetof(struct logger_entry, __pad);
+
+	log->buffer[logger_offset(pad)] = ((char *) &val)[0];
+	log->buffer[logger_offset(pad + 1)] = ((char *) &val)[1];
+}
+
+/*
+ * do_read_log - copies exactly 'count' bytes from 'log' into the reader's
+ * bounce buffer and advances its read head.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock. The copy to user space is done afterwards,
+ * without it, so a faulting reader never holds up writers.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static void do_read_log(struct logger_log *log,
+			struct logger_reader *reader,
+			size_t count)
 {
 	size_t len;
 
@@ -187,49 +235,59 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the log, whichever comes first.
 	 */
 	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	memcpy(reader->buf, log->buffer + reader->r_off, len);
 
 	/*
 	 * Second, we read any remaining bytes, starting back at the head of
 	 * the log.
 	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		memcpy(reader->buf + len, log->buffer, count - len);
 
 	reader->r_off = logger_offset(reader->r_off + count);
-
-	return count;
 }
 
 /*
- * logger_read - our log's read() method
+ * do_read_log_to_user - copies 'count' bytes at offset 'off' of 'log' to the
+ * user-space buffer 'buf'.
  *
- * Behavior:
- *
- * 	- O_NONBLOCK works
- * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * Called without log->lock; the caller checks afterwards whether writers
+ * lapped the range while it was being copied.
+ */
+static int do_read_log_to_user(struct logger_log *log, size_t off,
+			       char __user *buf, size_t count)
+{
+	size_t len;
+
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
+		return -EFAULT;
+
+	if (count != len)
+		if (copy_to_user(buf + len, log->buffer, count - len))
+			return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * logger_wait - waits until 'reader' has something to read
  *
- * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * Returns zero once the log is readable, -EAGAIN for O_NONBLOCK files and
+ * -EINTR if interrupted.
  */
-static ssize_t logger_read(struct file *file, char __user *buf,
-			   size_t count, loff_t *pos)
+static int logger_wait(struct file *file, struct logger_reader *reader)
 {
-	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
-	ssize_t ret;
+	int ret;
 	DEFINE_WAIT(wait);
 
-start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = (log->c_off == reader->r_off);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -247,29 +305,60 @@ start:
 	}
 
 	finish_wait(&log->wq, &wait);
+	return ret;
+}
+
+/*
+ * logger_read - our log's read() method
+ *
+ * Behavior:
+ *
+ * 	- O_NONBLOCK works
+ * 	- If there are no log entries to read, blocks until log is written to
+ * 	- Atomically reads exactly one log entry
+ *
+ * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
+ * buffer is insufficient to hold next entry.
+ */
+static ssize_t logger_read(struct file *file, char __user *buf,
+			   size_t count, loff_t *pos)
+{
+	struct logger_reader *reader = file->private_data;
+	struct logger_log *log = reader->log;
+	ssize_t ret;
+
+start:
+	ret = logger_wait(file, reader);
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	if (unlikely(log->c_off == reader->r_off)) {
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
 	/* get the size of the next entry */
 	ret = get_entry_len(log, reader->r_off);
 	if (count < ret) {
+		spin_unlock(&log->lock);
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	do_read_log(log, reader, ret);
+	spin_unlock(&log->lock);
+
+	if (copy_to_user(buf, reader->buf, ret))
+		ret = -EFAULT;
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -278,7 +367,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -316,7 +405,7 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -324,8 +413,12 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (clock_interval(old, new, log->head)) {
+		size_t head = get_next_entry(log, log->head, len);
+
+		log->head_pos += logger_offset(head - log->head);
+		log->head = head;
+	}
 
 	list_for_each_entry(reader, &log->readers, list)
 		if (clock_interval(old, new, reader->r_off))
@@ -333,39 +426,54 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'len' bytes from 'buf' to 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller must own [off, off + count), see logger_reserve().
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off,
+			 const void *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
+}
+
+/*
+ * do_clear_log - zeroes 'count' bytes of 'log' at offset 'off'
+ *
+ * Used to keep a reserved entry well-formed when its payload could not be
+ * copied in. The caller must own [off, off + count).
+ */
+static void do_clear_log(struct logger_log *log, size_t off, size_t count)
+{
+	size_t len;
 
-	log->w_off = logger_offset(log->w_off + count);
+	len = min(count, log->size - off);
+	memset(log->buffer + off, 0, len);
 
+	if (count != len)
+		memset(log->buffer, 0, count - len);
 }
 
 /*
  * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * the log 'log' at offset 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller must own [off, off + count), see logger_reserve().
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
@@ -374,87 +482,227 @@ static ssize_t do_write_log_from_user(struct logger_log *log,
 
 	/* print as kernel log if the log string starts with "!@" */
 	if (count >= 2) {
-		if (log->buffer[log->w_off] == '!'
-		    && log->buffer[logger_offset(log->w_off + 1)] == '@') {
+		if (log->buffer[off] == '!'
+		    && log->buffer[logger_offset(off + 1)] == '@') {
 			char tmp[256];
 			int i;
 			for (i = 0; i < min(count, sizeof(tmp) - 1); i++)
 				tmp[i] =
-				    log->buffer[logger_offset(log->w_off + i)];
+				    log->buffer[logger_offset(off + i)];
 			tmp[i] = '\0';
 			printk("%s\n", tmp);
 		}
 	}
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
 /*
- * logger_aio_write - our write method, implementing support for write(),
- * writev(), and aio_write(). Writes are our fast path, and we try to optimize
- * them above all else.
+ * logger_update_info - publishes head and tail to the mmap() info page
+ *
+ * The caller needs to hold log->lock.
  */
+static void logger_update_info(struct logger_log *log)
+{
+	struct logger_mmap_info *info = log->info;
+
+	if (!info)
+		return;
+
+	info->seq++;
+	smp_wmb();
+	info->head = log->head_pos;
+	info->tail = log->tail_pos;
+	smp_wmb();
+	info->seq++;
+}
+
+/*
+ * logger_has_room - can another 'len' byte entry be reserved?
+ *
+ * Entries still being copied in live in [c_off, w_off) and must never be
+ * lapped, and fix_up_readers() must not walk readers into them. Keeping
+ * some slack on top of 'len' guarantees both.
+ *
+ * The caller needs to hold log->lock.
+ */
+static inline int logger_has_room(struct logger_log *log, size_t len)
+{
+	size_t in_flight = logger_offset(log->w_off - log->c_off);
+
+	return in_flight + len + 2 * LOGGER_ENTRY_MAX_LEN < log->size;
+}
+
+static int logger_check_room(struct logger_log *log, size_t len)
+{
+	int ret;
+
+	spin_lock(&log->lock);
+	ret = logger_has_room(log, len);
+	spin_unlock(&log->lock);
+
+	return ret;
+}
 
 /* cpu currently holding logbuf_lock */
 #ifdef ADD_SYSTEM_TIMEINFO
 static volatile unsigned int logger_cpu = UINT_MAX;
 #endif
 
-ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
-			 unsigned long nr_segs, loff_t ppos)
+/*
+ * logger_reserve - reserves room for the entry described by 'header', stamps
+ * it and writes the header out. Returns the offset for the payload.
+ *
+ * The timestamp is taken under log->lock, so entries lie in the buffer in
+ * timestamp order however their payload copies interleave. Every call must
+ * be paired with logger_commit(), or a successful logger_unreserve().
+ */
+static size_t logger_reserve(struct logger_log *log,
+			     struct logger_entry *header)
 {
-	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
-	struct logger_entry header;
+	size_t len = sizeof(struct logger_entry) + header->len;
 	struct timespec now;
-	ssize_t ret = 0;
-
+	size_t off;
 #ifdef ADD_SYSTEM_TIMEINFO
-	char tbuf[50], *tp;
-	unsigned tlen;
 	unsigned long long t;
 	unsigned long nanosec_rem;
-#endif	
-
+#endif
 
-	now = current_kernel_time();
+	spin_lock(&log->lock);
+	while (unlikely(!logger_has_room(log, len))) {
+		spin_unlock(&log->lock);
+		wait_event(log->commit_wq, logger_check_room(log, len));
+		spin_lock(&log->lock);
+	}
 
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset. We do this now
+	 * because if we partially fail, we can end up with clobbered log
+	 * entries that encroach on readable buffer.
+	 */
+	fix_up_readers(log, len);
+	logger_update_info(log);
 
+	now = current_kernel_time();
+	header->sec = now.tv_sec;
+	header->nsec = now.tv_nsec;
 #ifdef ADD_SYSTEM_TIMEINFO
-	/* Follow the token with the time */
-	memset(tbuf, 0, sizeof(tbuf));
-
 	t = cpu_clock(logger_cpu);
 	nanosec_rem = do_div(t, 1000000000);
-	tlen = sprintf(tbuf, "[%5lu.%06lu] ",
-			(unsigned long) t,
-			nanosec_rem / 1000);
-	header.system_sec = (unsigned long) t;
-	header.system_nsec = nanosec_rem / 1000;
+	header->system_sec = (unsigned long) t;
+	header->system_nsec = nanosec_rem / 1000;
 #endif
+	header->__pad = LOGGER_ENTRY_PENDING;
+	do_write_log(log, log->w_off, header, sizeof(struct logger_entry));
+
+	off = logger_offset(log->w_off + sizeof(struct logger_entry));
+	log->w_off = logger_offset(log->w_off + len);
+	spin_unlock(&log->lock);
+
+	return off;
+}
+
+/*
+ * logger_unreserve - gives back the entry of 'len' bytes reserved at 'off'
+ * when its payload could not be copied in
+ *
+ * Only the last reservation can be taken back. If a later writer already
+ * owns the space after it, the payload is blanked instead, keeping the entry
+ * well-formed. Returns 0 if the entry was taken back; otherwise it must
+ * still be committed with logger_commit().
+ */
+static int logger_unreserve(struct logger_log *log, size_t off, size_t len)
+{
+	int ret = -EBUSY;
+
+	spin_lock(&log->lock);
+	if (log->w_off == logger_offset(off + len)) {
+		log->w_off = off;
+		ret = 0;
+	}
+	spin_unlock(&log->lock);
+
+	if (ret)
+		do_clear_log(log, logger_offset(off + sizeof(struct logger_entry)),
+			     len - sizeof(struct logger_entry));
+	else if (waitqueue_active(&log->commit_wq))
+		wake_up(&log->commit_wq);
+	return ret;
+}
+
+/*
+ * logger_commit - marks the entry reserved at 'off' as complete
+ *
+ * 'c_off' then advances over every completed entry in front of it, so each
+ * entry becomes visible to readers as soon as it and all older ones are in,
+ * however long a later writer takes.
+ */
+static void logger_commit(struct logger_log *log, size_t off)
+{
+	int done = 0;
+
+	spin_lock(&log->lock);
+	set_entry_pad(log, off, 0);
+	while (log->c_off != log->w_off &&
+	       get_entry_pad(log, log->c_off) != LOGGER_ENTRY_PENDING) {
+		size_t len = get_entry_len(log, log->c_off);
+
+		log->c_off = logger_offset(log->c_off + len);
+		log->tail_pos += len;
+		done = 1;
+	}
+	if (done)
+		logger_update_info(log);
+	spin_unlock(&log->lock);
+
+	if (done) {
+		/* wake up any blocked readers, and writers waiting for room */
+		wake_up_interruptible(&log->wq);
+		if (waitqueue_active(&log->commit_wq))
+			wake_up(&log->commit_wq);
+	}
+}
+
+/*
+ * logger_aio_write - our write method, implementing support for write(),
+ * writev(), and aio_write(). Writes are our fast path, and we try to optimize
+ * them above all else.
+ */
+
+ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
+			 unsigned long nr_segs, loff_t ppos)
+{
+	struct logger_log *log = file_get_log(iocb->ki_filp);
+	struct logger_entry header;
+	const struct iovec *seg;
+	unsigned long n;
+	size_t start, off, left;
+	ssize_t ret = 0;
+
+	header.pid = current->tgid;
+	header.tid = current->pid;
+	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Fault the payload in before reserving, so that a bad buffer fails
+	 * the write without touching the log and a copy fault after
+	 * logger_reserve() stays a rare race.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	for (seg = iov, n = nr_segs, left = header.len; n && left; seg++, n--) {
+		size_t len = min_t(size_t, seg->iov_len, left);
+
+		if (len && fault_in_pages_readable(seg->iov_base, len))
+			return -EFAULT;
+		left -= len;
+	}
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	off = logger_reserve(log, &header);
+	start = logger_offset(off - sizeof(struct logger_entry));
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -464,21 +712,22 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, off, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			if (!logger_unreserve(log, start,
+					      sizeof(struct logger_entry) +
+					      header.len))
+				return nr;
+			ret = nr;
+			break;
 		}
 
+		off = logger_offset(off + nr);
 		iov++;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	logger_commit(log, start);
 
 	return ret;
 }
@@ -510,13 +759,20 @@ static int logger_open(struct inode *inode, struct file *file)
 		if (!reader)
 			return -ENOMEM;
 
+		reader->buf = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->buf) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
+		mutex_init(&reader->mutex);
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -534,7 +790,12 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
+		kfree(reader->buf);
 		kfree(reader);
 	}
 
@@ -564,10 +825,146 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	if (log->c_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
+
+	return ret;
+}
+
+/*
+ * logger_read_batch - LOGGER_READ_BATCH, read() for many entries at once
+ *
+ * The entries are copied straight out of the ring without log->lock, so
+ * afterwards we check whether writers lapped them in the meantime. If so,
+ * whatever is still intact is read again.
+ */
+static long logger_read_batch(struct file *file,
+			      struct logger_read_batch __user *ubatch)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	struct logger_read_batch batch;
+	size_t start, off, len;
+	u32 pos, lapped;
+	int count;
+	long ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+
+start:
+	ret = logger_wait(file, reader);
+	if (ret)
+		return ret;
+
+	mutex_lock(&reader->mutex);
+retry:
+	spin_lock(&log->lock);
+
+	/* is there still something to read or did we race? */
+	if (unlikely(log->c_off == reader->r_off)) {
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->mutex);
+		goto start;
+	}
+
+	start = off = reader->r_off;
+	pos = log->tail_pos - logger_offset(log->c_off - start);
+	len = 0;
+	count = 0;
+	while (off != log->c_off) {
+		size_t n = get_entry_len(log, off);
+
+		if (len + n > batch.len)
+			break;
+		len += n;
+		count++;
+		off = logger_offset(off + n);
+	}
+	if (!count) {
+		spin_unlock(&log->lock);
+		ret = -EINVAL;
+		goto out;
+	}
+	reader->r_off = off;
+	spin_unlock(&log->lock);
+
+	ret = do_read_log_to_user(log, start,
+				  (char __user *)(unsigned long) batch.buf, len);
+
+	spin_lock(&log->lock);
+	lapped = log->head_pos - pos;
+	if ((s32) lapped > 0 && lapped < len) {
+		/* the tail of what we copied is still there */
+		reader->r_off = log->head;
+	}
+	spin_unlock(&log->lock);
+	if ((s32) lapped > 0)
+		goto retry;
+
+	if (ret)
+		goto out;
+	if (put_user(count, &ubatch->count))
+		ret = -EFAULT;
+	else
+		ret = len;
+
+out:
+	mutex_unlock(&reader->mutex);
+
+	return ret;
+}
+
+static unsigned long logger_buf_pfn(const void *addr)
+{
+	if (virt_addr_valid(addr))
+		return virt_to_phys(addr) >> PAGE_SHIFT;
+	return vmalloc_to_pfn(addr);
+}
+
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the logger_mmap_info page followed by the ring buffer, read-only.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long len = vma->vm_end - vma->vm_start;
+	unsigned long off;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (vma->vm_pgoff || len > PAGE_SIZE + log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (!log->info)
+		return -ENOMEM;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(log->info) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+
+	/*
+	 * Built as a module, the buffer is in module space and not
+	 * physically contiguous, so it is mapped a page at a time.
+	 */
+	for (off = 0; !ret && off < len - PAGE_SIZE; off += PAGE_SIZE)
+		ret = remap_pfn_range(vma, vma->vm_start + PAGE_SIZE + off,
+				      logger_buf_pfn(log->buffer + off),
+				      PAGE_SIZE, vma->vm_page_prot);
 
 	return ret;
 }
@@ -578,7 +975,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	if (cmd == LOGGER_READ_BATCH)
+		return logger_read_batch(file, (void __user *) arg);
+
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -590,10 +990,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
+		if (log->c_off >= reader->r_off)
+			ret = log->c_off - reader->r_off;
 		else
-			ret = (log->size - reader->r_off) + log->w_off;
+			ret = (log->size - reader->r_off) + log->c_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -601,7 +1001,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
+		if (log->c_off != reader->r_off)
 			ret = get_entry_len(log, reader->r_off);
 		else
 			ret = 0;
@@ -612,13 +1012,15 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+			reader->r_off = log->c_off;
+		log->head = log->c_off;
+		log->head_pos = log->tail_pos;
+		logger_update_info(log);
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -628,6 +1030,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -640,7 +1043,7 @@ static const struct file_operations logger_fops = {
  * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -650,9 +1053,11 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
+	.commit_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .commit_wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.c_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -681,14 +1086,136 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+#ifdef CONFIG_DEBUG_BENCH
+/*
+ * Writing N to the bench parameter runs N kernel threads that each append
+ * BENCH_WRITES entries to a scratch log through logger_reserve() and
+ * logger_commit(), and reports the aggregate writes/sec.
+ */
+#define BENCH_WRITES		20000
+#define BENCH_MAX_WRITERS	16
+#define BENCH_LOG_SIZE		(64 * 1024)
+#define BENCH_PAYLOAD		64
+
+static DEFINE_MUTEX(bench_lock);
+static DECLARE_COMPLETION(bench_done);
+static atomic_t bench_running;
+static int bench_writers;
+static unsigned long bench_rate;
+
+static int logger_bench_thread(void *data)
+{
+	struct logger_log *log = data;
+	struct logger_entry header;
+	char payload[BENCH_PAYLOAD];
+	size_t off;
+	int i;
+
+	memset(payload, 'b', sizeof(payload));
+	header.pid = current->tgid;
+	header.tid = current->pid;
+	for (i = 0; i < BENCH_WRITES; i++) {
+		header.len = sizeof(payload);
+		off = logger_reserve(log, &header);
+		do_write_log(log, off, payload, sizeof(payload));
+		logger_commit(log, logger_offset(off -
+					sizeof(struct logger_entry)));
+	}
+
+	if (atomic_dec_and_test(&bench_running))
+		complete(&bench_done);
+	return 0;
+}
+
+static int bench_set(const char *val, struct kernel_param *kp)
+{
+	struct task_struct **tasks;
+	struct logger_log *log;
+	unsigned long n;
+	ktime_t start;
+	s64 ns;
+	int i, ret = 0;
+
+	if (strict_strtoul(val, 0, &n) || !n || n > BENCH_MAX_WRITERS)
+		return -EINVAL;
+
+	tasks = kcalloc(n, sizeof(*tasks), GFP_KERNEL);
+	log = kzalloc(sizeof(*log), GFP_KERNEL);
+	if (log)
+		log->buffer = vmalloc(BENCH_LOG_SIZE);
+	if (!tasks || !log || !log->buffer) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	init_waitqueue_head(&log->wq);
+	init_waitqueue_head(&log->commit_wq);
+	INIT_LIST_HEAD(&log->readers);
+	spin_lock_init(&log->lock);
+	log->size = BENCH_LOG_SIZE;
+
+	mutex_lock(&bench_lock);
+	for (i = 0; i < n; i++) {
+		tasks[i] = kthread_create(logger_bench_thread, log,
+					  "logger_bench/%d", i);
+		if (IS_ERR(tasks[i])) {
+			ret = PTR_ERR(tasks[i]);
+			while (--i >= 0)
+				kthread_stop(tasks[i]);
+			goto out_unlock;
+		}
+	}
+
+	atomic_set(&bench_running, n);
+	INIT_COMPLETION(bench_done);
+	start = ktime_get();
+	for (i = 0; i < n; i++)
+		wake_up_process(tasks[i]);
+	wait_for_completion(&bench_done);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	bench_writers = n;
+	bench_rate = div64_u64((u64) n * BENCH_WRITES * NSEC_PER_SEC,
+			       ns ? ns : 1);
+	pr_info("logger bench: %d writers, %lu writes/sec\n",
+		bench_writers, bench_rate);
+out_unlock:
+	mutex_unlock(&bench_lock);
+out:
+	if (log)
+		vfree(log->buffer);
+	kfree(log);
+	kfree(tasks);
+	return ret;
+}
+
+static int bench_get(char *buffer, struct kernel_param *kp)
+{
+	int ret;
+
+	mutex_lock(&bench_lock);
+	ret = sprintf(buffer, "%d writers, %lu writes/sec", bench_writers,
+		      bench_rate);
+	mutex_unlock(&bench_lock);
+	return ret;
+}
+module_param_call(bench, bench_set, bench_get, NULL, S_IRUGO | S_IWUSR);
+#endif /* CONFIG_DEBUG_BENCH */
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	/* without the info page the log just can't be mmap()ed */
+	log->info = (struct logger_mmap_info *) get_zeroed_page(GFP_KERNEL);
+	if (log->info)
+		log->info->size = log->size;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 				"device for log '%s'!\n", log->misc.name);
+		free_page((unsigned long) log->info);
+		log->info = NULL;
 		return ret;
 	}
 
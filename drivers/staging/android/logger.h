@@ -52,11 +52,42 @@ struct logger_entry {
 #define LOGGER_ENTRY_MAX_PAYLOAD	\
 	(LOGGER_ENTRY_MAX_LEN - sizeof(struct logger_entry))
 
+/*
+ * mmap() of a log device, read-only: a struct logger_mmap_info page at
+ * offset 0, followed by the ring buffer itself.
+ *
+ * 'head' and 'tail' are byte positions counted since boot; the ring offset
+ * of a position is (pos & (size - 1)). Entries in [head, tail) are intact.
+ * 'seq' is odd while the kernel updates the page; readers retry if it was
+ * odd or changed across their snapshot, and after copying entries out they
+ * must check that 'head' has not moved past the first byte they copied.
+ */
+struct logger_mmap_info {
+	__u32		seq;	/* update sequence count */
+	__u32		size;	/* size of the ring buffer, a power of two */
+	__u32		head;	/* position of the oldest intact entry */
+	__u32		tail;	/* position just past the newest entry */
+};
+
+/*
+ * LOGGER_READ_BATCH copies as many whole entries as fit into 'buf' and
+ * returns the number of bytes copied; 'count' is set to the number of
+ * entries. Blocks like read() unless the file is O_NONBLOCK. 'buf' is a
+ * fixed 64 bits wide so that 32-bit callers work on a 64-bit kernel.
+ */
+struct logger_read_batch {
+	__u64		buf;	/* user buffer, cast to an integer */
+	__u32		len;	/* size of 'buf' */
+	__u32		count;	/* entries returned */
+};
+
 #define __LOGGERIO	0xAE
 
 #define LOGGER_GET_LOG_BUF_SIZE		_IO(__LOGGERIO, 1) /* size of log */
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_READ_BATCH		_IOWR(__LOGGERIO, 5, \
+					struct logger_read_batch)
 
 #endif /* _LINUX_LOGGER_H */
@@ -16,6 +16,10 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept on per-oom_adj lists that fork, exit and oom_adj writes
+ * update as they happen, so picking a victim only looks at the highest
+ * populated list at or above the threshold instead of walking every task.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +39,24 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/vmstat.h>
+#include <linux/math64.h>
+#include <asm/uaccess.h>
+
+#include "lowmemorykiller.h"
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/lowmemorykiller.h>
 
 #define SEC_ADJUST_LMK
 
@@ -57,6 +79,18 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * One list of signal_structs per oom_adj value, OOM_DISABLE..OOM_ADJUST_MAX.
+ * Nothing is indexed until lowmem_index_init() has picked up the processes
+ * that were forked before us; after that the hooks keep it current.
+ */
+#define LOWMEM_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+
+static struct list_head lowmem_buckets[LOWMEM_BUCKETS];
+/* nests inside ->siglock and tasklist_lock, so always taken with irqs off */
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static int lowmem_index_ready;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -79,27 +113,366 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
+static inline struct list_head *lowmem_bucket(int oom_adj)
+{
+	return &lowmem_buckets[oom_adj - OOM_DISABLE];
+}
+
+/* called from copy_process() with tasklist_lock write-held */
+void lowmem_index_add(struct signal_struct *sig)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (lowmem_index_ready)
+		list_add_tail(&sig->lowmem_node, lowmem_bucket(sig->oom_adj));
+	else
+		INIT_LIST_HEAD(&sig->lowmem_node);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/* called from __exit_signal() for the last thread, ->siglock held */
+void lowmem_index_del(struct signal_struct *sig)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (lowmem_index_ready)
+		list_del_init(&sig->lowmem_node);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+/* called from the /proc/<pid>/oom_adj writer, ->siglock held */
+void lowmem_index_adj(struct signal_struct *sig, int oom_adj)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (lowmem_index_ready && !list_empty(&sig->lowmem_node))
+		list_move_tail(&sig->lowmem_node, lowmem_bucket(oom_adj));
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+}
+
+static void __init lowmem_index_init(void)
+{
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+
+	/* tasklist_lock keeps fork and exit out while we catch up */
+	write_lock_irq(&tasklist_lock);
+	spin_lock(&lowmem_index_lock);
+	for_each_process(p)
+		list_add_tail(&p->signal->lowmem_node,
+			      lowmem_bucket(p->signal->oom_adj));
+	lowmem_index_ready = 1;
+	spin_unlock(&lowmem_index_lock);
+	write_unlock_irq(&tasklist_lock);
+}
+
+static void lowmem_other_pages(int *other_free, int *other_file)
+{
+	*other_free = global_page_state(NR_FREE_PAGES);
+#ifdef SEC_ADJUST_LMK
+	*other_file = global_page_state(NR_INACTIVE_FILE) +
+			global_page_state(NR_ACTIVE_FILE);
+#else
+	*other_file = global_page_state(NR_FILE_PAGES) -
+			global_page_state(NR_SHMEM);
+#endif
+}
+
+/*
+ * /dev/lowmem_notify lets userspace hear about memory pressure before we
+ * have to kill anything. The pressure level follows the minfree thresholds
+ * offset by notify_margin pages; every level change bumps the sequence
+ * number and wakes readers. The level is re-evaluated from the shrinker,
+ * on read/poll, and once a second while it is non-zero so that recovery
+ * is reported even after vmscan has gone quiet.
+ */
+static unsigned int lowmem_notify_margin = 1024;	/* 4MB */
+static struct lowmem_pressure lowmem_pressure = {
+	.min_adj = OOM_ADJUST_MAX + 1,
+};
+static DEFINE_SPINLOCK(lowmem_notify_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_notify_wait);
+static unsigned long lowmem_steal_last;
+static unsigned long lowmem_steal_jiffies;
+
+static void lowmem_notify_work_func(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_notify_work, lowmem_notify_work_func);
+
+struct lowmem_notify_reader {
+	u32 seq;	/* last sequence number handed to this reader */
+};
+
+/* Pages reclaimed from all zones since boot. Might sleep. */
+static unsigned long lowmem_pgsteal(void)
+{
+	unsigned long steal = 0;
+#ifdef CONFIG_VM_EVENT_COUNTERS
+	unsigned long events[NR_VM_EVENT_ITEMS];
+
+	all_vm_events(events);
+#ifdef CONFIG_ZONE_DMA
+	steal += events[PGSTEAL_DMA];
+#endif
+#ifdef CONFIG_ZONE_DMA32
+	steal += events[PGSTEAL_DMA32];
+#endif
+	steal += events[PGSTEAL_NORMAL];
+#ifdef CONFIG_HIGHMEM
+	steal += events[PGSTEAL_HIGH];
+#endif
+	steal += events[PGSTEAL_MOVABLE];
+#endif
+	return steal;
+}
+
+static void lowmem_notify_update(int other_free, int other_file)
+{
+	int i;
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	int level = 0;
+	int min_adj = OOM_ADJUST_MAX + 1;
+	size_t minfree = 0;
+	unsigned long now = jiffies;
+	unsigned long steal = 0;
+	int sampled = 0;
+	int changed = 0;
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+		size_t limit = lowmem_minfree[i] + lowmem_notify_margin;
+#ifdef SEC_ADJUST_LMK
+		if ((other_free + other_file) < limit)
+#else
+		if (other_free < limit && other_file < limit)
+#endif
+		{
+			level = array_size - i;
+			min_adj = lowmem_adj[i];
+			minfree = lowmem_minfree[i];
+			break;
+		}
+	}
+
+	/* sampled unlocked, since summing the event counters can sleep */
+	if (!lowmem_steal_jiffies ||
+	    time_after_eq(now, lowmem_steal_jiffies + HZ)) {
+		steal = lowmem_pgsteal();
+		sampled = 1;
+	}
+
+	spin_lock(&lowmem_notify_lock);
+	if (sampled && (!lowmem_steal_jiffies ||
+			time_after_eq(now, lowmem_steal_jiffies + HZ))) {
+		if (lowmem_steal_jiffies)
+			lowmem_pressure.reclaim_rate =
+				div_u64((u64)(steal - lowmem_steal_last) * HZ,
+					now - lowmem_steal_jiffies);
+		lowmem_steal_last = steal;
+		lowmem_steal_jiffies = now;
+	}
+	lowmem_pressure.free_pages = other_free;
+	lowmem_pressure.file_pages = other_file;
+	if (level != lowmem_pressure.level) {
+		lowmem_pressure.seq++;
+		lowmem_pressure.level = level;
+		lowmem_pressure.min_adj = min_adj;
+		lowmem_pressure.minfree = minfree;
+		changed = 1;
+	}
+	spin_unlock(&lowmem_notify_lock);
+
+	if (changed) {
+		lowmem_print(3, "lowmem_notify level %d, ofree %d %d, ma %d\n",
+			     level, other_free, other_file, min_adj);
+		wake_up_interruptible(&lowmem_notify_wait);
+		if (level)
+			schedule_delayed_work(&lowmem_notify_work, HZ);
+	}
+}
+
+static void lowmem_notify_refresh(void)
+{
+	int other_free;
+	int other_file;
+
+	lowmem_other_pages(&other_free, &other_file);
+	lowmem_notify_update(other_free, other_file);
+}
+
+static void lowmem_notify_work_func(struct work_struct *work)
+{
+	lowmem_notify_refresh();
+	if (lowmem_pressure.level)
+		schedule_delayed_work(&lowmem_notify_work, HZ);
+}
+
+static int lowmem_notify_pending(struct lowmem_notify_reader *reader)
+{
+	int ret;
+
+	spin_lock(&lowmem_notify_lock);
+	ret = reader->seq != lowmem_pressure.seq;
+	spin_unlock(&lowmem_notify_lock);
+	return ret;
+}
+
+static int lowmem_notify_open(struct inode *inode, struct file *file)
+{
+	struct lowmem_notify_reader *reader;
+
+	reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	/* the first read always reports the current state */
+	spin_lock(&lowmem_notify_lock);
+	reader->seq = lowmem_pressure.seq - 1;
+	spin_unlock(&lowmem_notify_lock);
+	file->private_data = reader;
+	return nonseekable_open(inode, file);
+}
+
+static int lowmem_notify_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t lowmem_notify_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *pos)
+{
+	struct lowmem_notify_reader *reader = file->private_data;
+	struct lowmem_pressure pressure;
+	int ret;
+
+	if (count < sizeof(pressure))
+		return -EINVAL;
+
+	lowmem_notify_refresh();
+	if (!lowmem_notify_pending(reader)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(lowmem_notify_wait,
+					       lowmem_notify_pending(reader));
+		if (ret)
+			return ret;
+	}
+
+	spin_lock(&lowmem_notify_lock);
+	pressure = lowmem_pressure;
+	spin_unlock(&lowmem_notify_lock);
+	reader->seq = pressure.seq;
+
+	if (copy_to_user(buf, &pressure, sizeof(pressure)))
+		return -EFAULT;
+	return sizeof(pressure);
+}
+
+static unsigned int lowmem_notify_poll(struct file *file, poll_table *wait)
+{
+	struct lowmem_notify_reader *reader = file->private_data;
+
+	poll_wait(file, &lowmem_notify_wait, wait);
+	lowmem_notify_refresh();
+	return lowmem_notify_pending(reader) ? POLLIN | POLLRDNORM : 0;
+}
+
+static const struct file_operations lowmem_notify_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_notify_open,
+	.release = lowmem_notify_release,
+	.read = lowmem_notify_read,
+	.poll = lowmem_notify_poll,
+};
+
+static struct miscdevice lowmem_notify_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_notify",
+	.fops = &lowmem_notify_fops,
+};
+
+#ifdef CONFIG_DEBUG_BENCH
+/*
+ * Writing N to the hog_mb parameter makes the driver hold N MB of pages, to
+ * push the system through the notify levels and into lowmem_shrink() when
+ * testing /dev/lowmem_notify. Writing 0 gives everything back.
+ */
+static LIST_HEAD(lowmem_hog_pages);
+static unsigned long lowmem_hog_count;
+static DEFINE_MUTEX(lowmem_hog_lock);
+
+static void lowmem_hog_resize(unsigned long target)
+{
+	struct page *page, *next;
+
+	while (lowmem_hog_count < target && !fatal_signal_pending(current)) {
+		page = alloc_page(GFP_HIGHUSER | __GFP_NORETRY | __GFP_NOWARN);
+		if (!page)
+			break;
+		list_add(&page->lru, &lowmem_hog_pages);
+		lowmem_hog_count++;
+		cond_resched();
+	}
+
+	list_for_each_entry_safe(page, next, &lowmem_hog_pages, lru) {
+		if (lowmem_hog_count <= target)
+			break;
+		list_del(&page->lru);
+		__free_page(page);
+		lowmem_hog_count--;
+	}
+}
+
+static int lowmem_hog_set(const char *val, struct kernel_param *kp)
+{
+	unsigned long mb;
+
+	if (strict_strtoul(val, 0, &mb))
+		return -EINVAL;
+
+	mutex_lock(&lowmem_hog_lock);
+	lowmem_hog_resize(mb << (20 - PAGE_SHIFT));
+	lowmem_print(1, "lowmem_hog: holding %lu pages\n", lowmem_hog_count);
+	mutex_unlock(&lowmem_hog_lock);
+	return 0;
+}
+
+static int lowmem_hog_get(char *buffer, struct kernel_param *kp)
+{
+	return sprintf(buffer, "%lu", lowmem_hog_count >> (20 - PAGE_SHIFT));
+}
+#endif /* CONFIG_DEBUG_BENCH */
+
 static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
+	struct signal_struct *sig;
 	int rem = 0;
 	int tasksize;
 	int i;
+	int oom_adj;
+	int scanned = 0;
+	ktime_t start;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES);
-	//int other_file = global_page_state(NR_FILE_PAGES);
+	int other_free;
+	int other_file;
+	unsigned long flags;
 
-	#ifdef SEC_ADJUST_LMK
-		int other_file = global_page_state(NR_INACTIVE_FILE) +
-							global_page_state(NR_ACTIVE_FILE);
-	#else
-		int other_file = global_page_state(NR_FILE_PAGES) -
-							global_page_state(NR_SHMEM);
-	#endif
+	lowmem_other_pages(&other_free, &other_file);
+	lowmem_notify_update(other_free, other_file);
 
 	/*
 	 * If we already have a death outstanding, then
@@ -153,48 +526,61 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	}
 	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
+	/*
+	 * Only the highest populated bucket at or above min_adj matters;
+	 * RSS is sampled just for the processes in it.
+	 */
+	start = ktime_get();
+	rcu_read_lock();
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	for (oom_adj = OOM_ADJUST_MAX;
+	     oom_adj >= min_adj && oom_adj >= OOM_DISABLE && !selected;
+	     oom_adj--) {
+		list_for_each_entry(sig, lowmem_bucket(oom_adj), lowmem_node) {
+			struct mm_struct *mm;
 
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+			p = pid_task(sig->leader_pid, PIDTYPE_PID);
+			if (!p)
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			task_lock(p);
+			mm = p->mm;
+			if (!mm) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
+			task_unlock(p);
+			scanned++;
+			if (tasksize <= 0 || tasksize <= selected_tasksize)
 				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
+	if (selected)
+		get_task_struct(selected);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+	rcu_read_unlock();
+	trace_lowmem_select(selected, min_adj, selected_oom_adj,
+			    selected_tasksize, scanned,
+			    ktime_to_ns(ktime_sub(ktime_get(), start)));
+
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
+		/* tasklist_lock keeps ->sighand around for force_sig() */
+		read_lock(&tasklist_lock);
+		if (pid_alive(selected)) {
+			lowmem_deathpending = selected;
+			lowmem_deathpending_timeout = jiffies + HZ;
+			force_sig(SIGKILL, selected);
+		}
+		read_unlock(&tasklist_lock);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	}
 #ifdef SEC_ADJUST_LMK
@@ -203,7 +589,6 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 #endif
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -214,15 +599,26 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	lowmem_index_init();
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
+	if (misc_register(&lowmem_notify_misc))
+		printk(KERN_ERR "lowmemorykiller: failed to register "
+		       "lowmem_notify device\n");
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	misc_deregister(&lowmem_notify_misc);
 	unregister_shrinker(&lowmem_shrinker);
+	cancel_delayed_work_sync(&lowmem_notify_work);
 	task_free_unregister(&task_nb);
+#ifdef CONFIG_DEBUG_BENCH
+	mutex_lock(&lowmem_hog_lock);
+	lowmem_hog_resize(0);
+	mutex_unlock(&lowmem_hog_lock);
+#endif
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -230,7 +626,13 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 			 S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
+module_param_named(notify_margin, lowmem_notify_margin, uint,
+		   S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+#ifdef CONFIG_DEBUG_BENCH
+module_param_call(hog_mb, lowmem_hog_set, lowmem_hog_get, NULL,
+		  S_IRUGO | S_IWUSR);
+#endif
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -0,0 +1,41 @@
+/* drivers/staging/android/lowmemorykiller.h
+ *
+ * Copyright (C) 2007-2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#ifndef _LINUX_LOWMEMORYKILLER_H
+#define _LINUX_LOWMEMORYKILLER_H
+
+#include <linux/types.h>
+
+/*
+ * Record returned by read() on /dev/lowmem_notify.
+ *
+ * level is 0 while free memory is comfortably above every minfree
+ * threshold. It becomes n when free memory comes within notify_margin
+ * pages of the n-th highest threshold, so the highest level is the one
+ * nearest to killing min_adj. Page counts are in pages; reclaim_rate
+ * is the number of pages vmscan reclaimed per second over the last
+ * sampling interval.
+ */
+struct lowmem_pressure {
+	__u32		seq;		/* bumped on every level change */
+	__u32		level;
+	__s32		min_adj;	/* oom_adj killed at this level */
+	__u32		minfree;	/* threshold for this level */
+	__u32		free_pages;
+	__u32		file_pages;
+	__u32		reclaim_rate;
+};
+
+#endif /* _LINUX_LOWMEMORYKILLER_H */
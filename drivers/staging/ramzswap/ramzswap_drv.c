@@ -24,11 +24,20 @@
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/crypto.h>
+#include <linux/err.h>
+#include <linux/jhash.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/random.h>
 #include <linux/string.h>
 #include <linux/swap.h>
 #include <linux/swapops.h>
 #include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
 
 #include "ramzswap_drv.h"
 
@@ -38,6 +47,15 @@ static struct ramzswap *devices;
 
 /* Module params (documentation at end) */
 static unsigned int num_devices;
+static char *compressor;
+static unsigned int writeback_interval = 60;	/* seconds per epoch */
+static unsigned int writeback_age = 10;		/* idle epochs */
+static unsigned int writeback_clen = PAGE_SIZE / 4 * 3;
+
+static struct kmem_cache *dedup_cache;
+
+/* Cold page writeback does blocking I/O, keep it off the shared queue */
+static struct workqueue_struct *wb_workqueue;
 
 static int rzs_test_flag(struct ramzswap *rzs, u32 index,
 			enum rzs_pageflags flag)
@@ -116,15 +134,17 @@ static void setup_swap_header(struct ramzswap *rzs, union swap_header *s)
 }
 
 static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
-			struct ramzswap_ioctl_stats *s)
+			struct ramzswap_ioctl_stats_ext *s)
 {
-	s->disksize = rzs->disksize;
+	s->base.disksize = rzs->disksize;
+	strlcpy(s->compressor, rzs->compressor, sizeof(s->compressor));
 
 #if defined(CONFIG_RAMZSWAP_STATS)
 	{
 	struct ramzswap_stats *rs = &rzs->stats;
 	size_t succ_writes, mem_used;
 	unsigned int good_compress_perc = 0, no_compress_perc = 0;
+	u64 num_compress, num_decompress, pool_size;
 
 	mem_used = xv_get_total_size_bytes(rzs->mem_pool)
 			+ (rs->pages_expand << PAGE_SHIFT);
@@ -138,70 +158,414 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 					/ rs->pages_stored;
 	}
 
-	s->num_reads = rzs_stat64_read(rzs, &rs->num_reads);
-	s->num_writes = rzs_stat64_read(rzs, &rs->num_writes);
-	s->failed_reads = rzs_stat64_read(rzs, &rs->failed_reads);
-	s->failed_writes = rzs_stat64_read(rzs, &rs->failed_writes);
-	s->invalid_io = rzs_stat64_read(rzs, &rs->invalid_io);
-	s->notify_free = rzs_stat64_read(rzs, &rs->notify_free);
-	s->pages_zero = rs->pages_zero;
+	s->base.num_reads = rzs_stat64_read(rzs, &rs->num_reads);
+	s->base.num_writes = rzs_stat64_read(rzs, &rs->num_writes);
+	s->base.failed_reads = rzs_stat64_read(rzs, &rs->failed_reads);
+	s->base.failed_writes = rzs_stat64_read(rzs, &rs->failed_writes);
+	s->base.invalid_io = rzs_stat64_read(rzs, &rs->invalid_io);
+	s->base.notify_free = rzs_stat64_read(rzs, &rs->notify_free);
+	s->base.pages_zero = rs->pages_zero;
+
+	s->base.good_compress_pct = good_compress_perc;
+	s->base.pages_expand_pct = no_compress_perc;
+
+	s->base.pages_stored = rs->pages_stored;
+	s->base.pages_used = mem_used >> PAGE_SHIFT;
+	s->base.orig_data_size = rs->pages_stored << PAGE_SHIFT;
+	s->base.compr_data_size = rs->compr_size;
+	s->base.mem_used_total = mem_used;
+
+	pool_size = xv_get_total_size_bytes(rzs->mem_pool);
+	if (pool_size)
+		s->fragmentation_pct = 100 - div64_u64(100 *
+			xv_get_used_size_bytes(rzs->mem_pool), pool_size);
+	s->pages_compacted = rzs_stat64_read(rzs, &rs->pages_compacted);
+
+	s->pages_backed = rs->pages_backed;
+	s->bdev_num_reads = rzs_stat64_read(rzs, &rs->bdev_num_reads);
+	s->bdev_num_writes = rzs_stat64_read(rzs, &rs->bdev_num_writes);
+	s->pages_written_back = rzs_stat64_read(rzs,
+					&rs->pages_written_back);
+
+	s->pages_dedup = rs->pages_dedup;
+	if (rs->pages_stored)
+		s->dedup_pct = rs->pages_dedup * 100 / rs->pages_stored;
+
+	num_compress = rzs_stat64_read(rzs, &rs->num_compress);
+	num_decompress = rzs_stat64_read(rzs, &rs->num_decompress);
+	if (num_compress)
+		s->compr_avg_ns = div64_u64(rzs_stat64_read(rzs,
+					&rs->compr_ns), num_compress);
+	if (num_decompress)
+		s->decompr_avg_ns = div64_u64(rzs_stat64_read(rzs,
+					&rs->decompr_ns), num_decompress);
+	}
+#endif /* CONFIG_RAMZSWAP_STATS */
+}
+
+static int ramzswap_compress(struct ramzswap *rzs, struct rzs_stream *stream,
+			const u8 *src, u8 *dst, unsigned int *dlen)
+{
+	int ret;
+	ktime_t start = ktime_get();
+
+	*dlen = 2 * PAGE_SIZE;
+	ret = crypto_comp_compress(stream->tfm, src, PAGE_SIZE, dst, dlen);
+
+	rzs_stat64_inc(rzs, &rzs->stats.num_compress);
+	rzs_stat64_add(rzs, &rzs->stats.compr_ns,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+	return ret;
+}
+
+static int ramzswap_decompress(struct ramzswap *rzs, struct rzs_stream *stream,
+			const u8 *src, unsigned int slen, u8 *dst)
+{
+	int ret;
+	unsigned int dlen = PAGE_SIZE;
+	ktime_t start = ktime_get();
 
-	s->good_compress_pct = good_compress_perc;
-	s->pages_expand_pct = no_compress_perc;
+	ret = crypto_comp_decompress(stream->tfm, src, slen, dst, &dlen);
+	if (!ret && dlen != PAGE_SIZE)
+		ret = -EINVAL;
 
-	s->pages_stored = rs->pages_stored;
-	s->pages_used = mem_used >> PAGE_SHIFT;
-	s->orig_data_size = rs->pages_stored << PAGE_SHIFT;
-	s->compr_data_size = rs->compr_size;
-	s->mem_used_total = mem_used;
+	rzs_stat64_inc(rzs, &rzs->stats.num_decompress);
+	rzs_stat64_add(rzs, &rzs->stats.decompr_ns,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+	return ret;
+}
+
+/*
+ * Use the local CPU's stream: it is cache-hot and, unless we get
+ * preempted, uncontended.
+ */
+static struct rzs_stream *ramzswap_get_stream(struct ramzswap *rzs)
+{
+	struct rzs_stream *stream;
+
+	stream = per_cpu_ptr(rzs->streams, raw_smp_processor_id());
+	mutex_lock(&stream->lock);
+	return stream;
+}
+
+static void ramzswap_put_stream(struct ramzswap *rzs,
+			struct rzs_stream *stream)
+{
+	mutex_unlock(&stream->lock);
+}
+
+static struct hlist_head *dedup_bucket(struct ramzswap *rzs, u32 hash)
+{
+	return &rzs->dedup_table[hash & rzs->dedup_mask];
+}
+
+/*
+ * Drop a reference to a shared object. Returns 1 if that was the last
+ * one: the node is gone from the index and the caller must free the
+ * object itself.
+ */
+static int ramzswap_dedup_put(struct ramzswap *rzs, struct rzs_dedup *dedup)
+{
+	spin_lock(&rzs->dedup_lock);
+	if (--dedup->refcount) {
+		spin_unlock(&rzs->dedup_lock);
+		return 0;
 	}
-#endif /* CONFIG_RAMZSWAP_STATS */
+	hlist_del(&dedup->node);
+	spin_unlock(&rzs->dedup_lock);
+
+	kmem_cache_free(dedup_cache, dedup);
+	return 1;
 }
 
-static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+/* Free a compressed object once nothing references it any more */
+static void ramzswap_free_object(struct ramzswap *rzs, struct page *page,
+			u32 offset)
 {
 	u32 clen;
 	void *obj;
 
+	obj = kmap_atomic(page, KM_USER0) + offset;
+	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
+	kunmap_atomic(obj, KM_USER0);
+
+	xv_free(rzs->mem_pool, page, offset);
+	if (clen <= PAGE_SIZE / 2)
+		rzs_stat_dec(rzs, &rzs->stats.good_compress);
+
+	spin_lock(&rzs->stat64_lock);
+	rzs->stats.compr_size -= clen;
+	spin_unlock(&rzs->stat64_lock);
+}
+
+static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+{
+	void *obj;
+	struct rzs_dedup *dedup;
+
 	struct page *page = rzs->table[index].page;
 	u32 offset = rzs->table[index].offset;
 
+	/* tells a writeback in flight that this copy is stale */
+	rzs_clear_flag(rzs, index, RZS_WRITEBACK);
+
 	if (unlikely(!page)) {
 		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
+		 * No memory is allocated for zero filled pages
+		 * or pages on the backing device. Simply clear
+		 * the flag.
 		 */
 		if (rzs_test_flag(rzs, index, RZS_ZERO)) {
 			rzs_clear_flag(rzs, index, RZS_ZERO);
-			rzs_stat_dec(&rzs->stats.pages_zero);
+			rzs_stat_dec(rzs, &rzs->stats.pages_zero);
+		}
+		if (rzs_test_flag(rzs, index, RZS_BACKED)) {
+			rzs_clear_flag(rzs, index, RZS_BACKED);
+			rzs_stat_dec(rzs, &rzs->stats.pages_backed);
 		}
 		return;
 	}
 
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
 		__free_page(page);
 		rzs_clear_flag(rzs, index, RZS_UNCOMPRESSED);
-		rzs_stat_dec(&rzs->stats.pages_expand);
+		rzs_stat_dec(rzs, &rzs->stats.pages_expand);
+		spin_lock(&rzs->stat64_lock);
+		rzs->stats.compr_size -= PAGE_SIZE;
+		spin_unlock(&rzs->stat64_lock);
 		goto out;
 	}
 
 	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
+	dedup = ((struct zobj_header *)obj)->dedup;
 	kunmap_atomic(obj, KM_USER0);
 
-	xv_free(rzs->mem_pool, page, offset);
-	if (clen <= PAGE_SIZE / 2)
-		rzs_stat_dec(&rzs->stats.good_compress);
+	if (!dedup || ramzswap_dedup_put(rzs, dedup))
+		ramzswap_free_object(rzs, page, offset);
+	else
+		rzs_stat_dec(rzs, &rzs->stats.pages_dedup);
 
 out:
-	rzs->stats.compr_size -= clen;
-	rzs_stat_dec(&rzs->stats.pages_stored);
+	rzs_stat_dec(rzs, &rzs->stats.pages_stored);
 
 	rzs->table[index].page = NULL;
 	rzs->table[index].offset = 0;
 }
 
+/*
+ * Look for an already stored object with the same contents as @page and,
+ * if there is one, point table entry @index at it. Candidates are found
+ * by hash and confirmed by decompressing them into the stream buffer, so
+ * a hash collision only costs a missed share.
+ */
+static int ramzswap_dedup_find(struct ramzswap *rzs, struct rzs_stream *stream,
+			struct page *page, u32 hash, u32 index)
+{
+	int ret, same;
+	struct hlist_node *pos;
+	struct rzs_dedup *dedup, *found = NULL;
+	unsigned char *user_mem, *cmem;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_for_each_entry(dedup, pos, dedup_bucket(rzs, hash), node) {
+		if (dedup->hash == hash) {
+			/* pin it while we compare */
+			dedup->refcount++;
+			found = dedup;
+			break;
+		}
+	}
+	spin_unlock(&rzs->dedup_lock);
+
+	if (!found)
+		return 0;
+
+	cmem = kmap_atomic(found->page, KM_USER1) + found->offset;
+	ret = ramzswap_decompress(rzs, stream,
+		cmem + sizeof(struct zobj_header),
+		xv_get_object_size(cmem) - sizeof(struct zobj_header),
+		stream->buffer);
+	kunmap_atomic(cmem, KM_USER1);
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	same = !ret && !memcmp(user_mem, stream->buffer, PAGE_SIZE);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	if (!same) {
+		struct page *obj_page = found->page;
+		u32 obj_offset = found->offset;
+
+		if (ramzswap_dedup_put(rzs, found))
+			ramzswap_free_object(rzs, obj_page, obj_offset);
+		return 0;
+	}
+
+	rzs->table[index].page = found->page;
+	rzs->table[index].offset = found->offset;
+	return 1;
+}
+
+static void ramzswap_dedup_insert(struct ramzswap *rzs,
+			struct rzs_dedup *dedup)
+{
+	spin_lock(&rzs->dedup_lock);
+	hlist_add_head(&dedup->node, dedup_bucket(rzs, dedup->hash));
+	spin_unlock(&rzs->dedup_lock);
+}
+
+/*
+ * Find the single table entry pointing at the object at <page, offset>.
+ * Fails if the object is gone, shared by several entries, or its
+ * back-reference went stale when the entry that stored it let go of a
+ * shared copy. Called with compact_lock held.
+ */
+static int ramzswap_object_owner(struct ramzswap *rzs, struct page *page,
+			u32 offset, u32 *index, u32 *size)
+{
+	void *obj;
+	struct zobj_header *zheader;
+	struct rzs_dedup *dedup;
+	int ret = 0;
+
+	obj = kmap_atomic(page, KM_USER0) + offset;
+	zheader = obj;
+	*index = zheader->table_idx;
+	*size = xv_get_object_size(obj);
+	dedup = zheader->dedup;
+	kunmap_atomic(obj, KM_USER0);
+
+	if (*index >= rzs->disksize >> PAGE_SHIFT ||
+	    rzs->table[*index].page != page ||
+	    rzs->table[*index].offset != offset ||
+	    rzs_test_flag(rzs, *index, RZS_UNCOMPRESSED))
+		return -ENOENT;
+
+	if (dedup) {
+		spin_lock(&rzs->dedup_lock);
+		if (dedup->refcount != 1)
+			ret = -EBUSY;
+		spin_unlock(&rzs->dedup_lock);
+	}
+
+	return ret;
+}
+
+/*
+ * Move one object out of a sparse page. Returns -EAGAIN when the only
+ * room left is in that same page, and -ENOMEM when the pool has no room
+ * at all; compaction never grows the pool.
+ */
+static int ramzswap_migrate_object(struct ramzswap *rzs, struct page *page,
+			u32 offset)
+{
+	int ret;
+	u32 index, size, new_index, new_size, new_offset;
+	struct page *new_page;
+	struct rzs_dedup *dedup;
+	unsigned char *src, *dst;
+
+	spin_lock(&rzs->compact_lock);
+	ret = ramzswap_object_owner(rzs, page, offset, &index, &size);
+	spin_unlock(&rzs->compact_lock);
+	if (ret)
+		return ret;
+
+	if (xv_malloc(rzs->mem_pool, size, &new_page, &new_offset,
+			GFP_NOWAIT))
+		return -ENOMEM;
+
+	if (new_page == page) {
+		xv_free(rzs->mem_pool, new_page, new_offset);
+		return -EAGAIN;
+	}
+
+	/* the slot may have been freed while we allocated */
+	spin_lock(&rzs->compact_lock);
+	ret = ramzswap_object_owner(rzs, page, offset, &new_index, &new_size);
+	if (ret || new_index != index || new_size != size) {
+		spin_unlock(&rzs->compact_lock);
+		xv_free(rzs->mem_pool, new_page, new_offset);
+		return ret ? ret : -ENOENT;
+	}
+
+	src = kmap_atomic(page, KM_USER0) + offset;
+	dst = kmap_atomic(new_page, KM_USER1) + new_offset;
+	memcpy(dst, src, size);
+	dedup = ((struct zobj_header *)dst)->dedup;
+	kunmap_atomic(dst, KM_USER1);
+	kunmap_atomic(src, KM_USER0);
+
+	rzs->table[index].page = new_page;
+	rzs->table[index].offset = new_offset;
+	if (dedup) {
+		dedup->page = new_page;
+		dedup->offset = new_offset;
+	}
+	spin_unlock(&rzs->compact_lock);
+
+	xv_free(rzs->mem_pool, page, offset);
+	return 0;
+}
+
+/*
+ * Empty as many sparse pool pages as we can by moving their objects
+ * into free space elsewhere in the pool. Objects that are shared, or
+ * whose back-reference is stale, stay where they are.
+ */
+static int ramzswap_compact(struct ramzswap *rzs)
+{
+	int i, j, ret = 0;
+	int nr_pages, nr_objs, max_objs;
+	u64 pages_before, freed;
+	struct page **pages;
+	u32 *offsets;
+
+	/* no object (header included) is smaller than 8 bytes */
+	max_objs = PAGE_SIZE / 8;
+
+	pages = kmalloc(compact_batch * sizeof(*pages), GFP_KERNEL);
+	offsets = kmalloc(max_objs * sizeof(*offsets), GFP_KERNEL);
+	if (!pages || !offsets) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	down_write(&rzs->compact_sem);
+
+	pages_before = xv_get_total_size_bytes(rzs->mem_pool) >> PAGE_SHIFT;
+	nr_pages = xv_get_sparse_pages(rzs->mem_pool, compact_max_used,
+					pages, compact_batch);
+
+	for (i = 0; i < nr_pages; i++) {
+		if (ret != -ENOMEM) {
+			nr_objs = xv_get_page_objects(rzs->mem_pool, pages[i],
+						offsets, max_objs);
+			for (j = 0; j < nr_objs; j++) {
+				ret = ramzswap_migrate_object(rzs, pages[i],
+							offsets[j]);
+				if (ret == -EAGAIN || ret == -ENOMEM)
+					break;
+			}
+		}
+		put_page(pages[i]);
+	}
+
+	freed = pages_before -
+		(xv_get_total_size_bytes(rzs->mem_pool) >> PAGE_SHIFT);
+
+	up_write(&rzs->compact_sem);
+
+	rzs_stat64_add(rzs, &rzs->stats.pages_compacted, freed);
+	pr_debug("Compaction released %llu of %d sparse pages\n",
+		(unsigned long long)freed, nr_pages);
+	ret = 0;
+
+out:
+	kfree(offsets);
+	kfree(pages);
+	return ret;
+}
+
 static int handle_zero_page(struct bio *bio)
 {
 	void *user_mem;
@@ -265,9 +629,8 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
 	u32 index;
-	size_t clen;
 	struct page *page;
-	struct zobj_header *zheader;
+	struct rzs_stream *stream;
 	unsigned char *user_mem, *cmem;
 
 	rzs_stat64_inc(rzs, &rzs->stats.num_reads);
@@ -275,33 +638,56 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
+	/*
+	 * The page is hot again, so cancel its writeback. Only the
+	 * writeback worker sets the tag, with compact_sem held for write,
+	 * so once it is clear here ramzswap_wb_commit() leaves the RAM
+	 * copy alone; if the commit won the race, RZS_BACKED is set.
+	 */
+	if (unlikely(rzs_test_flag(rzs, index, RZS_WRITEBACK))) {
+		spin_lock(&rzs->compact_lock);
+		rzs_clear_flag(rzs, index, RZS_WRITEBACK);
+		spin_unlock(&rzs->compact_lock);
+	}
+
 	if (rzs_test_flag(rzs, index, RZS_ZERO))
 		return handle_zero_page(bio);
 
+	/* Let the block layer resubmit it to the backing device */
+	if (rzs_test_flag(rzs, index, RZS_BACKED)) {
+		rzs_stat64_inc(rzs, &rzs->stats.bdev_num_reads);
+		bio->bi_bdev = rzs->backing_swap;
+		return 1;
+	}
+
 	/* Requested page is not present in compressed area */
 	if (!rzs->table[index].page)
 		return handle_ramzswap_fault(rzs, bio);
 
+	rzs->table[index].age = rzs->wb_epoch;
+
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 		return handle_uncompressed_page(rzs, bio);
 
-	user_mem = kmap_atomic(page, KM_USER0);
-	clen = PAGE_SIZE;
+	stream = ramzswap_get_stream(rzs);
 
+	user_mem = kmap_atomic(page, KM_USER0);
 	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
 			rzs->table[index].offset;
 
-	ret = lzo1x_decompress_safe(
-		cmem + sizeof(*zheader),
-		xv_get_object_size(cmem) - sizeof(*zheader),
-		user_mem, &clen);
+	ret = ramzswap_decompress(rzs, stream,
+		cmem + sizeof(struct zobj_header),
+		xv_get_object_size(cmem) - sizeof(struct zobj_header),
+		user_mem);
 
 	kunmap_atomic(user_mem, KM_USER0);
 	kunmap_atomic(cmem, KM_USER1);
 
+	ramzswap_put_stream(rzs, stream);
+
 	/* should NEVER happen */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n",
 			ret, index);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_reads);
@@ -322,10 +708,12 @@ out:
 static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
-	u32 offset, index;
-	size_t clen;
+	u32 offset, index, hash;
+	unsigned int clen;
 	struct zobj_header *zheader;
+	struct rzs_dedup *dedup = NULL;
 	struct page *page, *page_store;
+	struct rzs_stream *stream;
 	unsigned char *user_mem, *cmem, *src;
 
 	rzs_stat64_inc(rzs, &rzs->stats.num_writes);
@@ -333,44 +721,72 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	src = rzs->compress_buffer;
-
-	mutex_lock(&rzs->lock);
-
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (page_zero_filled(user_mem)) {
 		kunmap_atomic(user_mem, KM_USER0);
-		mutex_unlock(&rzs->lock);
-		rzs_stat_inc(&rzs->stats.pages_zero);
+		rzs_stat_inc(rzs, &rzs->stats.pages_zero);
 		rzs_set_flag(rzs, index, RZS_ZERO);
 
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
 		bio_endio(bio, 0);
 		return 0;
 	}
+	hash = jhash2((u32 *)user_mem, PAGE_SIZE / sizeof(u32), 0);
+	kunmap_atomic(user_mem, KM_USER0);
 
-	ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-				rzs->compress_workmem);
+	/*
+	 * Table entries are per swap slot and the swap layer never has two
+	 * I/Os in flight for the same slot, so only the compression buffers
+	 * need protecting.
+	 */
+	stream = ramzswap_get_stream(rzs);
+
+	if (ramzswap_dedup_find(rzs, stream, page, hash, index)) {
+		ramzswap_put_stream(rzs, stream);
+		rzs_stat_inc(rzs, &rzs->stats.pages_stored);
+		rzs_stat_inc(rzs, &rzs->stats.pages_dedup);
 
+		set_bit(BIO_UPTODATE, &bio->bi_flags);
+		bio_endio(bio, 0);
+		return 0;
+	}
+
+	src = stream->buffer;
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = ramzswap_compress(rzs, stream, user_mem, src, &clen);
 	kunmap_atomic(user_mem, KM_USER0);
 
-	if (unlikely(ret != LZO_E_OK)) {
-		mutex_unlock(&rzs->lock);
-		pr_err("Compression failed! err=%d\n", ret);
-		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
-		goto out;
+	/*
+	 * Poorly compressible pages are not worth their RAM when there
+	 * is somewhere else to put them: hand the bio on to the backing
+	 * device unchanged.
+	 */
+	if (rzs->backing_swap && (ret || clen > writeback_clen)) {
+		ramzswap_put_stream(rzs, stream);
+		/*
+		 * A writeback of this slot's previous contents may still
+		 * be in flight to the same sector; ours must land last.
+		 */
+		wait_event(rzs->wb->io_wait,
+			!rzs_test_flag(rzs, index, RZS_WB_IO));
+		rzs_set_flag(rzs, index, RZS_BACKED);
+		rzs_stat_inc(rzs, &rzs->stats.pages_backed);
+		rzs_stat64_inc(rzs, &rzs->stats.bdev_num_writes);
+		bio->bi_bdev = rzs->backing_swap;
+		return 1;
 	}
 
 	/*
-	 * Page is incompressible. Store it as-is (uncompressed)
-	 * since we do not want to return too many swap write
-	 * errors which has side effect of hanging the system.
+	 * Page is incompressible, or the compressor gave up on it.
+	 * Store it as-is (uncompressed) since we do not want to
+	 * return too many swap write errors which has side effect
+	 * of hanging the system.
 	 */
-	if (unlikely(clen > max_zpage_size)) {
+	if (unlikely(ret || clen > max_zpage_size)) {
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
-			mutex_unlock(&rzs->lock);
+			ramzswap_put_stream(rzs, stream);
 			pr_info("Error allocating memory for incompressible "
 				"page: %u\n", index);
 			rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
@@ -379,36 +795,41 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 
 		offset = 0;
 		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
-		rzs_stat_inc(&rzs->stats.pages_expand);
+		rzs_stat_inc(rzs, &rzs->stats.pages_expand);
 		rzs->table[index].page = page_store;
 		src = kmap_atomic(page, KM_USER0);
 		goto memstore;
 	}
 
+	/* Without a node the object is simply never shared */
+	dedup = kmem_cache_alloc(dedup_cache, GFP_NOIO);
+
 	if (xv_malloc(rzs->mem_pool, clen + sizeof(*zheader),
 			&rzs->table[index].page, &offset,
 			GFP_NOIO | __GFP_HIGHMEM)) {
-		mutex_unlock(&rzs->lock);
+		ramzswap_put_stream(rzs, stream);
+		if (dedup)
+			kmem_cache_free(dedup_cache, dedup);
 		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+			"page: %u, size=%u\n", index, clen);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
 	}
 
 memstore:
 	rzs->table[index].offset = offset;
+	rzs->table[index].age = rzs->wb_epoch;
 
 	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
 			rzs->table[index].offset;
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
 	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
 		zheader = (struct zobj_header *)cmem;
+		zheader->dedup = dedup;
+		/* Back-reference needed for memory defragmentation */
 		zheader->table_idx = index;
 		cmem += sizeof(*zheader);
 	}
-#endif
 
 	memcpy(cmem, src, clen);
 
@@ -416,13 +837,24 @@ memstore:
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 		kunmap_atomic(src, KM_USER0);
 
+	/* Only publish the object once its contents are in place */
+	if (dedup) {
+		dedup->page = rzs->table[index].page;
+		dedup->offset = offset;
+		dedup->hash = hash;
+		dedup->refcount = 1;
+		ramzswap_dedup_insert(rzs, dedup);
+	}
+
+	ramzswap_put_stream(rzs, stream);
+
 	/* Update stats */
+	spin_lock(&rzs->stat64_lock);
 	rzs->stats.compr_size += clen;
-	rzs_stat_inc(&rzs->stats.pages_stored);
+	spin_unlock(&rzs->stat64_lock);
+	rzs_stat_inc(rzs, &rzs->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
-		rzs_stat_inc(&rzs->stats.good_compress);
-
-	mutex_unlock(&rzs->lock);
+		rzs_stat_inc(rzs, &rzs->stats.good_compress);
 
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
@@ -471,6 +903,11 @@ static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
 		return 0;
 	}
 
+	/*
+	 * A non-zero return means the bio was redirected to the
+	 * backing device and should be resubmitted there.
+	 */
+	down_read(&rzs->compact_sem);
 	switch (bio_data_dir(bio)) {
 	case READ:
 		ret = ramzswap_read(rzs, bio);
@@ -480,44 +917,379 @@ static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
 		ret = ramzswap_write(rzs, bio);
 		break;
 	}
+	up_read(&rzs->compact_sem);
 
 	return ret;
 }
 
-static void reset_device(struct ramzswap *rzs)
+static void ramzswap_free_streams(struct ramzswap *rzs)
 {
-	size_t index;
+	int cpu;
 
-	/* Do not accept any new I/O request */
-	rzs->init_done = 0;
+	if (!rzs->streams)
+		return;
 
-	/* Free various per-device buffers */
-	kfree(rzs->compress_workmem);
-	free_pages((unsigned long)rzs->compress_buffer, 1);
+	for_each_possible_cpu(cpu) {
+		struct rzs_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+
+		if (stream->tfm)
+			crypto_free_comp(stream->tfm);
+		free_pages((unsigned long)stream->buffer, 1);
+	}
+
+	free_percpu(rzs->streams);
+	rzs->streams = NULL;
+}
+
+static int ramzswap_alloc_streams(struct ramzswap *rzs)
+{
+	int cpu;
+
+	rzs->streams = alloc_percpu(struct rzs_stream);
+	if (!rzs->streams)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct rzs_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+
+		mutex_init(&stream->lock);
+		stream->tfm = crypto_alloc_comp(rzs->compressor, 0, 0);
+		if (IS_ERR(stream->tfm)) {
+			int err = PTR_ERR(stream->tfm);
+
+			stream->tfm = NULL;
+			return err;
+		}
+		stream->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!stream->buffer)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void ramzswap_wb_end_io(struct bio *bio, int err)
+{
+	int i;
+	struct rzs_writeback *wb = bio->bi_private;
+
+	if (!err && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		err = -EIO;
+
+	for (i = 0; i < WB_BATCH; i++) {
+		if (wb->pages[i] == bio->bi_io_vec[0].bv_page) {
+			wb->error[i] = err;
+			break;
+		}
+	}
+
+	bio_put(bio);
+	if (atomic_dec_and_test(&wb->pending))
+		complete(&wb->done);
+}
+
+/*
+ * Pick up to WB_BATCH pages in [*pos, end) that have not been touched
+ * for writeback_age epochs and copy them, uncompressed, into the
+ * writeback pages. Each one is tagged RZS_WRITEBACK; a slot free or a
+ * read clears the tag, telling ramzswap_wb_commit() to keep the page in
+ * RAM. RZS_WB_IO stays set until the bio has completed.
+ *
+ * compact_sem keeps reads, writes and compaction out, so only slot frees
+ * can race with us. compact_lock is taken just to pick and tag a page;
+ * the copy is done without it, holding a reference on the pool page so
+ * that a racing free can at worst leave us with a stale copy.
+ */
+static int ramzswap_wb_collect(struct ramzswap *rzs, size_t *pos, size_t end)
+{
+	int nr = 0;
+	size_t index;
+	struct rzs_writeback *wb = rzs->wb;
 
-	rzs->compress_workmem = NULL;
-	rzs->compress_buffer = NULL;
+	down_write(&rzs->compact_sem);
 
-	/* Free all pages that are still in this ramzswap device */
-	for (index = 0; index < rzs->disksize >> PAGE_SHIFT; index++) {
+	for (index = *pos; index < end && nr < WB_BATCH; index++) {
+		int ret = 0;
+		int uncompressed;
+		unsigned int dlen = PAGE_SIZE;
+		struct zobj_header *zheader;
+		unsigned char *src, *dst;
 		struct page *page;
-		u16 offset;
+		u32 offset, size = 0;
 
+		/* index 0 is the swap header */
+		if (!index)
+			continue;
+
+		spin_lock(&rzs->compact_lock);
 		page = rzs->table[index].page;
+		if (!page || (u8)(rzs->wb_epoch - rzs->table[index].age) <
+				writeback_age) {
+			spin_unlock(&rzs->compact_lock);
+			continue;
+		}
+
 		offset = rzs->table[index].offset;
+		uncompressed = rzs_test_flag(rzs, index, RZS_UNCOMPRESSED);
+		if (!uncompressed) {
+			src = kmap_atomic(page, KM_USER0) + offset;
+			zheader = (struct zobj_header *)src;
+			/* shared objects would stay in RAM anyway */
+			if (zheader->dedup) {
+				spin_lock(&rzs->dedup_lock);
+				if (zheader->dedup->refcount > 1)
+					ret = -EBUSY;
+				spin_unlock(&rzs->dedup_lock);
+			}
+			size = xv_get_object_size(src);
+			kunmap_atomic(src, KM_USER0);
+		}
+		if (!ret) {
+			rzs_set_flag(rzs, index, RZS_WRITEBACK);
+			rzs_set_flag(rzs, index, RZS_WB_IO);
+			get_page(page);
+		}
+		spin_unlock(&rzs->compact_lock);
+
+		if (ret)
+			continue;
 
-		if (!page)
+		src = kmap_atomic(page, KM_USER0) + offset;
+		dst = kmap_atomic(wb->pages[nr], KM_USER1);
+
+		if (uncompressed) {
+			memcpy(dst, src, PAGE_SIZE);
+		} else {
+			ret = crypto_comp_decompress(wb->tfm,
+				src + sizeof(struct zobj_header),
+				size - sizeof(struct zobj_header),
+				dst, &dlen);
+			if (!ret && dlen != PAGE_SIZE)
+				ret = -EINVAL;
+		}
+
+		kunmap_atomic(dst, KM_USER1);
+		kunmap_atomic(src, KM_USER0);
+		put_page(page);
+
+		if (ret) {
+			spin_lock(&rzs->compact_lock);
+			rzs_clear_flag(rzs, index, RZS_WRITEBACK);
+			rzs_clear_flag(rzs, index, RZS_WB_IO);
+			spin_unlock(&rzs->compact_lock);
 			continue;
+		}
+
+		wb->index[nr++] = index;
+	}
+
+	up_write(&rzs->compact_sem);
+
+	*pos = index;
+	return nr;
+}
+
+/* Write the batch out in index order and wait for all of it */
+static void ramzswap_wb_submit(struct ramzswap *rzs, int nr)
+{
+	int i;
+	struct bio *bio;
+	struct rzs_writeback *wb = rzs->wb;
+
+	atomic_set(&wb->pending, nr);
+	INIT_COMPLETION(wb->done);
+
+	for (i = 0; i < nr; i++) {
+		wb->error[i] = 0;
+
+		bio = bio_alloc(GFP_NOIO, 1);
+		bio->bi_bdev = rzs->backing_swap;
+		bio->bi_sector = (sector_t)wb->index[i] <<
+					SECTORS_PER_PAGE_SHIFT;
+		bio_add_page(bio, wb->pages[i], PAGE_SIZE, 0);
+		bio->bi_end_io = ramzswap_wb_end_io;
+		bio->bi_private = wb;
+
+		submit_bio(WRITE, bio);
+	}
+
+	wait_for_completion(&wb->done);
+}
+
+/*
+ * Drop the RAM copy of every page that made it to the backing device,
+ * and let writers redirected to the same sectors go ahead. Reads and
+ * writes keep running: a slot that was read, freed or rewritten since
+ * it was collected has lost its RZS_WRITEBACK tag.
+ */
+static void ramzswap_wb_commit(struct ramzswap *rzs, int nr)
+{
+	int i;
+	u32 index;
+	struct rzs_writeback *wb = rzs->wb;
+
+	spin_lock(&rzs->compact_lock);
+
+	for (i = 0; i < nr; i++) {
+		index = wb->index[i];
+		rzs_clear_flag(rzs, index, RZS_WB_IO);
+
+		if (!rzs_test_flag(rzs, index, RZS_WRITEBACK))
+			continue;
+
+		if (wb->error[i]) {
+			rzs_clear_flag(rzs, index, RZS_WRITEBACK);
+			continue;
+		}
+
+		ramzswap_free_page(rzs, index);
+		rzs_set_flag(rzs, index, RZS_BACKED);
+		rzs_stat_inc(rzs, &rzs->stats.pages_backed);
+		rzs_stat64_inc(rzs, &rzs->stats.pages_written_back);
+	}
+
+	spin_unlock(&rzs->compact_lock);
+	wake_up_all(&wb->io_wait);
+}
+
+/*
+ * Runs once per writeback_interval. Every access stamps a table entry
+ * with the current epoch, so anything writeback_age epochs behind is
+ * cold and gets moved to the backing device.
+ */
+static void ramzswap_wb_work(struct work_struct *work)
+{
+	int nr;
+	size_t pos = 0, end;
+	struct ramzswap *rzs = container_of(work, struct ramzswap,
+						wb_work.work);
+	size_t num_pages = rzs->disksize >> PAGE_SHIFT;
+
+	rzs->wb_epoch++;
+
+	while (pos < num_pages) {
+		end = min_t(size_t, pos + wb_scan_chunk, num_pages);
+		while (pos < end) {
+			nr = ramzswap_wb_collect(rzs, &pos, end);
+			if (!nr)
+				break;
+			ramzswap_wb_submit(rzs, nr);
+			ramzswap_wb_commit(rzs, nr);
+		}
+		cond_resched();
+	}
+
+	queue_delayed_work(wb_workqueue, &rzs->wb_work,
+			writeback_interval * HZ);
+}
+
+static void ramzswap_free_backing_swap(struct ramzswap *rzs)
+{
+	int i;
+	struct rzs_writeback *wb = rzs->wb;
+
+	cancel_delayed_work_sync(&rzs->wb_work);
+
+	if (wb) {
+		for (i = 0; i < WB_BATCH; i++) {
+			if (wb->pages[i])
+				__free_page(wb->pages[i]);
+		}
+		if (wb->tfm)
+			crypto_free_comp(wb->tfm);
+		kfree(wb);
+		rzs->wb = NULL;
+	}
+
+	if (rzs->backing_swap) {
+		close_bdev_exclusive(rzs->backing_swap,
+				FMODE_READ | FMODE_WRITE);
+		rzs->backing_swap = NULL;
+	}
+}
 
-		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(rzs->mem_pool, page, offset);
+/*
+ * Backing device slots mirror ramzswap's: page n of the disk goes to
+ * page n of the backing device, so it must be at least disksize long.
+ * If no disksize was given, the backing device's size is used.
+ */
+static int ramzswap_setup_backing_swap(struct ramzswap *rzs)
+{
+	int i, ret;
+	u64 size;
+	struct block_device *bdev;
+	struct rzs_writeback *wb;
+
+	bdev = open_bdev_exclusive(rzs->backing_swap_name,
+				FMODE_READ | FMODE_WRITE, rzs);
+	if (IS_ERR(bdev)) {
+		pr_err("Error opening backing device: %s\n",
+			rzs->backing_swap_name);
+		return PTR_ERR(bdev);
+	}
+	rzs->backing_swap = bdev;
+
+	size = i_size_read(bdev->bd_inode);
+	if (!rzs->disksize) {
+		rzs->disksize = size;
+	} else if (size < rzs->disksize) {
+		pr_err("Backing device %s is smaller than disksize\n",
+			rzs->backing_swap_name);
+		return -EINVAL;
+	}
+
+	wb = kzalloc(sizeof(*wb), GFP_KERNEL);
+	if (!wb)
+		return -ENOMEM;
+	rzs->wb = wb;
+
+	init_completion(&wb->done);
+	init_waitqueue_head(&wb->io_wait);
+	wb->tfm = crypto_alloc_comp(rzs->compressor, 0, 0);
+	if (IS_ERR(wb->tfm)) {
+		ret = PTR_ERR(wb->tfm);
+		wb->tfm = NULL;
+		return ret;
+	}
+
+	for (i = 0; i < WB_BATCH; i++) {
+		wb->pages[i] = alloc_page(GFP_KERNEL);
+		if (!wb->pages[i])
+			return -ENOMEM;
+	}
+
+	pr_info("Using backing device %s\n", rzs->backing_swap_name);
+	return 0;
+}
+
+static void reset_device(struct ramzswap *rzs)
+{
+	size_t index;
+
+	/* Do not accept any new I/O request */
+	rzs->init_done = 0;
+
+	/* Free various per-device buffers */
+	ramzswap_free_backing_swap(rzs);
+	ramzswap_free_streams(rzs);
+
+	/*
+	 * Free all pages that are still in this ramzswap device. Shared
+	 * objects go away with their last reference.
+	 */
+	if (rzs->table) {
+		for (index = 0; index < rzs->disksize >> PAGE_SHIFT; index++) {
+			if (rzs->table[index].page)
+				ramzswap_free_page(rzs, index);
+		}
 	}
 
 	vfree(rzs->table);
 	rzs->table = NULL;
 
+	vfree(rzs->dedup_table);
+	rzs->dedup_table = NULL;
+
 	xv_destroy_pool(rzs->mem_pool);
 	rzs->mem_pool = NULL;
 
@@ -525,12 +1297,14 @@ static void reset_device(struct ramzswap *rzs)
 	memset(&rzs->stats, 0, sizeof(rzs->stats));
 
 	rzs->disksize = 0;
+	rzs->compressor[0] = '\0';
+	rzs->backing_swap_name[0] = '\0';
 }
 
 static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 {
 	int ret;
-	size_t num_pages;
+	size_t num_pages, buckets;
 	struct page *page;
 	union swap_header *swap_header;
 
@@ -539,19 +1313,22 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 		return -EBUSY;
 	}
 
-	ramzswap_set_disksize(rzs, totalram_pages << PAGE_SHIFT);
+	if (!rzs->compressor[0])
+		strlcpy(rzs->compressor, compressor ? compressor :
+			default_compressor, sizeof(rzs->compressor));
 
-	rzs->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!rzs->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
+	if (rzs->backing_swap_name[0]) {
+		ret = ramzswap_setup_backing_swap(rzs);
+		if (ret)
+			goto fail;
 	}
 
-	rzs->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!rzs->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ramzswap_set_disksize(rzs, totalram_pages << PAGE_SHIFT);
+
+	ret = ramzswap_alloc_streams(rzs);
+	if (ret) {
+		pr_err("Error allocating %s compression streams\n",
+			rzs->compressor);
 		goto fail;
 	}
 
@@ -566,6 +1343,17 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	}
 	memset(rzs->table, 0, num_pages * sizeof(*rzs->table));
 
+	buckets = roundup_pow_of_two(max_t(size_t, 1,
+				num_pages / dedup_slots_per_bucket));
+	rzs->dedup_table = vmalloc(buckets * sizeof(*rzs->dedup_table));
+	if (!rzs->dedup_table) {
+		pr_err("Error allocating ramzswap dedup table\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	memset(rzs->dedup_table, 0, buckets * sizeof(*rzs->dedup_table));
+	rzs->dedup_mask = buckets - 1;
+
 	page = alloc_page(__GFP_ZERO);
 	if (!page) {
 		pr_err("Error allocating swap header page\n");
@@ -593,6 +1381,11 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 
 	rzs->init_done = 1;
 
+	if (rzs->backing_swap)
+		queue_delayed_work(wb_workqueue, &rzs->wb_work,
+				writeback_interval * HZ);
+
+	pr_info("Using %s compressor\n", rzs->compressor);
 	pr_debug("Initialization done!\n");
 	return 0;
 
@@ -634,9 +1427,49 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		pr_info("Disk size set to %zu kB\n", disksize_kb);
 		break;
 
+	case RZSIO_SET_BACKING_SWAP:
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(&rzs->backing_swap_name, (void *)arg,
+						_IOC_SIZE(cmd))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		rzs->backing_swap_name[MAX_SWAP_NAME_LEN - 1] = '\0';
+		pr_info("Backing swap set to %s\n", rzs->backing_swap_name);
+		break;
+
+	case RZSIO_SET_COMPRESSOR:
+	{
+		char name[RZS_COMPRESSOR_LEN];
+
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(name, (void *)arg, sizeof(name))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		name[sizeof(name) - 1] = '\0';
+		if (!crypto_has_comp(name, 0, 0)) {
+			pr_info("Compressor %s not available\n", name);
+			ret = -EINVAL;
+			goto out;
+		}
+		strlcpy(rzs->compressor, name, sizeof(rzs->compressor));
+		pr_info("Compressor set to %s\n", name);
+		break;
+	}
+
 	case RZSIO_GET_STATS:
+	case RZSIO_GET_STATS_EXT:
 	{
-		struct ramzswap_ioctl_stats *stats;
+		struct ramzswap_ioctl_stats_ext *stats;
+		size_t size = cmd == RZSIO_GET_STATS ?
+				sizeof(stats->base) : sizeof(*stats);
 		if (!rzs->init_done) {
 			ret = -ENOTTY;
 			goto out;
@@ -647,7 +1480,7 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 			goto out;
 		}
 		ramzswap_ioctl_get_stats(rzs, stats);
-		if (copy_to_user((void *)arg, stats, sizeof(*stats))) {
+		if (copy_to_user((void *)arg, stats, size)) {
 			kfree(stats);
 			ret = -EFAULT;
 			goto out;
@@ -659,6 +1492,14 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		ret = ramzswap_ioctl_init_device(rzs);
 		break;
 
+	case RZSIO_COMPACT:
+		if (!rzs->init_done) {
+			ret = -ENOTTY;
+			goto out;
+		}
+		ret = ramzswap_compact(rzs);
+		break;
+
 	case RZSIO_RESET:
 		/* Do not reset an active device! */
 		if (bdev->bd_holders) {
@@ -682,13 +1523,20 @@ out:
 	return ret;
 }
 
+static void ramzswap_free_slot(struct ramzswap *rzs, size_t index)
+{
+	spin_lock(&rzs->compact_lock);
+	ramzswap_free_page(rzs, index);
+	spin_unlock(&rzs->compact_lock);
+	rzs_stat64_inc(rzs, &rzs->stats.notify_free);
+}
+
 void ramzswap_slot_free_notify(struct block_device *bdev, unsigned long index)
 {
 	struct ramzswap *rzs;
 
 	rzs = bdev->bd_disk->private_data;
-	ramzswap_free_page(rzs, index);
-	rzs_stat64_inc(rzs, &rzs->stats.notify_free);
+	ramzswap_free_slot(rzs, index);
 
 	return;
 }
@@ -703,7 +1551,10 @@ static int create_device(struct ramzswap *rzs, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&rzs->lock);
+	spin_lock_init(&rzs->dedup_lock);
+	init_rwsem(&rzs->compact_sem);
+	INIT_DELAYED_WORK(&rzs->wb_work, ramzswap_wb_work);
+	spin_lock_init(&rzs->compact_lock);
 	spin_lock_init(&rzs->stat64_lock);
 
 	rzs->queue = blk_alloc_queue(GFP_KERNEL);
@@ -759,6 +1610,200 @@ static void destroy_device(struct ramzswap *rzs)
 		blk_cleanup_queue(rzs->queue);
 }
 
+#ifdef CONFIG_DEBUG_BENCH
+/*
+ * Writing N to the bench parameter runs N kernel threads over a scratch
+ * device. Each one takes BENCH_PAGES pages through the swap cycle: a write
+ * bio, a read bio for the same slot and a slot free, all handed to
+ * ramzswap_make_request() like the swap layer's own. The aggregate
+ * pages/sec is reported; a page that reads back wrong fails the run.
+ */
+#define BENCH_PAGES		10000
+#define BENCH_SLOTS		256	/* per thread */
+#define BENCH_MAX_THREADS	16
+
+struct rzs_bench {
+	struct ramzswap *rzs;
+	u32 first;			/* first slot of this thread */
+	int err;
+};
+
+static DEFINE_MUTEX(bench_lock);
+static DECLARE_COMPLETION(bench_done);
+static atomic_t bench_running;
+static int bench_threads;
+static unsigned long bench_rate;
+
+static int ramzswap_bench_io(struct ramzswap *rzs, struct page *page,
+			     u32 index, int rw)
+{
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = (sector_t)index << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_io_vec[0].bv_page = page;
+	bio->bi_io_vec[0].bv_len = PAGE_SIZE;
+	bio->bi_io_vec[0].bv_offset = 0;
+	bio->bi_vcnt = 1;
+	bio->bi_idx = 0;
+	bio->bi_size = PAGE_SIZE;
+	bio->bi_rw = rw;
+
+	/* no backing device, so every bio completes before this returns */
+	ramzswap_make_request(rzs->queue, bio);
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+	return ret;
+}
+
+static int ramzswap_bench_thread(void *data)
+{
+	struct rzs_bench *bench = data;
+	struct ramzswap *rzs = bench->rzs;
+	struct page *src, *dst;
+	u32 *word, index;
+	int i, ret = 0;
+
+	src = alloc_page(GFP_KERNEL);
+	dst = alloc_page(GFP_KERNEL);
+	if (!src || !dst) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* one in eight words random: compresses to roughly half a page */
+	word = page_address(src);
+	for (i = 0; i < PAGE_SIZE / sizeof(*word); i++)
+		word[i] = (i & 7) ? word[i - 1] : random32();
+
+	for (i = 0; i < BENCH_PAGES; i++) {
+		/* a fresh first word keeps dedup from short-cutting the write */
+		word[0] = i;
+		index = bench->first + i % BENCH_SLOTS;
+
+		ret = ramzswap_bench_io(rzs, src, index, WRITE);
+		if (!ret)
+			ret = ramzswap_bench_io(rzs, dst, index, READ);
+		if (!ret && memcmp(page_address(src), page_address(dst),
+				   PAGE_SIZE))
+			ret = -EIO;
+		ramzswap_free_slot(rzs, index);
+		if (ret)
+			break;
+	}
+
+out:
+	if (dst)
+		__free_page(dst);
+	if (src)
+		__free_page(src);
+	bench->err = ret;
+	if (atomic_dec_and_test(&bench_running))
+		complete(&bench_done);
+	return 0;
+}
+
+static int bench_set(const char *val, struct kernel_param *kp)
+{
+	struct task_struct **tasks;
+	struct rzs_bench *bench;
+	struct ramzswap *rzs;
+	unsigned long n;
+	ktime_t start;
+	s64 ns;
+	int i, ret;
+
+	if (strict_strtoul(val, 0, &n) || !n || n > BENCH_MAX_THREADS)
+		return -EINVAL;
+
+	/* the scratch device needs the driver up */
+	if (!devices)
+		return -ENODEV;
+
+	tasks = kcalloc(n, sizeof(*tasks), GFP_KERNEL);
+	bench = kcalloc(n, sizeof(*bench), GFP_KERNEL);
+	rzs = kzalloc(sizeof(*rzs), GFP_KERNEL);
+	if (!tasks || !bench || !rzs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	mutex_lock(&bench_lock);
+	/* the minor right after the configured devices is never in use */
+	ret = create_device(rzs, num_devices);
+	if (ret)
+		goto out_unlock;
+
+	/* slot 0 holds the swap header */
+	rzs->disksize = (1 + n * BENCH_SLOTS) << PAGE_SHIFT;
+	ret = ramzswap_ioctl_init_device(rzs);
+	if (ret)
+		goto out_destroy;
+
+	for (i = 0; i < n; i++) {
+		bench[i].rzs = rzs;
+		bench[i].first = 1 + i * BENCH_SLOTS;
+		tasks[i] = kthread_create(ramzswap_bench_thread, &bench[i],
+					  "ramzswap_bench/%d", i);
+		if (IS_ERR(tasks[i])) {
+			ret = PTR_ERR(tasks[i]);
+			while (--i >= 0)
+				kthread_stop(tasks[i]);
+			goto out_reset;
+		}
+	}
+
+	atomic_set(&bench_running, n);
+	INIT_COMPLETION(bench_done);
+	start = ktime_get();
+	for (i = 0; i < n; i++)
+		wake_up_process(tasks[i]);
+	wait_for_completion(&bench_done);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	for (i = 0; i < n; i++) {
+		if (bench[i].err) {
+			ret = bench[i].err;
+			pr_err("bench: thread %d failed: err=%d\n", i, ret);
+			goto out_reset;
+		}
+	}
+
+	bench_threads = n;
+	bench_rate = div64_u64((u64)n * BENCH_PAGES * NSEC_PER_SEC,
+			       ns ? ns : 1);
+	pr_info("bench: %d threads, %lu pages/sec with %s\n",
+		bench_threads, bench_rate, rzs->compressor);
+
+out_reset:
+	reset_device(rzs);
+out_destroy:
+	destroy_device(rzs);
+out_unlock:
+	mutex_unlock(&bench_lock);
+out:
+	kfree(rzs);
+	kfree(bench);
+	kfree(tasks);
+	return ret;
+}
+
+static int bench_get(char *buffer, struct kernel_param *kp)
+{
+	int ret;
+
+	mutex_lock(&bench_lock);
+	ret = sprintf(buffer, "%d threads, %lu pages/sec", bench_threads,
+		      bench_rate);
+	mutex_unlock(&bench_lock);
+	return ret;
+}
+#endif /* CONFIG_DEBUG_BENCH */
+
 static int __init ramzswap_init(void)
 {
 	int ret, dev_id;
@@ -770,11 +1815,23 @@ static int __init ramzswap_init(void)
 		goto out;
 	}
 
+	dedup_cache = KMEM_CACHE(rzs_dedup, 0);
+	if (!dedup_cache) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	wb_workqueue = create_singlethread_workqueue("ramzswap_wb");
+	if (!wb_workqueue) {
+		ret = -ENOMEM;
+		goto destroy_cache;
+	}
+
 	ramzswap_major = register_blkdev(0, "ramzswap");
 	if (ramzswap_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_wq;
 	}
 
 	if (!num_devices) {
@@ -803,6 +1860,10 @@ free_devices:
 		destroy_device(&devices[--dev_id]);
 unregister:
 	unregister_blkdev(ramzswap_major, "ramzswap");
+destroy_wq:
+	destroy_workqueue(wb_workqueue);
+destroy_cache:
+	kmem_cache_destroy(dedup_cache);
 out:
 	return ret;
 }
@@ -823,11 +1884,29 @@ static void __exit ramzswap_exit(void)
 	unregister_blkdev(ramzswap_major, "ramzswap");
 
 	kfree(devices);
+	destroy_workqueue(wb_workqueue);
+	kmem_cache_destroy(dedup_cache);
 	pr_debug("Cleanup done!\n");
 }
 
 module_param(num_devices, uint, 0);
 MODULE_PARM_DESC(num_devices, "Number of ramzswap devices");
+module_param(compressor, charp, 0);
+MODULE_PARM_DESC(compressor, "Default crypto API compressor (default: lzo)");
+module_param(writeback_interval, uint, 0644);
+MODULE_PARM_DESC(writeback_interval,
+	"Seconds between cold page scans when a backing device is set");
+module_param(writeback_age, uint, 0644);
+MODULE_PARM_DESC(writeback_age,
+	"Scans a page must go untouched before it is written back");
+module_param(writeback_clen, uint, 0644);
+MODULE_PARM_DESC(writeback_clen,
+	"Pages compressing to more bytes go straight to the backing device");
+#ifdef CONFIG_DEBUG_BENCH
+module_param_call(bench, bench_set, bench_get, NULL, 0644);
+MODULE_PARM_DESC(bench,
+	"Write N to time N threads swapping pages through a scratch device");
+#endif
 
 module_init(ramzswap_init);
 module_exit(ramzswap_exit);
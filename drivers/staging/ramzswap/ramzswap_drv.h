@@ -17,6 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/list.h>
+#include <linux/crypto.h>
 
 #include "ramzswap_ioctl.h"
 #include "xvmalloc.h"
@@ -34,13 +39,15 @@ static const unsigned max_num_devices = 32;
  * object. This is required to support memory defragmentation.
  */
 struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
+	struct rzs_dedup *dedup;	/* NULL if not in the dedup index */
+	u32 table_idx;	/* first table entry that stored this object */
 };
 
 /*-- Configurable parameters */
 
+/* Default compressor, see the compressor module param */
+static const char default_compressor[] = "lzo";
+
 /* Default ramzswap disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
@@ -56,6 +63,21 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
  * otherwise, xv_malloc() would always return failure.
  */
 
+/* Compaction only tries to empty pages at most this full (bytes) */
+static const unsigned compact_max_used = PAGE_SIZE / 2;
+
+/* Pages examined per compaction pass */
+static const unsigned compact_batch = 64;
+
+/* Pages written back to the backing device per I/O batch */
+#define WB_BATCH		16
+
+/* Table entries examined per hold of compact_sem during writeback scan */
+static const unsigned wb_scan_chunk = 1024;
+
+/* One dedup hash bucket for every this many swap slots */
+static const unsigned dedup_slots_per_bucket = 8;
+
 /*-- End of configurable params */
 
 #define SECTOR_SHIFT		9
@@ -71,6 +93,15 @@ enum rzs_pageflags {
 	/* Page consists entirely of zeros */
 	RZS_ZERO,
 
+	/* Page lives on the backing device, at the same index */
+	RZS_BACKED,
+
+	/* Page is being copied to the backing device */
+	RZS_WRITEBACK,
+
+	/* A writeback bio for this index is in flight (even if stale) */
+	RZS_WB_IO,
+
 	__NR_RZS_PAGEFLAGS,
 };
 
@@ -83,10 +114,39 @@ enum rzs_pageflags {
 struct table {
 	struct page *page;
 	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	u8 age;		/* writeback epoch of the last access */
 	u8 flags;
 } __attribute__((aligned(4)));
 
+/*
+ * Compressed objects are indexed by a hash of their uncompressed
+ * contents so that identical pages can share one object. refcount
+ * counts the table entries pointing at the object; it is protected by
+ * the device's dedup_lock. Incompressible pages are never shared.
+ */
+struct rzs_dedup {
+	struct hlist_node node;
+	struct page *page;
+	u16 offset;
+	u32 hash;
+	u32 refcount;
+};
+
+/*
+ * Cold page writeback state, only allocated when a backing device is
+ * configured. The worker decompresses each batch into pages[] with its
+ * own tfm, writes them out in index order and waits for completion.
+ */
+struct rzs_writeback {
+	struct crypto_comp *tfm;
+	struct page *pages[WB_BATCH];
+	u32 index[WB_BATCH];
+	int error[WB_BATCH];
+	atomic_t pending;
+	struct completion done;
+	wait_queue_head_t io_wait;	/* writers waiting on RZS_WB_IO */
+};
+
 struct ramzswap_stats {
 	/* basic stats */
 	size_t compr_size;	/* compressed size of pages stored -
@@ -103,16 +163,49 @@ struct ramzswap_stats {
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 pages_dedup;	/* no. of pages sharing another's object */
+	u64 num_compress;
+	u64 compr_ns;		/* total time spent compressing */
+	u64 num_decompress;
+	u64 decompr_ns;		/* total time spent decompressing */
+	u64 pages_compacted;	/* pool pages released by compaction */
+	u32 pages_backed;	/* no. of pages on the backing device */
+	u64 bdev_num_reads;
+	u64 bdev_num_writes;
+	u64 pages_written_back;
 #endif
 };
 
+/*
+ * Compression context. There is one per possible CPU so that swap-outs
+ * on different CPUs never share workmem or an output buffer; the mutex
+ * only matters when a writer is preempted and another one lands on the
+ * same CPU.
+ */
+struct rzs_stream {
+	struct mutex lock;
+	struct crypto_comp *tfm;
+	void *buffer;	/* 2 pages: compressed output can exceed PAGE_SIZE */
+};
+
 struct ramzswap {
 	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct rzs_stream *streams;	/* per-CPU */
 	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;
+	struct hlist_head *dedup_table;
+	u32 dedup_mask;
+	spinlock_t dedup_lock;	/* protect dedup_table and refcounts */
+	/*
+	 * Compaction and writeback move objects under everyone's feet:
+	 * they hold compact_sem for write to keep reads and writes (which
+	 * hold it for read across the whole request) out, and compact_lock
+	 * to serialize with slot free notifications, which can't sleep.
+	 * Dropping the RAM copy of a written back page only needs
+	 * compact_lock: a read of that page cancels the writeback first.
+	 */
+	struct rw_semaphore compact_sem;
+	spinlock_t compact_lock;
+	spinlock_t stat64_lock;	/* protect stats */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -122,6 +215,14 @@ struct ramzswap {
 	 * set equal to device size.
 	 */
 	size_t disksize;	/* bytes */
+	char compressor[RZS_COMPRESSOR_LEN];	/* crypto API name */
+
+	/* Optional backing device, same layout as the ramzswap disk */
+	unsigned char backing_swap_name[MAX_SWAP_NAME_LEN];
+	struct block_device *backing_swap;
+	struct rzs_writeback *wb;
+	struct delayed_work wb_work;
+	u8 wb_epoch;
 
 	struct ramzswap_stats stats;
 };
@@ -130,14 +231,18 @@ struct ramzswap {
 
 /* Debugging and Stats */
 #if defined(CONFIG_RAMZSWAP_STATS)
-static void rzs_stat_inc(u32 *v)
+static void rzs_stat_inc(struct ramzswap *rzs, u32 *v)
 {
+	spin_lock(&rzs->stat64_lock);
 	*v = *v + 1;
+	spin_unlock(&rzs->stat64_lock);
 }
 
-static void rzs_stat_dec(u32 *v)
+static void rzs_stat_dec(struct ramzswap *rzs, u32 *v)
 {
+	spin_lock(&rzs->stat64_lock);
 	*v = *v - 1;
+	spin_unlock(&rzs->stat64_lock);
 }
 
 static void rzs_stat64_inc(struct ramzswap *rzs, u64 *v)
@@ -147,6 +252,13 @@ static void rzs_stat64_inc(struct ramzswap *rzs, u64 *v)
 	spin_unlock(&rzs->stat64_lock);
 }
 
+static void rzs_stat64_add(struct ramzswap *rzs, u64 *v, u64 delta)
+{
+	spin_lock(&rzs->stat64_lock);
+	*v = *v + delta;
+	spin_unlock(&rzs->stat64_lock);
+}
+
 static u64 rzs_stat64_read(struct ramzswap *rzs, u64 *v)
 {
 	u64 val;
@@ -158,9 +270,10 @@ static u64 rzs_stat64_read(struct ramzswap *rzs, u64 *v)
 	return val;
 }
 #else
-#define rzs_stat_inc(v)
-#define rzs_stat_dec(v)
+#define rzs_stat_inc(r, v)
+#define rzs_stat_dec(r, v)
 #define rzs_stat64_inc(r, v)
+#define rzs_stat64_add(r, v, d)
 #define rzs_stat64_read(r, v)
 #endif /* CONFIG_RAMZSWAP_STATS */
 
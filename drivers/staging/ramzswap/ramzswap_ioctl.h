@@ -15,6 +15,9 @@
 #ifndef _RAMZSWAP_IOCTL_H_
 #define _RAMZSWAP_IOCTL_H_
 
+#define RZS_COMPRESSOR_LEN	16
+#define MAX_SWAP_NAME_LEN	128
+
 struct ramzswap_ioctl_stats {
 	u64 disksize;		/* user specified or equal to backing swap
 				 * size (if present) */
@@ -34,9 +37,29 @@ struct ramzswap_ioctl_stats {
 	u64 mem_used_total;
 } __attribute__ ((packed, aligned(4)));
 
+/* RZSIO_GET_STATS layout above is fixed; newer counters go here */
+struct ramzswap_ioctl_stats_ext {
+	struct ramzswap_ioctl_stats base;
+	u32 pages_dedup;	/* stored pages sharing an identical object */
+	u32 dedup_pct;		/* pages_dedup as % of pages_stored */
+	u64 compr_avg_ns;	/* mean compression latency */
+	u64 decompr_avg_ns;	/* mean decompression latency */
+	char compressor[RZS_COMPRESSOR_LEN];
+	u32 fragmentation_pct;	/* pool memory not holding objects */
+	u64 pages_compacted;	/* pool pages released by RZSIO_COMPACT */
+	u32 pages_backed;	/* pages currently on the backing device */
+	u64 bdev_num_reads;	/* reads forwarded to the backing device */
+	u64 bdev_num_writes;	/* incompressible pages sent straight to it */
+	u64 pages_written_back;	/* cold pages moved out of RAM */
+} __attribute__ ((packed, aligned(4)));
+
 #define RZSIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
 #define RZSIO_GET_STATS		_IOR('z', 1, struct ramzswap_ioctl_stats)
 #define RZSIO_INIT		_IO('z', 2)
 #define RZSIO_RESET		_IO('z', 3)
+#define RZSIO_SET_COMPRESSOR	_IOW('z', 4, char[RZS_COMPRESSOR_LEN])
+#define RZSIO_COMPACT		_IO('z', 5)
+#define RZSIO_SET_BACKING_SWAP	_IOW('z', 6, unsigned char[MAX_SWAP_NAME_LEN])
+#define RZSIO_GET_STATS_EXT	_IOR('z', 7, struct ramzswap_ioctl_stats_ext)
 
 #endif
@@ -14,6 +14,7 @@
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/mm.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 
@@ -284,9 +285,11 @@ static int grow_pool(struct xv_pool *pool, gfp_t flags)
 	if (unlikely(!page))
 		return -ENOMEM;
 
+	spin_lock(&pool->lock);
 	stat_inc(&pool->total_pages);
+	set_page_private(page, 0);
+	list_add(&page->lru, &pool->pages);
 
-	spin_lock(&pool->lock);
 	block = get_ptr_atomic(page, 0, KM_USER0);
 
 	block->size = PAGE_SIZE - XV_ALIGN;
@@ -317,6 +320,7 @@ struct xv_pool *xv_create_pool(void)
 		return NULL;
 
 	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->pages);
 
 	return pool;
 }
@@ -361,7 +365,8 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 
 	if (!*page) {
 		spin_unlock(&pool->lock);
-		if (flags & GFP_NOWAIT)
+		/* GFP_NOWAIT is zero, so test for what it leaves out */
+		if (!(flags & __GFP_WAIT))
 			return -ENOMEM;
 		error = grow_pool(pool, flags);
 		if (unlikely(error))
@@ -406,6 +411,9 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 	block->size = origsize;
 	clear_flag(block, BLOCK_FREE);
 
+	set_page_private(*page, page_private(*page) + size + XV_ALIGN);
+	pool->used_bytes += size + XV_ALIGN;
+
 	put_ptr_atomic(block, KM_USER0);
 	spin_unlock(&pool->lock);
 
@@ -434,6 +442,9 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 
 	block->size = ALIGN(block->size, XV_ALIGN);
 
+	set_page_private(page, page_private(page) - block->size - XV_ALIGN);
+	pool->used_bytes -= block->size + XV_ALIGN;
+
 	tmpblock = BLOCK_NEXT(block);
 	if (offset + block->size + XV_ALIGN == PAGE_SIZE)
 		tmpblock = NULL;
@@ -468,11 +479,12 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 
 	/* No used objects in this page. Free it. */
 	if (block->size == PAGE_SIZE - XV_ALIGN) {
+		list_del(&page->lru);
+		stat_dec(&pool->total_pages);
 		put_ptr_atomic(page_start, KM_USER0);
 		spin_unlock(&pool->lock);
 
 		__free_page(page);
-		stat_dec(&pool->total_pages);
 		return;
 	}
 
@@ -505,3 +517,81 @@ u64 xv_get_total_size_bytes(struct xv_pool *pool)
 {
 	return pool->total_pages << PAGE_SHIFT;
 }
+
+/*
+ * Returns memory actually handed out by the allocator, block headers
+ * included. The gap to xv_get_total_size_bytes() is fragmentation.
+ */
+u64 xv_get_used_size_bytes(struct xv_pool *pool)
+{
+	return pool->used_bytes;
+}
+
+/**
+ * xv_get_sparse_pages - find compaction candidates
+ * @pool: pool to search
+ * @max_used: only report pages with at most this many bytes allocated
+ * @pages: array to fill
+ * @nr_pages: size of @pages
+ *
+ * Each page returned holds an extra reference which the caller must
+ * drop with put_page(). The page may stop belonging to the pool (or
+ * change contents) as soon as the pool lock is dropped; callers have
+ * to revalidate any object they find in it.
+ */
+int xv_get_sparse_pages(struct xv_pool *pool, u32 max_used,
+			struct page **pages, int nr_pages)
+{
+	int nr = 0;
+	struct page *page;
+
+	spin_lock(&pool->lock);
+	list_for_each_entry(page, &pool->pages, lru) {
+		if (nr == nr_pages)
+			break;
+		if (page_private(page) > max_used)
+			continue;
+		get_page(page);
+		pages[nr++] = page;
+	}
+	spin_unlock(&pool->lock);
+
+	return nr;
+}
+
+/**
+ * xv_get_page_objects - list the objects allocated from a page
+ * @pool: pool owning @page
+ * @page: page from xv_get_sparse_pages()
+ * @offsets: filled with object offsets, as returned by xv_malloc()
+ * @nr_offsets: size of @offsets
+ *
+ * Returns the number of objects found, 0 if the page has already
+ * been given back.
+ */
+int xv_get_page_objects(struct xv_pool *pool, struct page *page,
+			u32 *offsets, int nr_offsets)
+{
+	int nr = 0;
+	u32 offset = 0;
+	void *page_start;
+	struct block_header *block;
+
+	spin_lock(&pool->lock);
+	if (!page_private(page)) {
+		spin_unlock(&pool->lock);
+		return 0;
+	}
+
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	while (offset < PAGE_SIZE && nr < nr_offsets) {
+		block = (struct block_header *)((char *)page_start + offset);
+		if (!test_flag(block, BLOCK_FREE))
+			offsets[nr++] = offset + XV_ALIGN;
+		offset += ALIGN(block->size, XV_ALIGN) + XV_ALIGN;
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+	spin_unlock(&pool->lock);
+
+	return nr;
+}
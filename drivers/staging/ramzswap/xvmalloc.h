@@ -26,5 +26,11 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset);
 
 u32 xv_get_object_size(void *obj);
 u64 xv_get_total_size_bytes(struct xv_pool *pool);
+u64 xv_get_used_size_bytes(struct xv_pool *pool);
+
+int xv_get_sparse_pages(struct xv_pool *pool, u32 max_used,
+			struct page **pages, int nr_pages);
+int xv_get_page_objects(struct xv_pool *pool, struct page *page,
+			u32 *offsets, int nr_offsets);
 
 #endif
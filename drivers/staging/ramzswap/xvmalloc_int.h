@@ -15,6 +15,7 @@
 
 #include <linux/kernel.h>
 #include <linux/types.h>
+#include <linux/list.h>
 
 /* User configurable params */
 
@@ -79,8 +80,16 @@ struct xv_pool {
 
 	struct freelist_entry freelist[NUM_FREE_LISTS];
 
+	/*
+	 * All pages owned by the pool, linked through page->lru. Each
+	 * page's page_private() holds the bytes allocated from it,
+	 * block headers included.
+	 */
+	struct list_head pages;
+
 	/* stats */
 	u64 total_pages;
+	u64 used_bytes;
 };
 
 #endif
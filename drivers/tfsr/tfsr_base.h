@@ -210,6 +210,14 @@ struct block_device_operations *bml_get_block_device_operations(void);
 int bml_blkdev_init(void);
 void bml_blkdev_exit(void);
 
+int fsr_pcache_init(u32 volume);
+void fsr_pcache_exit(u32 volume);
+int fsr_pcache_read(u32 volume, u32 vpn, u32 sct_off, u32 nsct, u8 *buf);
+void fsr_pcache_invalidate(u32 volume, u32 vpn, u32 npgs);
+void fsr_pcache_invalidate_all(void);
+void fsr_pcache_proc_init(void);
+void fsr_pcache_proc_exit(void);
+
 int stl_update_blkdev_param(u32 minor, u32 blkdev_size, u32 blkdev_blksize);
 stl_info_t *fsr_get_stl_info(u32 volume, u32 partno);
 struct block_device_operations *stl_get_block_device_operations(void);
@@ -242,6 +250,7 @@ struct fsr_dev
 	struct gendisk		*gd;
 	int			dev_id;
 	struct scatterlist	*sg;
+	struct task_struct	*thread;	/* I/O thread */
 };
 #else
 /* Kernel 2.4 */
@@ -20,6 +20,9 @@
 #include <linux/fs.h>
 #include <linux/version.h>
 #include <linux/proc_fs.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/scatterlist.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 15)
 #include <linux/platform_device.h>
 #else
@@ -37,6 +40,21 @@
 static DECLARE_MUTEX(bml_list_mutex);
 static LIST_HEAD(bml_list);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+/**
+ * bounce buffer for multi-segment reads, one per volume and shared by the
+ * I/O threads of all its partitions, which take turns with it
+ */
+struct bml_bounce
+{
+	struct mutex		lock;
+	char			*buf;
+	unsigned int		size;
+};
+
+static struct bml_bounce bml_bounce[FSR_MAX_VOLUMES];
+#endif
+
 #ifdef CONFIG_PM
 #include <linux/pm.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 15)
@@ -52,6 +70,250 @@ EXPORT_SYMBOL(bml_module_resume);
 
 #endif /* end of CONFIG_PM */
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+/**
+ * read sectors from BML into one contiguous buffer
+ * @param volume        : device number
+ * @param n1stVpn       : first virtual page of the partition
+ * @param sector        : first sector, relative to n1stVpn
+ * @param nsect         : number of sectors
+ * @param buf           : destination buffer
+ * @return              FSR_BML_SUCCESS on success, BML error code on failure
+ *
+ * All the whole pages go in a single FSR_BML_Read() so the LLD can stream
+ * them, only a partial first and last page go through the page cache.
+ */
+static int bml_read_sectors(u32 volume, u32 n1stVpn, unsigned long sector,
+		unsigned long nsect, char *buf)
+{
+	FSRVolSpec *vs;
+	u32 spp_shift, spp_mask;
+	unsigned long n;
+	int ret = FSR_BML_SUCCESS;
+
+	vs = fsr_get_vol_spec(volume);
+	spp_shift = ffs(vs->nSctsPerPg) - 1;
+	spp_mask = vs->nSctsPerPg - 1;
+
+	/* partial first page */
+	if (sector & spp_mask)
+	{
+		n = vs->nSctsPerPg - (sector & spp_mask);
+		if (n > nsect)
+		{
+			n = nsect;
+		}
+		ret = fsr_pcache_read(volume, n1stVpn + (sector >> spp_shift),
+				sector & spp_mask, n, buf);
+		sector += n;
+		nsect -= n;
+		buf += n << SECTOR_BITS;
+	}
+
+	/* whole pages */
+	n = nsect & ~spp_mask;
+	if (ret == FSR_BML_SUCCESS && n)
+	{
+		ret = FSR_BML_Read(volume, n1stVpn + (sector >> spp_shift),
+				n >> spp_shift, buf, NULL, FSR_BML_FLAG_ECC_ON);
+		sector += n;
+		nsect -= n;
+		buf += n << SECTOR_BITS;
+	}
+
+	/* partial last page */
+	if (ret == FSR_BML_SUCCESS && nsect)
+	{
+		ret = fsr_pcache_read(volume, n1stVpn + (sector >> spp_shift),
+				0, nsect, buf);
+	}
+
+	return ret;
+}
+
+/**
+ * transfer a whole request from BML to buffer cache
+ * @param dev           : fsr block device
+ * @param req           : request description
+ * @return              0 on success, otherwise on failure
+ *
+ * The request is mapped to a scatterlist. A single segment is read in
+ * place. Several segments are read as one run of pages into the bounce
+ * buffer and then copied out, which costs far less than reading one
+ * segment at a time from NAND.
+ */
+static int bml_transfer(struct fsr_dev *dev, struct request *req)
+{
+	u32 minor, volume, partno;
+	u32 nPgsPerUnit = 0, n1stVpn = 0;
+	unsigned long sector, nsect;
+	struct scatterlist *sg;
+	struct bml_bounce *bb;
+	FSRPartI *ps;
+	char *buf;
+	int nsg, i;
+	int ret = FSR_BML_SUCCESS;
+
+	if (!blk_fs_request(req))
+	{
+		return -EIO;
+	}
+
+	if (rq_data_dir(req) != READ)
+	{
+		ERRPRINTK("Unknown request 0x%x\n", (u32) rq_data_dir(req));
+		return -EINVAL;
+	}
+
+	minor = dev->gd->first_minor;
+	volume = fsr_vol(minor);
+	partno = fsr_part(minor);
+	ps = fsr_get_part_spec(volume);
+	bb = &bml_bounce[volume];
+
+	DEBUG(DL3,"TINY[I]: volume(%d), partno(%d)\n", volume, partno);
+
+	if(!fsr_is_whole_dev(partno))
+	{
+		if (FSR_BML_GetVirUnitInfo(volume, 
+			fsr_part_start(ps, partno), &n1stVpn, &nPgsPerUnit) 
+				!= FSR_BML_SUCCESS)
+		{
+			ERRPRINTK("FSR_BML_GetVirUnitInfo FAIL\n");
+			return -EIO;
+		}
+	}
+
+	sector = blk_rq_pos(req);
+	nsect = blk_rq_sectors(req);
+	nsg = blk_rq_map_sg(dev->queue, req, dev->sg);
+
+	if (nsg == 1)
+	{
+		ret = bml_read_sectors(volume, n1stVpn, sector, nsect,
+				sg_virt(dev->sg));
+	}
+	else if (bb->buf && (nsect << SECTOR_BITS) <= bb->size)
+	{
+		mutex_lock(&bb->lock);
+		ret = bml_read_sectors(volume, n1stVpn, sector, nsect,
+				bb->buf);
+		buf = bb->buf;
+		for_each_sg(dev->sg, sg, nsg, i)
+		{
+			if (ret != FSR_BML_SUCCESS)
+			{
+				break;
+			}
+			memcpy(sg_virt(sg), buf, sg->length);
+			buf += sg->length;
+		}
+		mutex_unlock(&bb->lock);
+	}
+	else
+	{
+		for_each_sg(dev->sg, sg, nsg, i)
+		{
+			if (ret != FSR_BML_SUCCESS)
+			{
+				break;
+			}
+			ret = bml_read_sectors(volume, n1stVpn, sector,
+					sg->length >> SECTOR_BITS, sg_virt(sg));
+			sector += sg->length >> SECTOR_BITS;
+		}
+	}
+
+	/* I/O error */
+	if (ret != FSR_BML_SUCCESS) 
+	{
+		ERRPRINTK("TINY: transfer error = %X\n", ret);
+		return -EIO;
+	}
+
+	rq_flush_dcache_pages(req);
+
+	DEBUG(DL3,"TINY[O]: volume(%d), partno(%d)\n", volume, partno);
+
+	return 0;
+}
+
+/**
+ * I/O thread of a block device
+ * @param arg           : fsr block device
+ * @return              0
+ *
+ * Takes whole requests off the queue and reads them from NAND with the
+ * queue lock dropped, so the block layer can keep merging new requests
+ * while a transfer is in flight.
+ */
+static int bml_thread(void *arg)
+{
+	struct fsr_dev *dev = arg;
+	struct request_queue *rq = dev->queue;
+	struct request *req;
+	int error;
+
+	spin_lock_irq(rq->queue_lock);
+
+	while (1)
+	{
+		/* before the checks, or a wakeup in between would be lost */
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		if (kthread_should_stop())
+		{
+			break;
+		}
+
+		req = blk_fetch_request(rq);
+		if (!req)
+		{
+			spin_unlock_irq(rq->queue_lock);
+			schedule();
+			spin_lock_irq(rq->queue_lock);
+			continue;
+		}
+
+		__set_current_state(TASK_RUNNING);
+		dev->req = req;
+		spin_unlock_irq(rq->queue_lock);
+
+		error = bml_transfer(dev, req);
+
+		spin_lock_irq(rq->queue_lock);
+		__blk_end_request_all(req, error);
+		dev->req = NULL;
+	}
+
+	__set_current_state(TASK_RUNNING);
+	spin_unlock_irq(rq->queue_lock);
+
+	return 0;
+}
+
+/**
+ * request function, hands the work to the I/O thread
+ * @param rq    : request queue which is created by blk_init_queue()
+ * @return              none
+ */
+static void bml_request(struct request_queue *rq)
+{
+	struct fsr_dev *dev = rq->queuedata;
+	struct request *req;
+
+	if (!dev->thread)
+	{
+		while ((req = blk_fetch_request(rq)) != NULL)
+		{
+			__blk_end_request_all(req, -ENODEV);
+		}
+		return;
+	}
+
+	wake_up_process(dev->thread);
+}
+#else
 /**
  * transger data from BML to buffer cache
  * @param volume        : device number
@@ -61,11 +323,7 @@ EXPORT_SYMBOL(bml_module_resume);
  *
  * It will erase a block before it do write the data
  */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-static int bml_transfer(u32 volume, u32 partno, const struct request *req, u32 data_len)
-#else
 static int bml_transfer(u32 volume, u32 partno, const struct request *req)
-#endif
 {
 	unsigned long sector, nsect;
 	char *buf;
@@ -81,13 +339,8 @@ static int bml_transfer(u32 volume, u32 partno, const struct request *req)
 		return 0;
 	}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-	sector = blk_rq_pos(req);
-	nsect = data_len >> 9;
-#else
 	sector = req->sector;
 	nsect = req->current_nr_sectors;
-#endif
 	buf = req->buffer;
 	
 	vs = fsr_get_vol_spec(volume);
@@ -156,10 +409,6 @@ static void bml_request(struct request_queue *rq)
 	int ret;
 #endif
 	int trans_ret;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-	int error = 0;
-	u32 len = 0;
-#endif
 
 	FSRVolSpec *vs;
 
@@ -169,11 +418,7 @@ static void bml_request(struct request_queue *rq)
 	if (dev->req)
 		return;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-	while ((dev->req = req = blk_peek_request(rq)) != NULL)
-#else
 	while ((dev->req = req = elv_next_request(rq)) != NULL) 
-#endif
 	{
 		spin_unlock_irq(rq->queue_lock);
 		
@@ -185,23 +430,6 @@ static void bml_request(struct request_queue *rq)
 		
 		DEBUG(DL3,"TINY[I]: volume(%d), partno(%d)\n", volume, partno);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-		len = blk_rq_cur_bytes(req);
-		if (!( blk_rq_pos(req) & spp_mask) && ( blk_rq_cur_sectors(req) != blk_rq_sectors(req)))
-		{
-			blk_rq_map_sg(rq, req, dev->sg);
-			if (!((dev->sg->length >> SECTOR_BITS) & 0x7))
-			{
-				len = dev->sg->length;
-			}
-			if (len > blk_rq_bytes(req))
-			{
-				len = blk_rq_bytes(req);
-			}
-
-		}
-		trans_ret = bml_transfer(volume, partno, req, len);
-#else
 		if (!(req->sector & spp_mask) && (req->current_nr_sectors != req->nr_sectors))
 		{
 			blk_rq_map_sg(rq, req, dev->sg);
@@ -215,23 +443,9 @@ static void bml_request(struct request_queue *rq)
 			}
 		}
 		trans_ret = bml_transfer(volume, partno, req);
-#endif
 		
 		spin_lock_irq(rq->queue_lock);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
-		if (trans_ret)
-		{
-			error = 0;
-		} else
-		{
-			error = -EIO;
-		}
-		/* don't need to check if request is finished */
-		if (blk_rq_sectors(req) <= (len >> 9))
-			list_del_init(&req->queuelist);
-		__blk_end_request(req, error, len);
-
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 25)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 25)
 		req->hard_cur_sectors = req->current_nr_sectors;
 		end_request(req, trans_ret);
 #else	
@@ -253,6 +467,7 @@ static void bml_request(struct request_queue *rq)
 
 	DEBUG(DL3,"TINY[O]\n");
 }
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31) */
 
 /**
  * add each partitions as disk
@@ -265,6 +480,9 @@ static int bml_add_disk(u32 volume, u32 partno)
 {
 	u32 minor, sectors;
 	struct fsr_dev *dev;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+	struct bml_bounce *bb = &bml_bounce[volume];
+#endif
 	FSRPartI *pi;
 	
 	DEBUG(DL3,"TINY[I]: volume(%d), partno(%d)\n", volume, partno);
@@ -327,6 +545,35 @@ static int bml_add_disk(u32 volume, u32 partno)
 	}
 	
 	minor = fsr_minor(volume, partno);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+	/*
+	 * the first disk of a volume sets up its bounce buffer,
+	 * without it each segment is read on its own
+	 */
+	if (!bb->buf)
+	{
+		bb->size = queue_max_hw_sectors(dev->queue) << SECTOR_BITS;
+		bb->buf = kmalloc(bb->size, GFP_KERNEL);
+		if (!bb->buf)
+		{
+			ERRPRINTK("No bounce buffer for volume %d\r\n", volume);
+		}
+	}
+
+	dev->thread = kthread_run(bml_thread, dev, "%sd%d", DEVICE_NAME, minor);
+	if (IS_ERR(dev->thread))
+	{
+		dev->thread = NULL;
+		put_disk(dev->gd);
+		blk_cleanup_queue(dev->queue);
+		kfree(dev->sg);
+		list_del(&dev->list);
+		kfree(dev);
+		ERRPRINTK("No I/O thread for %s%d\r\n", DEVICE_NAME, minor);
+		return -ENOMEM;
+	}
+#endif
 	
 	dev->gd->major = MAJOR_NR;
 	dev->gd->first_minor = minor;
@@ -371,6 +618,23 @@ static void bml_del_disk(struct fsr_dev *dev)
 {
 	DEBUG(DL3,"TINY[I]\n");
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+	/*
+	 * The thread uses dev->gd, so it goes first. Once dev->thread is
+	 * cleared under the queue lock, bml_request() fails new requests
+	 * itself, and the ones the thread left behind are failed here.
+	 */
+	if (dev->thread)
+	{
+		kthread_stop(dev->thread);
+
+		spin_lock_irq(dev->queue->queue_lock);
+		dev->thread = NULL;
+		bml_request(dev->queue);
+		spin_unlock_irq(dev->queue->queue_lock);
+	}
+#endif
+
 	if (dev->gd) 
 	{
 		del_gendisk(dev->gd);
@@ -404,6 +668,9 @@ static int bml_blkdev_create(void)
 
 	for (volume = 0; volume < FSR_MAX_VOLUMES; volume++) 
 	{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+		mutex_init(&bml_bounce[volume].lock);
+#endif
 		ret = FSR_BML_Open(volume, FSR_BML_FLAG_NONE);
 		
 		if (ret != FSR_BML_SUCCESS) 
@@ -418,6 +685,10 @@ static int bml_blkdev_create(void)
 			FSR_BML_Close(volume, FSR_BML_FLAG_NONE);
 			continue;
 		}
+		if (fsr_pcache_init(volume))
+		{
+			ERRPRINTK("No page cache for volume %d\r\n", volume);
+		}
 		pi = fsr_get_part_spec(volume);
 		nparts = fsr_parts_nr(pi);
 		/*
@@ -521,6 +792,9 @@ static int tfsr_resume(struct device *dev, u32 level)
 			ERRPRINTK("TinyFSR: bml_module_resume fail\n");
 	} 
 
+	/* NAND may have been written while we were away */
+	fsr_pcache_invalidate_all();
+
 	DEBUG(DL3,"TINY[I]\n");
 
 	return ret;
@@ -611,6 +885,8 @@ int __init bml_blkdev_init(void)
 		return -ENODEV;
 	}
 
+	fsr_pcache_proc_init();
+
 	DEBUG(DL3,"TINY[O]\n");
 
 	return 0;
@@ -635,6 +911,8 @@ void __exit bml_blkdev_exit(void)
 		}
 	}
 
+	fsr_pcache_proc_exit();
+
 	platform_device_unregister(&tfsr_device);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 15)
         platform_driver_unregister(&tfsr_driver);
@@ -642,6 +920,14 @@ void __exit bml_blkdev_exit(void)
 	driver_unregister(&tfsr_driver);
 #endif
 	bml_blkdev_free();
+	for (volume = 0; volume < FSR_MAX_VOLUMES; volume++)
+	{
+		fsr_pcache_exit(volume);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+		kfree(bml_bounce[volume].buf);
+		bml_bounce[volume].buf = NULL;
+#endif
+	}
 	unregister_blkdev(MAJOR_NR, DEVICE_NAME);
 }
 
@@ -0,0 +1,296 @@
+/*
+ *---------------------------------------------------------------------------*
+ *                                                                           *
+ * Copyright (C) 2003-2010 Samsung Electronics                               *
+ * This program is free software; you can redistribute it and/or modify      *
+ * it under the terms of the GNU General Public License version 2 as         *
+ * published by the Free Software Foundation.                                *
+ *                                                                           *
+ *---------------------------------------------------------------------------*
+*/
+/**
+ * @file        drivers/tfsr/tfsr_pcache.c
+ * @brief       Per-volume cache of NAND pages for partial page reads
+ *
+ * Sector reads which do not cover a whole page, mostly file system
+ * metadata, keep coming back to the same few pages. Such a page is read
+ * whole once and kept here. Whole page reads do not go through the cache.
+ *
+ * TinyFSR never writes, but the full FSR stack can write and erase the same
+ * volume, so it must call fsr_pcache_invalidate() for every page it changes.
+ * The cache is also dropped on resume.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/proc_fs.h>
+
+#include "tfsr_base.h"
+
+#define PCACHE_PAGES		CONFIG_TINY_FSR_PAGE_CACHE
+
+struct fsr_pcache_entry
+{
+	u32			vpn;
+	u32			last_use;
+	int			valid;
+	u8			*data;
+};
+
+struct fsr_pcache
+{
+	struct mutex		lock;
+	int			nr_entries;	/* 0 when there is no cache */
+	struct fsr_pcache_entry	entry[PCACHE_PAGES];
+	u32			use;
+	u32			hits;
+	u32			misses;
+	u32			invalidations;
+};
+
+static struct fsr_pcache pcache[FSR_MAX_VOLUMES];
+
+static struct proc_dir_entry *fsr_proc_dir;
+
+/**
+ * set up the page cache of a volume
+ * @param volume        : a volume number
+ * @return              0 on success, -ENOMEM when not a single page fits
+ *
+ * The volume spec has to be read first, it gives the page size.
+ */
+int fsr_pcache_init(u32 volume)
+{
+	struct fsr_pcache *pc = &pcache[volume];
+	FSRVolSpec *vs = fsr_get_vol_spec(volume);
+	u32 page_size = vs->nSctsPerPg << SECTOR_BITS;
+	int i;
+
+	memset(pc, 0, sizeof(struct fsr_pcache));
+	mutex_init(&pc->lock);
+
+	for (i = 0; i < PCACHE_PAGES; i++)
+	{
+		pc->entry[i].data = kmalloc(page_size, GFP_KERNEL);
+		if (!pc->entry[i].data)
+		{
+			break;
+		}
+	}
+	pc->nr_entries = i;
+
+	if (PCACHE_PAGES && !pc->nr_entries)
+	{
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * free the page cache of a volume
+ * @param volume        : a volume number
+ */
+void fsr_pcache_exit(u32 volume)
+{
+	struct fsr_pcache *pc = &pcache[volume];
+	int i;
+
+	if (!pc->nr_entries)
+	{
+		return;
+	}
+
+	mutex_lock(&pc->lock);
+	for (i = 0; i < pc->nr_entries; i++)
+	{
+		kfree(pc->entry[i].data);
+		pc->entry[i].data = NULL;
+		pc->entry[i].valid = 0;
+	}
+	pc->nr_entries = 0;
+	mutex_unlock(&pc->lock);
+}
+
+/**
+ * read sectors of one page through the page cache
+ * @param volume        : a volume number
+ * @param vpn           : virtual page number
+ * @param sct_off       : first sector in the page
+ * @param nsct          : number of sectors, at most to the end of the page
+ * @param buf           : destination buffer
+ * @return              FSR_BML_SUCCESS on success, BML error code on failure
+ *
+ * On a miss the whole page is read and replaces the least recently used one.
+ */
+int fsr_pcache_read(u32 volume, u32 vpn, u32 sct_off, u32 nsct, u8 *buf)
+{
+	struct fsr_pcache *pc = &pcache[volume];
+	struct fsr_pcache_entry *e = NULL;
+	int ret;
+	int i;
+
+	if (!pc->nr_entries)
+	{
+		return FSR_BML_ReadScts(volume, vpn, sct_off, nsct, buf,
+				NULL, FSR_BML_FLAG_ECC_ON);
+	}
+
+	mutex_lock(&pc->lock);
+
+	for (i = 0; i < pc->nr_entries; i++)
+	{
+		if (pc->entry[i].valid && pc->entry[i].vpn == vpn)
+		{
+			e = &pc->entry[i];
+			break;
+		}
+	}
+
+	if (e)
+	{
+		pc->hits++;
+	}
+	else
+	{
+		/* take a free entry, else the least recently used one */
+		for (i = 0; i < pc->nr_entries; i++)
+		{
+			if (!pc->entry[i].valid)
+			{
+				e = &pc->entry[i];
+				break;
+			}
+			if (!e || pc->entry[i].last_use < e->last_use)
+			{
+				e = &pc->entry[i];
+			}
+		}
+
+		e->valid = 0;
+		ret = FSR_BML_Read(volume, vpn, 1, e->data, NULL,
+				FSR_BML_FLAG_ECC_ON);
+		if (ret != FSR_BML_SUCCESS)
+		{
+			mutex_unlock(&pc->lock);
+			return ret;
+		}
+		e->vpn = vpn;
+		e->valid = 1;
+		pc->misses++;
+	}
+
+	e->last_use = ++pc->use;
+	memcpy(buf, e->data + (sct_off << SECTOR_BITS), nsct << SECTOR_BITS);
+
+	mutex_unlock(&pc->lock);
+
+	return FSR_BML_SUCCESS;
+}
+
+/**
+ * drop cached pages which have been written or erased
+ * @param volume        : a volume number
+ * @param vpn           : first virtual page number
+ * @param npgs          : number of pages, (u32)-1 for the rest of the volume
+ * @return              none
+ *
+ * Has to be called by anything writing or erasing a volume behind TinyFSR's
+ * back. May sleep.
+ */
+void fsr_pcache_invalidate(u32 volume, u32 vpn, u32 npgs)
+{
+	struct fsr_pcache *pc;
+	int i;
+
+	if (volume >= FSR_MAX_VOLUMES)
+	{
+		return;
+	}
+
+	pc = &pcache[volume];
+	if (!pc->nr_entries)
+	{
+		return;
+	}
+
+	mutex_lock(&pc->lock);
+	for (i = 0; i < pc->nr_entries; i++)
+	{
+		if (pc->entry[i].valid && pc->entry[i].vpn - vpn < npgs)
+		{
+			pc->entry[i].valid = 0;
+			pc->invalidations++;
+		}
+	}
+	mutex_unlock(&pc->lock);
+}
+EXPORT_SYMBOL(fsr_pcache_invalidate);
+
+/**
+ * drop every cached page of every volume
+ */
+void fsr_pcache_invalidate_all(void)
+{
+	u32 volume;
+
+	for (volume = 0; volume < FSR_MAX_VOLUMES; volume++)
+	{
+		fsr_pcache_invalidate(volume, 0, (u32) -1);
+	}
+}
+
+static int fsr_pcache_read_proc(char *page, char **start, off_t off,
+		int count, int *eof, void *data)
+{
+	struct fsr_pcache *pc;
+	u32 volume;
+	int len = 0;
+
+	for (volume = 0; volume < FSR_MAX_VOLUMES; volume++)
+	{
+		pc = &pcache[volume];
+		if (!pc->nr_entries)
+		{
+			continue;
+		}
+		len += snprintf(page + len, PAGE_SIZE - len,
+				"vol%d: pages %d hits %u misses %u invalidations %u\n",
+				volume, pc->nr_entries, pc->hits, pc->misses,
+				pc->invalidations);
+	}
+
+	*eof = 1;
+	return len;
+}
+
+/**
+ * create /proc/tinyFSR/pcache
+ */
+void fsr_pcache_proc_init(void)
+{
+	fsr_proc_dir = proc_mkdir(TINYFSR_PROC_DIR, NULL);
+	if (!fsr_proc_dir)
+	{
+		ERRPRINTK("TINY: can't create /proc/%s\n", TINYFSR_PROC_DIR);
+		return;
+	}
+
+	create_proc_read_entry("pcache", 0444, fsr_proc_dir,
+			fsr_pcache_read_proc, NULL);
+}
+
+/**
+ * remove /proc/tinyFSR/pcache
+ */
+void fsr_pcache_proc_exit(void)
+{
+	if (fsr_proc_dir)
+	{
+		remove_proc_entry("pcache", fsr_proc_dir);
+		remove_proc_entry(TINYFSR_PROC_DIR, NULL);
+		fsr_proc_dir = NULL;
+	}
+}
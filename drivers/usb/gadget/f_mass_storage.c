@@ -289,6 +289,10 @@
 #include <linux/string.h>
 #include <linux/freezer.h>
 #include <linux/utsname.h>
+#include <linux/backing-dev.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 
 #include <linux/usb/ch9.h>
 #include <linux/usb/gadget.h>
@@ -331,6 +335,29 @@ static const char fsg_string_interface[] = "Mass Storage";
 
 #include "storage_common.c"
 
+/* Pipeline depth and buffer size, and how much written data may pile up
+ * in the page cache before background writeback is started. */
+static unsigned int fsg_num_buffers = 4;
+module_param_named(num_buffers, fsg_num_buffers, uint, S_IRUGO);
+MODULE_PARM_DESC(num_buffers, "number of pipeline buffers, 2 to 32");
+
+static unsigned int fsg_buflen = 32768;
+module_param_named(buflen, fsg_buflen, uint, S_IRUGO);
+MODULE_PARM_DESC(buflen, "size of each pipeline buffer in bytes");
+
+static unsigned int fsg_writeback_kb = 1024;
+module_param_named(writeback_kb, fsg_writeback_kb, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(writeback_kb, "start writeback after this much written, 0 for never");
+
+#define FSG_MAX_NUM_BUFFERS	32
+#define FSG_MAX_BUFLEN		((u32)131072)
+
+/* Read-ahead grows up to 1 << FSG_RA_MAX_SHIFT times the pipeline while
+ * reads are sequential, and is turned off after FSG_RA_RANDOM_READS
+ * reads which are not. */
+#define FSG_RA_MAX_SHIFT	3
+#define FSG_RA_RANDOM_READS	4
+
 struct fsg_common  *cdfs_fsg_common;
 EXPORT_SYMBOL(cdfs_fsg_common);
 /*-------------------------------------------------------------------------*/
@@ -361,7 +388,12 @@ struct fsg_common {
 
 	struct fsg_buffhd	*next_buffhd_to_fill;
 	struct fsg_buffhd	*next_buffhd_to_drain;
-	struct fsg_buffhd	buffhds[FSG_NUM_BUFFERS];
+	struct fsg_buffhd	*buffhds;
+	unsigned int		num_buffers;
+	u32			buflen;
+
+	/* background writeback of data the host wrote, one work per LUN */
+	struct workqueue_struct	*writeback_wq;
 
 	int			cmnd_size;
 	u8			cmnd[MAX_COMMAND_SIZE];
@@ -1111,6 +1143,81 @@ transfer_request = fsg->cmnd[9];
 
 /*-------------------------------------------------------------------------*/
 
+/* Widen read-ahead on the backing file while the host reads sequentially,
+ * and turn it off while the host seeks around. */
+static void fsg_lun_adapt_readahead(struct fsg_common *common,
+				    struct fsg_lun *curlun, loff_t file_offset)
+{
+	struct file	*filp = curlun->filp;
+	unsigned long	ra_pages, pipeline;
+
+	if (file_offset == curlun->next_read_offset) {
+		curlun->random_reads = 0;
+		if (curlun->seq_reads < FSG_RA_MAX_SHIFT)
+			++curlun->seq_reads;
+	} else {
+		curlun->seq_reads = 0;
+		if (curlun->random_reads < FSG_RA_RANDOM_READS)
+			++curlun->random_reads;
+	}
+	curlun->next_read_offset = file_offset + common->data_size_from_cmnd;
+
+	ra_pages = filp->f_mapping->backing_dev_info->ra_pages;
+	pipeline = (common->num_buffers * common->buflen) >> PAGE_CACHE_SHIFT;
+
+	spin_lock(&filp->f_lock);
+	if (curlun->seq_reads) {
+		filp->f_mode &= ~FMODE_RANDOM;
+		filp->f_ra.ra_pages = max(ra_pages, pipeline) <<
+					curlun->seq_reads;
+	} else if (curlun->random_reads >= FSG_RA_RANDOM_READS) {
+		filp->f_mode |= FMODE_RANDOM;
+		filp->f_ra.ra_pages = ra_pages;
+	}
+	spin_unlock(&filp->f_lock);
+}
+
+static void fsg_writeback_work(struct work_struct *work)
+{
+	struct fsg_lun *curlun =
+		container_of(work, struct fsg_lun, writeback_work);
+	struct file *filp;
+
+	filp = xchg(&curlun->writeback_filp, NULL);
+	if (filp) {
+		filemap_flush(filp->f_mapping);
+		fput(filp);
+	}
+}
+
+/* Start writeback of what the host wrote, without waiting for it, so that
+ * long writes don't end in the thread stalling on dirty page limits.
+ * Only the main thread sets writeback_filp; while a flush of this LUN
+ * is still pending, keep counting and try again on a later write. */
+static void fsg_lun_start_writeback(struct fsg_common *common,
+				    struct fsg_lun *curlun)
+{
+	if (curlun->writeback_filp)
+		return;
+
+	curlun->unflushed = 0;
+	get_file(curlun->filp);
+	curlun->writeback_filp = curlun->filp;
+	queue_work(common->writeback_wq, &curlun->writeback_work);
+}
+
+/* throughput totals are read from sysfs, so they change under common->lock */
+static void fsg_lun_account(struct fsg_common *common, u64 *bytes,
+			    s64 *usecs, u32 amount, ktime_t start)
+{
+	s64 delta = ktime_us_delta(ktime_get(), start);
+
+	spin_lock_irq(&common->lock);
+	*bytes += amount;
+	*usecs += delta;
+	spin_unlock_irq(&common->lock);
+}
+
 static int do_read(struct fsg_common *common)
 {
 	struct fsg_lun		*curlun = common->curlun;
@@ -1122,6 +1229,7 @@ static int do_read(struct fsg_common *common)
 	unsigned int		amount;
 	unsigned int		partial_page;
 	ssize_t			nread;
+	ktime_t			start = ktime_get();
 
 	/* Get the starting Logical Block Address and check that it's
 	 * not too big */
@@ -1149,6 +1257,8 @@ static int do_read(struct fsg_common *common)
 	if (unlikely(amount_left == 0))
 		return -EIO;		/* No default reply */
 
+	fsg_lun_adapt_readahead(common, curlun, file_offset);
+
 	for (;;) {
 
 		/* Figure out how much we need to read:
@@ -1159,7 +1269,7 @@ static int do_read(struct fsg_common *common)
 		 *	the next page.
 		 * If this means reading 0 then we were asked to read past
 		 *	the end of file. */
-		amount = min(amount_left, FSG_BUFLEN);
+		amount = min(amount_left, common->buflen);
 		amount = min((loff_t) amount,
 				curlun->file_length - file_offset);
 		partial_page = file_offset & (PAGE_CACHE_SIZE - 1);
@@ -1234,6 +1344,8 @@ static int do_read(struct fsg_common *common)
 		common->next_buffhd_to_fill = bh->next;
 	}
 
+	fsg_lun_account(common, &curlun->read_bytes, &curlun->read_usecs,
+			common->data_size_from_cmnd - amount_left, start);
 	return -EIO;		/* No default reply */
 }
 
@@ -1252,6 +1364,7 @@ static int do_write(struct fsg_common *common)
 	unsigned int		partial_page;
 	ssize_t			nwritten;
 	int			rc;
+	ktime_t			start = ktime_get();
 
 	if (curlun->ro) {
 		curlun->sense_data = SS_WRITE_PROTECTED;
@@ -1310,7 +1423,7 @@ static int do_write(struct fsg_common *common)
 			 * If this means getting 0, then we were asked
 			 *	to write past the end of file.
 			 * Finally, round down to a block boundary. */
-			amount = min(amount_left_to_req, FSG_BUFLEN);
+			amount = min(amount_left_to_req, common->buflen);
 			amount = min((loff_t) amount, curlun->file_length -
 					usb_offset);
 			partial_page = usb_offset & (PAGE_CACHE_SIZE - 1);
@@ -1407,6 +1520,11 @@ static int do_write(struct fsg_common *common)
 			amount_left_to_write -= nwritten;
 			common->residue -= nwritten;
 
+			curlun->unflushed += nwritten;
+			if (fsg_writeback_kb &&
+			    curlun->unflushed >= fsg_writeback_kb << 10)
+				fsg_lun_start_writeback(common, curlun);
+
 			/* If an error occurred, report it and its position */
 			if (nwritten < amount) {
 				curlun->sense_data = SS_WRITE_ERROR;
@@ -1429,6 +1547,9 @@ static int do_write(struct fsg_common *common)
 			return rc;
 	}
 
+	fsg_lun_account(common, &curlun->write_bytes, &curlun->write_usecs,
+			common->data_size_from_cmnd - amount_left_to_write,
+			start);
 	return -EIO;		/* No default reply */
 }
 
@@ -1513,7 +1634,7 @@ static int do_verify(struct fsg_common *common)
 		 * And don't try to read past the end of the file.
 		 * If this means reading 0 then we were asked to read
 		 * past the end of file. */
-		amount = min(amount_left, FSG_BUFLEN);
+		amount = min(amount_left, common->buflen);
 		amount = min((loff_t) amount,
 				curlun->file_length - file_offset);
 		if (amount == 0) {
@@ -1985,7 +2106,7 @@ static int pad_with_zeros(struct fsg_dev *fsg)
 				return rc;
 		}
 
-		nsend = min(fsg->common->usb_amount_left, FSG_BUFLEN);
+		nsend = min(fsg->common->usb_amount_left, fsg->common->buflen);
 		memset(bh->buf + nkeep, 0, nsend - nkeep);
 		bh->inreq->length = nsend;
 		bh->inreq->zero = 0;
@@ -2028,7 +2149,7 @@ static int throw_away_data(struct fsg_common *common)
 		bh = common->next_buffhd_to_fill;
 		if (bh->state == BUF_STATE_EMPTY
 		 && common->usb_amount_left > 0) {
-			amount = min(common->usb_amount_left, FSG_BUFLEN);
+			amount = min(common->usb_amount_left, common->buflen);
 
 			/* amount is always divisible by 512, hence by
 			 * the bulk-out maxpacket size */
@@ -2767,7 +2888,7 @@ reset:
 	if (common->fsg) {
 		fsg = common->fsg;
 
-		for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+		for (i = 0; i < common->num_buffers; ++i) {
 			struct fsg_buffhd *bh = &common->buffhds[i];
 
 			if (bh->inreq) {
@@ -2819,7 +2940,7 @@ reset:
 	clear_bit(IGNORE_BULK_OUT, &fsg->atomic_bitflags);
 
 	/* Allocate the requests */
-	for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+	for (i = 0; i < common->num_buffers; ++i) {
 		struct fsg_buffhd	*bh = &common->buffhds[i];
 
 		rc = alloc_request(common, fsg->bulk_in, &bh->inreq);
@@ -2887,7 +3008,7 @@ static void handle_exception(struct fsg_common *common)
 
 	/* Cancel all the pending transfers */
 	if (likely(common->fsg)) {
-		for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+		for (i = 0; i < common->num_buffers; ++i) {
 			bh = &common->buffhds[i];
 			if (bh->inreq_busy)
 				usb_ep_dequeue(common->fsg->bulk_in, bh->inreq);
@@ -2899,7 +3020,7 @@ static void handle_exception(struct fsg_common *common)
 		/* Wait until everything is idle */
 		for (;;) {
 			int num_active = 0;
-			for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+			for (i = 0; i < common->num_buffers; ++i) {
 				bh = &common->buffhds[i];
 				num_active += bh->inreq_busy + bh->outreq_busy;
 			}
@@ -2920,7 +3041,7 @@ static void handle_exception(struct fsg_common *common)
 	 * state, and the exception.  Then invoke the handler. */
 	spin_lock_irq(&common->lock);
 
-	for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+	for (i = 0; i < common->num_buffers; ++i) {
 		bh = &common->buffhds[i];
 		bh->state = BUF_STATE_EMPTY;
 	}
@@ -3151,9 +3272,47 @@ static ssize_t fsg_store_file(struct device *dev, struct device_attribute *attr,
         return (rc < 0 ? rc : count);
 }
 
+static unsigned int fsg_mbps100(u64 bytes, s64 usecs)
+{
+	return usecs > 0 ? (unsigned int) div64_u64(bytes * 100, usecs) : 0;
+}
+
+/*
+ * Writes are timed until the data is in the page cache; the background
+ * writeback to the medium is not included, hence "cached" in the output.
+ */
+static ssize_t fsg_show_throughput(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct fsg_lun		*curlun = fsg_lun_from_dev(dev);
+	struct rw_semaphore	*filesem = dev_get_drvdata(dev);
+	struct fsg_common	*common = container_of(filesem,
+						struct fsg_common, filesem);
+	u64			read_bytes, write_bytes;
+	s64			read_usecs, write_usecs;
+	unsigned int		rd, wr;
+
+	/* 64-bit values, so take a consistent snapshot */
+	spin_lock_irq(&common->lock);
+	read_bytes = curlun->read_bytes;
+	read_usecs = curlun->read_usecs;
+	write_bytes = curlun->write_bytes;
+	write_usecs = curlun->write_usecs;
+	spin_unlock_irq(&common->lock);
+
+	rd = fsg_mbps100(read_bytes, read_usecs);
+	wr = fsg_mbps100(write_bytes, write_usecs);
+
+	return sprintf(buf, "read %llu bytes %u.%02u MB/s\n"
+			    "write %llu bytes %u.%02u MB/s cached\n",
+		       read_bytes, rd / 100, rd % 100,
+		       write_bytes, wr / 100, wr % 100);
+}
+
 /* Write permission is checked per LUN in store_*() functions. */
 static DEVICE_ATTR(ro, 0644, fsg_show_ro, fsg_store_ro);
 static DEVICE_ATTR(file, 0644, fsg_show_file, fsg_store_file);
+static DEVICE_ATTR(throughput, 0444, fsg_show_throughput, NULL);
 
 
 /****************************** FSG COMMON ******************************/
@@ -3217,6 +3376,14 @@ static struct fsg_common *fsg_common_init(struct fsg_common *common,
 	common->ep0 = gadget->ep0;
 	common->ep0req = cdev->req;
 
+	/* filemap_flush() can block for long on slow media, keep it off
+	 * the shared workqueue */
+	common->writeback_wq = create_singlethread_workqueue("fsg_writeback");
+	if (unlikely(!common->writeback_wq)) {
+		rc = -ENOMEM;
+		goto error_release;
+	}
+
 	/* Maybe allocate device-global string IDs, and patch descriptors */
 	if (fsg_strings[FSG_STRING_INTERFACE].id == 0) {
 		rc = usb_string_id(cdev);
@@ -3242,6 +3409,7 @@ static struct fsg_common *fsg_common_init(struct fsg_common *common,
 		curlun->ro = lcfg->cdrom || lcfg->ro;
 		curlun->removable = lcfg->removable;
 		curlun->dev.release = fsg_lun_release;
+		INIT_WORK(&curlun->writeback_work, fsg_writeback_work);
 
 #ifdef CONFIG_USB_ANDROID_MASS_STORAGE
 		/* use "usb_mass_storage" platform device as parent */
@@ -3268,6 +3436,9 @@ static struct fsg_common *fsg_common_init(struct fsg_common *common,
 		if (rc)
 			goto error_luns;
 		rc = device_create_file(&curlun->dev, &dev_attr_file);
+		if (rc)
+			goto error_luns;
+		rc = device_create_file(&curlun->dev, &dev_attr_throughput);
 		if (rc)
 			goto error_luns;
 
@@ -3285,14 +3456,25 @@ static struct fsg_common *fsg_common_init(struct fsg_common *common,
 
 
 	/* Data buffers cyclic list */
+	common->num_buffers = clamp_t(unsigned int, fsg_num_buffers,
+				      2, FSG_MAX_NUM_BUFFERS);
+	common->buflen = clamp_t(u32, fsg_buflen & PAGE_CACHE_MASK,
+				 PAGE_CACHE_SIZE, FSG_MAX_BUFLEN);
+	common->buffhds = kcalloc(common->num_buffers,
+				  sizeof *common->buffhds, GFP_KERNEL);
+	if (unlikely(!common->buffhds)) {
+		rc = -ENOMEM;
+		goto error_release;
+	}
+
 	bh = common->buffhds;
-	i = FSG_NUM_BUFFERS;
+	i = common->num_buffers;
 	goto buffhds_first_it;
 	do {
 		bh->next = bh + 1;
 		++bh;
 buffhds_first_it:
-		bh->buf = kmalloc(FSG_BUFLEN, GFP_KERNEL);
+		bh->buf = kmalloc(common->buflen, GFP_KERNEL);
 		if (unlikely(!bh->buf)) {
 			rc = -ENOMEM;
 			goto error_release;
@@ -3416,6 +3598,10 @@ static void fsg_common_release(struct kref *ref)
 		for (; i; --i, ++lun) {
 			device_remove_file(&lun->dev, &dev_attr_ro);
 			device_remove_file(&lun->dev, &dev_attr_file);
+			device_remove_file(&lun->dev, &dev_attr_throughput);
+			cancel_work_sync(&lun->writeback_work);
+			if (lun->writeback_filp)
+				fput(lun->writeback_filp);
 			fsg_lun_close(lun);
 			device_unregister(&lun->dev);
 		}
@@ -3423,12 +3609,16 @@ static void fsg_common_release(struct kref *ref)
 		kfree(common->luns);
 	}
 
-	{
+	if (common->writeback_wq)
+		destroy_workqueue(common->writeback_wq);
+
+	if (common->buffhds) {
 		struct fsg_buffhd *bh = common->buffhds;
-		unsigned i = FSG_NUM_BUFFERS;
+		unsigned i = common->num_buffers;
 		do {
 			kfree(bh->buf);
 		} while (++bh, --i);
+		kfree(common->buffhds);
 	}
 
 	if (common->free_storage_on_release)
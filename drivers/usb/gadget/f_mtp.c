@@ -27,6 +27,8 @@
 #include <linux/interrupt.h>
 #include <linux/kthread.h>
 #include <linux/freezer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 
 #include <linux/types.h>
 #include <linux/file.h>
@@ -39,7 +41,7 @@
 #include <linux/usb/android_composite.h>
 #include <linux/usb/f_mtp.h>
 
-#define BULK_BUFFER_SIZE           16384
+#define BULK_BUFFER_SIZE           65536
 #define INTR_BUFFER_SIZE           28
 
 /* String IDs */
@@ -52,9 +54,11 @@
 #define STATE_CANCELED              3   /* transaction canceled by host */
 #define STATE_ERROR                 4   /* error from completion routine */
 
-/* number of tx and rx requests to allocate */
-#define TX_REQ_MAX 4
-#define RX_REQ_MAX 2
+/* number of tx and rx requests to allocate.
+ * File transfers keep all of them queued while the thread does file I/O.
+ */
+#define TX_REQ_MAX 8
+#define RX_REQ_MAX 4
 
 /* IO Thread commands */
 #define ANDROID_THREAD_QUIT				1
@@ -101,6 +105,8 @@ struct mtp_dev {
 	struct usb_request *rx_req[RX_REQ_MAX];
 	struct usb_request *intr_req;
 	int rx_done;
+	/* number of rx requests completed, they complete in queue order */
+	unsigned rx_completed;
 
 	/* synchronize access to interrupt endpoint */
 	struct mutex intr_mutex;
@@ -118,6 +124,15 @@ struct mtp_dev {
 	struct completion			thread_wait;
 	/* result from current command */
 	int							thread_result;
+
+	/* complete requests without touching the endpoints, for selftest */
+	int loopback;
+
+	/* last file transfer, for the transfer_stats attribute */
+	int		xfer_send;
+	size_t		xfer_bytes;
+	s64		xfer_usecs;
+	int		xfer_result;
 };
 
 static struct usb_interface_descriptor mtp_interface_desc = {
@@ -372,6 +387,7 @@ static void mtp_complete_out(struct usb_ep *ep, struct usb_request *req)
 	struct mtp_dev *dev = _mtp_dev;
 
 	dev->rx_done = 1;
+	dev->rx_completed++;
 	if (req->status != 0)
 		dev->state = STATE_ERROR;
 
@@ -390,6 +406,36 @@ static void mtp_complete_intr(struct usb_ep *ep, struct usb_request *req)
 	wake_up(&dev->intr_wq);
 }
 
+/* queue a bulk request, or in loopback mode act as both host and endpoint */
+static int mtp_queue(struct mtp_dev *dev, struct usb_ep *ep,
+		struct usb_request *req)
+{
+	if (!dev->loopback)
+		return usb_ep_queue(ep, req, GFP_KERNEL);
+
+	/* like f_sourcesink: IN data is sunk, OUT data is whatever the
+	 * buffer held already
+	 */
+	req->status = 0;
+	req->actual = req->length;
+	req->complete(ep, req);
+	return 0;
+}
+
+static int mtp_tx_all_idle(struct mtp_dev *dev)
+{
+	struct list_head *pos;
+	unsigned long flags;
+	int n = 0;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	list_for_each(pos, &dev->tx_idle)
+		n++;
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	return n == TX_REQ_MAX;
+}
+
 static int __init create_bulk_endpoints(struct mtp_dev *dev,
 				struct usb_endpoint_descriptor *in_desc,
 				struct usb_endpoint_descriptor *out_desc,
@@ -631,6 +677,13 @@ static int mtp_send_file(struct mtp_dev *dev, struct file *filp,
 
 	DBG(cdev, "mtp_send_file(%lld %d)\n", offset, count);
 
+	/* read ahead far enough to keep every tx request busy */
+	spin_lock(&filp->f_lock);
+	filp->f_mode &= ~FMODE_RANDOM;
+	filp->f_ra.ra_pages = max_t(unsigned, filp->f_ra.ra_pages,
+			(TX_REQ_MAX * BULK_BUFFER_SIZE) >> PAGE_SHIFT);
+	spin_unlock(&filp->f_lock);
+
 	while (count > 0) {
 		/* get an idle tx request to use */
 		req = 0;
@@ -654,7 +707,7 @@ static int mtp_send_file(struct mtp_dev *dev, struct file *filp,
 		xfer = ret;
 
 		req->length = xfer;
-		ret = usb_ep_queue(dev->ep_in, req, GFP_KERNEL);
+		ret = mtp_queue(dev, dev->ep_in, req);
 		if (ret < 0) {
 			DBG(cdev, "mtp_write: xfer error %d\n", ret);
 			dev->state = STATE_ERROR;
@@ -671,6 +724,16 @@ static int mtp_send_file(struct mtp_dev *dev, struct file *filp,
 	if (req)
 		req_put(dev, &dev->tx_idle, req);
 
+	/* let the queued data go out before reporting the result */
+	ret = wait_event_interruptible(dev->write_wq,
+		mtp_tx_all_idle(dev) || dev->state != STATE_BUSY);
+	if (r >= 0) {
+		if (ret < 0)
+			r = ret;
+		else if (!mtp_tx_all_idle(dev))
+			r = -EIO;
+	}
+
 	DBG(cdev, "mtp_write returning %d\n", r);
 	return r;
 }
@@ -679,62 +742,110 @@ static int mtp_receive_file(struct mtp_dev *dev, struct file *filp,
 	loff_t offset, size_t count)
 {
 	struct usb_composite_dev *cdev = dev->cdev;
-	struct usb_request *read_req = NULL, *write_req = NULL;
+	struct usb_request *req;
+	size_t unqueued = count;
+	unsigned consumed = dev->rx_completed;
+	int head = 0, tail = 0, inflight = 0;
 	int r = count;
 	int ret;
-	int cur_buf = 0;
 
 	DBG(cdev, "mtp_receive_file(%d)\n", count);
 
-	while (count > 0 || write_req) {
-		if (count > 0) {
-			/* queue a request */
-			read_req = dev->rx_req[cur_buf];
-			cur_buf = (cur_buf + 1) % RX_REQ_MAX;
-
-			read_req->length = (count > BULK_BUFFER_SIZE
-					? BULK_BUFFER_SIZE : count);
-			dev->rx_done = 0;
-			ret = usb_ep_queue(dev->ep_out, read_req, GFP_KERNEL);
+	while (count > 0) {
+		/* keep every rx request queued while we write to the file */
+		while (unqueued > 0 && inflight < RX_REQ_MAX) {
+			req = dev->rx_req[head];
+			req->length = (unqueued > BULK_BUFFER_SIZE
+					? BULK_BUFFER_SIZE : unqueued);
+			ret = mtp_queue(dev, dev->ep_out, req);
 			if (ret < 0) {
 				r = -EIO;
 				dev->state = STATE_ERROR;
-				break;
+				goto out;
 			}
-			count -= ret;
+			unqueued -= req->length;
+			head = (head + 1) % RX_REQ_MAX;
+			inflight++;
 		}
 
-		if (write_req) {
-			DBG(cdev, "rx %p %d\n", write_req, write_req->actual);
-			ret = vfs_write(filp, write_req->buf, write_req->actual,
-				&offset);
-			DBG(cdev, "vfs_write %d\n", ret);
-			if (ret != write_req->actual) {
-				r = -EIO;
-				dev->state = STATE_ERROR;
-				break;
-			}
-			write_req = NULL;
+		/* wait for the oldest read to complete */
+		ret = wait_event_interruptible(dev->read_wq,
+			dev->rx_completed != consumed || dev->state != STATE_BUSY);
+		if (ret < 0 || dev->state != STATE_BUSY) {
+			r = ret;
+			goto out;
+		}
+		req = dev->rx_req[tail];
+		tail = (tail + 1) % RX_REQ_MAX;
+		inflight--;
+		consumed++;
+
+		/* the reads queued behind a short one would eat the next transaction */
+		if (req->actual != req->length) {
+			DBG(cdev, "rx %p short %d/%d\n", req, req->actual, req->length);
+			r = -EIO;
+			dev->state = STATE_ERROR;
+			goto out;
 		}
 
-		if (read_req) {
-			/* wait for our last read to complete */
-			ret = wait_event_interruptible(dev->read_wq,
-				dev->rx_done || dev->state != STATE_BUSY);
-			if (ret < 0 || dev->state != STATE_BUSY) {
-				r = ret;
-				break;
-			}
-			count -= read_req->actual;
-			write_req = read_req;
-			read_req = NULL;
+		DBG(cdev, "rx %p %d\n", req, req->actual);
+		ret = vfs_write(filp, req->buf, req->actual, &offset);
+		DBG(cdev, "vfs_write %d\n", ret);
+		if (ret != req->actual) {
+			r = -EIO;
+			dev->state = STATE_ERROR;
+			goto out;
+		}
+		count -= req->actual;
+	}
+
+out:
+	if (inflight) {
+		int state = dev->state;
+
+		while (inflight--) {
+			usb_ep_dequeue(dev->ep_out, dev->rx_req[tail]);
+			tail = (tail + 1) % RX_REQ_MAX;
+			consumed++;
 		}
+		/*
+		 * Dequeued requests always complete. Their buffers must not
+		 * be queued again before that.
+		 */
+		wait_event(dev->read_wq,
+			(int)(dev->rx_completed - consumed) >= 0);
+
+		/* the dequeued requests complete with an error status */
+		spin_lock_irq(&dev->lock);
+		if (state == STATE_CANCELED)
+			dev->state = STATE_CANCELED;
+		spin_unlock_irq(&dev->lock);
 	}
 
 	DBG(cdev, "mtp_read returning %d\n", r);
 	return r;
 }
 
+/* run a file transfer and keep its throughput for transfer_stats */
+static int mtp_file_xfer(struct mtp_dev *dev, int send, struct file *filp,
+	loff_t offset, size_t count)
+{
+	ktime_t start = ktime_get();
+	int ret;
+
+	if (send)
+		ret = mtp_send_file(dev, filp, offset, count);
+	else
+		ret = mtp_receive_file(dev, filp, offset, count);
+
+	dev->xfer_usecs = ktime_us_delta(ktime_get(), start);
+	dev->xfer_send = send;
+	dev->xfer_bytes = count;
+	dev->xfer_result = ret;
+
+	return ret;
+}
+
 /* Kernel thread for handling file IO operations */
 static int mtp_thread(void *data)
 {
@@ -766,17 +877,11 @@ static int mtp_thread(void *data)
 		else
 			flags = O_WRONLY | O_LARGEFILE | O_CREAT;
 
-		if (dev->thread_command == ANDROID_THREAD_SEND_FILE) {
-			dev->thread_result = mtp_send_file(dev,
-				dev->thread_file,
-				dev->thread_file_offset,
-				dev->thread_file_length);
-		} else {
-			dev->thread_result = mtp_receive_file(dev,
-				dev->thread_file,
-				dev->thread_file_offset,
-				dev->thread_file_length);
-		}
+		dev->thread_result = mtp_file_xfer(dev,
+			dev->thread_command == ANDROID_THREAD_SEND_FILE,
+			dev->thread_file,
+			dev->thread_file_offset,
+			dev->thread_file_length);
 
 		if (dev->thread_file) {
 			fput(dev->thread_file);
@@ -973,6 +1078,84 @@ static struct miscdevice mtp_device = {
 	.fops = &mtp_fops,
 };
 
+static ssize_t mtp_transfer_stats_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct mtp_dev *dev = _mtp_dev;
+	u64 kbps = 0;
+
+	if (dev->xfer_usecs > 0)
+		kbps = div64_u64((u64)dev->xfer_bytes * 1000000,
+				dev->xfer_usecs) >> 10;
+
+	return sprintf(buf, "%s %zu bytes %lld us %llu KB/s result %d\n",
+			dev->xfer_send ? "send" : "receive", dev->xfer_bytes,
+			dev->xfer_usecs, kbps, dev->xfer_result);
+}
+
+/*
+ * Host independent throughput test of the file transfer path. With the
+ * cable out, write "send <file>" or "receive <file> <bytes>" and read
+ * transfer_stats afterwards. Requests complete at once instead of going
+ * to the endpoints, so this measures file I/O and request handling.
+ */
+static ssize_t mtp_selftest_store(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t size)
+{
+	struct mtp_dev *dev = _mtp_dev;
+	struct file *filp;
+	char op[8], path[128];
+	unsigned long length = 0;
+	int send, ret;
+
+	if (sscanf(buf, "%7s %127s %lu", op, path, &length) < 2)
+		return -EINVAL;
+
+	if (!strcmp(op, "send"))
+		send = 1;
+	else if (!strcmp(op, "receive") && length)
+		send = 0;
+	else
+		return -EINVAL;
+
+	/* claim the device before the open can truncate anything */
+	spin_lock_irq(&dev->lock);
+	if (dev->state != STATE_OFFLINE) {
+		spin_unlock_irq(&dev->lock);
+		return -EBUSY;
+	}
+	dev->state = STATE_BUSY;
+	dev->loopback = 1;
+	spin_unlock_irq(&dev->lock);
+
+	filp = filp_open(path, send ? O_RDONLY | O_LARGEFILE :
+			O_WRONLY | O_LARGEFILE | O_CREAT | O_TRUNC, 0600);
+	if (IS_ERR(filp)) {
+		ret = PTR_ERR(filp);
+		filp = NULL;
+		goto out;
+	}
+	if (send && !length)
+		length = i_size_read(filp->f_path.dentry->d_inode);
+
+	ret = mtp_file_xfer(dev, send, filp, 0, length);
+
+out:
+	spin_lock_irq(&dev->lock);
+	dev->loopback = 0;
+	if (dev->state == STATE_BUSY || dev->state == STATE_ERROR)
+		dev->state = STATE_OFFLINE;
+	spin_unlock_irq(&dev->lock);
+
+	if (filp)
+		filp_close(filp, NULL);
+
+	return ret < 0 ? ret : size;
+}
+
+static DEVICE_ATTR(transfer_stats, S_IRUGO, mtp_transfer_stats_show, NULL);
+static DEVICE_ATTR(selftest, S_IWUSR, NULL, mtp_selftest_store);
+
 static int
 mtp_function_bind(struct usb_configuration *c, struct usb_function *f)
 {
@@ -1027,6 +1210,8 @@ mtp_function_unbind(struct usb_configuration *c, struct usb_function *f)
 	spin_unlock_irq(&dev->lock);
 	wake_up(&dev->intr_wq);
 
+	device_remove_file(mtp_device.this_device, &dev_attr_selftest);
+	device_remove_file(mtp_device.this_device, &dev_attr_transfer_stats);
 	misc_deregister(&mtp_device);
 	kfree(_mtp_dev);
 	_mtp_dev = NULL;
@@ -1245,12 +1430,24 @@ static int mtp_bind_config(struct usb_configuration *c)
 	if (ret)
 		goto err1;
 
-	ret = usb_add_function(c, &dev->function);
+	ret = device_create_file(mtp_device.this_device,
+			&dev_attr_transfer_stats);
 	if (ret)
 		goto err2;
+	ret = device_create_file(mtp_device.this_device, &dev_attr_selftest);
+	if (ret)
+		goto err3;
+
+	ret = usb_add_function(c, &dev->function);
+	if (ret)
+		goto err4;
 
 	return 0;
 
+err4:
+	device_remove_file(mtp_device.this_device, &dev_attr_selftest);
+err3:
+	device_remove_file(mtp_device.this_device, &dev_attr_transfer_stats);
 err2:
 	misc_deregister(&mtp_device);
 err1:
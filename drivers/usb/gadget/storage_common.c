@@ -285,6 +285,19 @@ struct fsg_lun {
 	u32		sense_data_info;
 	u32		unit_attention_data;
 
+	/* host access pattern, to adapt read-ahead on the backing file */
+	loff_t		next_read_offset;
+	unsigned int	seq_reads;
+	unsigned int	random_reads;
+	/* bytes written since background writeback was last started */
+	unsigned int	unflushed;
+	struct work_struct	writeback_work;
+	struct file	*writeback_filp;	/* pending writeback */
+
+	/* achieved throughput, per direction */
+	u64		read_bytes, write_bytes;
+	s64		read_usecs, write_usecs;
+
 	struct device	dev;
 };
 
@@ -300,7 +313,8 @@ static struct fsg_lun *fsg_lun_from_dev(struct device *dev)
 #define EP0_BUFSIZE	256
 #define DELAYED_STATUS	(EP0_BUFSIZE + 999)	/* An impossibly large value */
 
-/* Number of buffers we will use.  2 is enough for double-buffering */
+/* Number of buffers we will use.  2 is enough for double-buffering,
+ * f_mass_storage takes its own number from a module parameter */
 #define FSG_NUM_BUFFERS	2
 
 /* Default size of buffer length. */
@@ -1047,6 +1047,7 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 	}
 
 	task->signal->oom_adj = oom_adjust;
+	lowmem_index_adj(task->signal, oom_adjust);
 
 	unlock_task_sighand(task, &flags);
 	put_task_struct(task);
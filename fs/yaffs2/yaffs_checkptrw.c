@@ -111,6 +111,7 @@ static void yaffs2_CheckpointFindNextCheckpointBlock(yaffs_Device *dev)
 				dev->checkpointCurrentBlock = i;
 				dev->checkpointBlockList[dev->blocksInCheckpoint] = i;
 				dev->blocksInCheckpoint++;
+				dev->checkpointStreamBlocks++;
 				T(YAFFS_TRACE_CHECKPOINT, (TSTR("found checkpt block %d"TENDSTR), i));
 				return;
 			}
@@ -128,6 +129,7 @@ int yaffs2_CheckpointOpen(yaffs_Device *dev, int forWriting)
 
 
 	dev->checkpointOpenForWrite = forWriting;
+	dev->checkpointStreamBlocks = 0;
 
 	/* Got the functions we need? */
 	if (!dev->param.writeChunkWithTagsToNAND ||
@@ -177,6 +179,63 @@ int yaffs2_CheckpointOpen(yaffs_Device *dev, int forWriting)
 	return 1;
 }
 
+/*
+ * Open the checkpoint stream for writing at the point where the last
+ * write or read of it stopped, without erasing what is already there.
+ */
+int yaffs2_CheckpointOpenAppend(yaffs_Device *dev)
+{
+	dev->checkpointOpenForWrite = 1;
+	dev->checkpointStreamBlocks = 0;
+	dev->checkpointByteOffset = 0;
+
+	if (!dev->checkpointLogValid)
+		return 0;
+
+	if (!dev->param.writeChunkWithTagsToNAND ||
+		!dev->param.readChunkWithTagsFromNAND ||
+		!dev->param.eraseBlockInNAND ||
+		!dev->param.markNANDBlockBad)
+		return 0;
+
+	if (!dev->checkpointBuffer)
+		dev->checkpointBuffer = YMALLOC_DMA(dev->param.totalBytesPerChunk);
+	if (!dev->checkpointBuffer)
+		return 0;
+
+	dev->checkpointPageSequence = dev->checkpointLogPageSequence;
+	dev->checkpointByteCount = 0;
+	dev->checkpointSum = 0;
+	dev->checkpointXor = 0;
+	dev->checkpointCurrentBlock = dev->checkpointLogBlock;
+	dev->checkpointCurrentChunk = dev->checkpointLogChunk;
+	dev->checkpointNextBlock = dev->checkpointLogNextBlock;
+
+	memset(dev->checkpointBuffer, 0, dev->nDataBytesPerChunk);
+
+	return 1;
+}
+
+/* Remember where the stream ends so that the next segment can go there */
+void yaffs2_CheckpointMarkAppend(yaffs_Device *dev)
+{
+	dev->checkpointLogBlock = dev->checkpointCurrentBlock;
+	dev->checkpointLogChunk = dev->checkpointCurrentChunk;
+	dev->checkpointLogNextBlock = dev->checkpointNextBlock;
+	dev->checkpointLogPageSequence = dev->checkpointPageSequence;
+}
+
+/*
+ * Segments carry their own sum. They always start on a chunk boundary:
+ * appends start in a fresh chunk and yaffs2_CheckpointAtEnd() leaves a
+ * reader at the start of the next one.
+ */
+void yaffs2_CheckpointStartSegment(yaffs_Device *dev)
+{
+	dev->checkpointSum = 0;
+	dev->checkpointXor = 0;
+}
+
 int yaffs2_GetCheckpointSum(yaffs_Device *dev, __u32 *sum)
 {
 	__u32 compositeSum;
@@ -211,6 +270,7 @@ static int yaffs2_CheckpointFlushBuffer(yaffs_Device *dev)
 		yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, dev->checkpointCurrentBlock);
 		bi->blockState = YAFFS_BLOCK_STATE_CHECKPOINT;
 		dev->blocksInCheckpoint++;
+		dev->checkpointStreamBlocks++;
 	}
 
 	chunk = dev->checkpointCurrentBlock * dev->param.nChunksPerBlock + dev->checkpointCurrentChunk;
@@ -273,15 +333,65 @@ int yaffs2_CheckpointWrite(yaffs_Device *dev, const void *data, int nBytes)
 	return i;
 }
 
-int yaffs2_CheckpointRead(yaffs_Device *dev, void *data, int nBytes)
+/*
+ * Read the next chunk of the stream into the checkpoint buffer.
+ * Returns 1 if it is the chunk we expected. *ended is set if the
+ * stream just stops there, ie. the chunk has never been written.
+ */
+static int yaffs2_CheckpointReadChunk(yaffs_Device *dev, int *ended)
 {
-	int i = 0;
-	int ok = 1;
 	yaffs_ExtendedTags tags;
-
-
 	int chunk;
 	int realignedChunk;
+	int ok = 1;
+
+	*ended = 0;
+
+	if (dev->checkpointCurrentBlock < 0) {
+		yaffs2_CheckpointFindNextCheckpointBlock(dev);
+		dev->checkpointCurrentChunk = 0;
+	}
+
+	if (dev->checkpointCurrentBlock < 0)
+		return 0;
+
+	chunk = dev->checkpointCurrentBlock *
+		dev->param.nChunksPerBlock +
+		dev->checkpointCurrentChunk;
+
+	realignedChunk = chunk - dev->chunkOffset;
+
+	dev->nPageReads++;
+
+	/* read in the next chunk */
+	dev->param.readChunkWithTagsFromNAND(dev,
+			realignedChunk,
+			dev->checkpointBuffer,
+			&tags);
+
+	if (!tags.chunkUsed)
+		*ended = 1;
+
+	if (tags.chunkId != (dev->checkpointPageSequence + 1) ||
+		tags.eccResult > YAFFS_ECC_RESULT_FIXED ||
+		tags.sequenceNumber != YAFFS_SEQUENCE_CHECKPOINT_DATA)
+		ok = 0;
+
+	dev->checkpointByteOffset = 0;
+	dev->checkpointPageSequence++;
+	dev->checkpointCurrentChunk++;
+
+	if (dev->checkpointCurrentChunk >= dev->param.nChunksPerBlock)
+		dev->checkpointCurrentBlock = -1;
+
+	return ok;
+}
+
+int yaffs2_CheckpointRead(yaffs_Device *dev, void *data, int nBytes)
+{
+	int i = 0;
+	int ok = 1;
+	int ended;
 
 	__u8 *dataBytes = (__u8 *)data;
 
@@ -293,46 +403,9 @@ int yaffs2_CheckpointRead(yaffs_Device *dev, void *data, int nBytes)
 
 	while (i < nBytes && ok) {
 
-
 		if (dev->checkpointByteOffset < 0 ||
-			dev->checkpointByteOffset >= dev->nDataBytesPerChunk) {
-
-			if (dev->checkpointCurrentBlock < 0) {
-				yaffs2_CheckpointFindNextCheckpointBlock(dev);
-				dev->checkpointCurrentChunk = 0;
-			}
-
-			if (dev->checkpointCurrentBlock < 0)
-				ok = 0;
-			else {
-				chunk = dev->checkpointCurrentBlock *
-					dev->param.nChunksPerBlock +
-					dev->checkpointCurrentChunk;
-
-				realignedChunk = chunk - dev->chunkOffset;
-				
-				dev->nPageReads++;
-
-				/* read in the next chunk */
-				/* printf("read checkpoint page %d\n",dev->checkpointPage); */
-				dev->param.readChunkWithTagsFromNAND(dev,
-						realignedChunk,
-						dev->checkpointBuffer,
-						&tags);
-
-				if (tags.chunkId != (dev->checkpointPageSequence + 1) ||
-					tags.eccResult > YAFFS_ECC_RESULT_FIXED ||
-					tags.sequenceNumber != YAFFS_SEQUENCE_CHECKPOINT_DATA)
-					ok = 0;
-
-				dev->checkpointByteOffset = 0;
-				dev->checkpointPageSequence++;
-				dev->checkpointCurrentChunk++;
-
-				if (dev->checkpointCurrentChunk >= dev->param.nChunksPerBlock)
-					dev->checkpointCurrentBlock = -1;
-			}
-		}
+			dev->checkpointByteOffset >= dev->nDataBytesPerChunk)
+			ok = yaffs2_CheckpointReadChunk(dev, &ended);
 
 		if (ok) {
 			*dataBytes = dev->checkpointBuffer[dev->checkpointByteOffset];
@@ -348,6 +421,82 @@ int yaffs2_CheckpointRead(yaffs_Device *dev, void *data, int nBytes)
 	return 	i;
 }
 
+/*
+ * A segment that was appended after a full data segment starts in the
+ * block the writer would have picked next: the first empty one past the
+ * hint. The block states we have now are the ones the writer saw, since
+ * nothing else is allowed to change before the stale marker is appended.
+ */
+static int yaffs2_CheckpointFindAppendedBlock(yaffs_Device *dev)
+{
+	yaffs_ExtendedTags tags;
+	int i;
+
+	if (dev->checkpointNextBlock < dev->internalStartBlock ||
+		dev->blocksInCheckpoint >= dev->checkpointMaxBlocks)
+		return -1;
+
+	for (i = dev->checkpointNextBlock; i <= dev->internalEndBlock; i++) {
+		yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, i);
+		if (bi->blockState == YAFFS_BLOCK_STATE_EMPTY)
+			break;
+	}
+
+	if (i > dev->internalEndBlock)
+		return 0;
+
+	dev->param.readChunkWithTagsFromNAND(dev,
+			i * dev->param.nChunksPerBlock - dev->chunkOffset,
+			NULL, &tags);
+
+	if (!tags.chunkUsed)
+		return 0;
+
+	if (tags.sequenceNumber != YAFFS_SEQUENCE_CHECKPOINT_DATA)
+		return -1;
+
+	dev->checkpointNextBlock = tags.objectId;
+	dev->checkpointCurrentBlock = i;
+	dev->checkpointCurrentChunk = 0;
+	dev->checkpointBlockList[dev->blocksInCheckpoint] = i;
+	dev->blocksInCheckpoint++;
+	dev->checkpointStreamBlocks++;
+
+	return 1;
+}
+
+/*
+ * Called between segments when reading. Returns 1 if the stream ends
+ * cleanly here, 0 if another segment follows (its first chunk is then
+ * loaded) and -1 if what follows is not a valid continuation.
+ */
+int yaffs2_CheckpointAtEnd(yaffs_Device *dev, int afterData)
+{
+	int ended;
+	int found;
+
+	dev->checkpointByteOffset = dev->nDataBytesPerChunk;
+
+	if (dev->checkpointCurrentBlock < 0) {
+		if (afterData) {
+			found = yaffs2_CheckpointFindAppendedBlock(dev);
+			if (found <= 0)
+				return found ? -1 : 1;
+		} else {
+			yaffs2_CheckpointFindNextCheckpointBlock(dev);
+			dev->checkpointCurrentChunk = 0;
+			if (dev->checkpointCurrentBlock < 0)
+				return (dev->blocksInCheckpoint <
+					dev->checkpointMaxBlocks) ? 1 : -1;
+		}
+	}
+
+	if (yaffs2_CheckpointReadChunk(dev, &ended))
+		return 0;
+
+	return ended ? 1 : -1;
+}
+
 int yaffs2_CheckpointClose(yaffs_Device *dev)
 {
 
@@ -371,8 +520,12 @@ int yaffs2_CheckpointClose(yaffs_Device *dev)
 		dev->checkpointBlockList = NULL;
 	}
 
-	dev->nFreeChunks -= dev->blocksInCheckpoint * dev->param.nChunksPerBlock;
-	dev->nErasedBlocks -= dev->blocksInCheckpoint;
+	if (dev->checkpointOpenForWrite)
+		yaffs2_CheckpointMarkAppend(dev);
+
+	/* Only the blocks this open added are not accounted for yet */
+	dev->nFreeChunks -= dev->checkpointStreamBlocks * dev->param.nChunksPerBlock;
+	dev->nErasedBlocks -= dev->checkpointStreamBlocks;
 
 
 	T(YAFFS_TRACE_CHECKPOINT, (TSTR("checkpoint byte count %d" TENDSTR),
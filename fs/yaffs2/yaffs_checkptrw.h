@@ -20,6 +20,14 @@
 
 int yaffs2_CheckpointOpen(yaffs_Device *dev, int forWriting);
 
+int yaffs2_CheckpointOpenAppend(yaffs_Device *dev);
+
+void yaffs2_CheckpointStartSegment(yaffs_Device *dev);
+
+int yaffs2_CheckpointAtEnd(yaffs_Device *dev, int afterData);
+
+void yaffs2_CheckpointMarkAppend(yaffs_Device *dev);
+
 int yaffs2_CheckpointWrite(yaffs_Device *dev, const void *data, int nBytes);
 
 int yaffs2_CheckpointRead(yaffs_Device *dev, void *data, int nBytes);
@@ -26,6 +26,7 @@
 #include "yaffs_yaffs2.h"
 #include "yaffs_bitmap.h"
 #include "yaffs_verify.h"
+#include "yaffs_summary.h"
 
 #include "yaffs_nand.h"
 #include "yaffs_packedtags2.h"
@@ -37,6 +38,12 @@
 #define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
+/* Chunks copied per call by a passive gc */
+#define YAFFS_GC_PASSIVE_COPIES 5
+
+/* Cap on block age in cost-benefit selection, keeps the maths in 64 bits */
+#define YAFFS_GC_MAX_AGE 0x100000
+
 #include "yaffs_ecc.h"
 
 
@@ -468,6 +475,9 @@ static int yaffs_WriteNewChunkWithTagsToNAND(struct yaffs_DeviceStruct *dev,
 		/* Copy the data into the robustification buffer */
 		yaffs_HandleWriteChunkOk(dev, chunk, data, tags);
 
+		if (dev->param.isYaffs2)
+			yaffs_SummaryAdd(dev, tags, chunk);
+
 	} while (writeOk != YAFFS_OK &&
 		(yaffs_wr_attempts <= 0 || attempts <= yaffs_wr_attempts));
 
@@ -998,6 +1008,7 @@ static int yaffs_DeleteWorker(yaffs_Object *in, yaffs_Tnode *tn, __u32 level,
 					}
 
 					yaffs_LoadLevel0Tnode(dev, tn, i, 0);
+					yaffs2_CheckpointObjectDirty(in);
 				}
 
 			}
@@ -1112,6 +1123,7 @@ static void yaffs_SoftDeleteFile(yaffs_Object *obj)
 					       obj->variant.fileVariant.
 					       topLevel, 0);
 			obj->softDeleted = 1;
+			yaffs2_CheckpointObjectDirty(obj);
 		}
 	}
 }
@@ -1238,6 +1250,8 @@ static yaffs_Object *yaffs_AllocateEmptyObject(yaffs_Device *dev)
 		YINIT_LIST_HEAD(&(obj->hardLinks));
 		YINIT_LIST_HEAD(&(obj->hashLink));
 		YINIT_LIST_HEAD(&obj->siblings);
+		YINIT_LIST_HEAD(&obj->checkpointLink);
+		yaffs2_CheckpointObjectDirty(obj);
 
 
 		/* Now make the directory sane */
@@ -1315,9 +1329,11 @@ static void yaffs_FreeObject(yaffs_Object *obj)
 		 * Don't delete now, but mark for later deletion
 		 */
 		obj->deferedFree = 1;
+		yaffs2_CheckpointObjectGone(obj);
 		return;
 	}
 
+	yaffs2_CheckpointObjectGone(obj);
 	yaffs_UnhashObject(obj);
 
 	yaffs_FreeRawObject(dev,obj);
@@ -1332,6 +1348,81 @@ void yaffs_HandleDeferedFree(yaffs_Object *obj)
 		yaffs_FreeObject(obj);
 }
 
+static void yaffs_FreeTnodeTree(yaffs_Device *dev, yaffs_Tnode *tn,
+				__u32 level)
+{
+	int i;
+
+	if (!tn)
+		return;
+
+	if (level > 0) {
+		for (i = 0; i < YAFFS_NTNODES_INTERNAL; i++)
+			yaffs_FreeTnodeTree(dev, tn->internal[i], level - 1);
+	}
+
+	yaffs_FreeTnode(dev, tn);
+}
+
+/*
+ * Throw away the tnode tree of a file without touching the flash,
+ * used when a checkpoint delta brings in a newer tree.
+ */
+int yaffs_ResetFileStructure(yaffs_Object *obj)
+{
+	yaffs_FileStructure *fStruct = &obj->variant.fileVariant;
+
+	yaffs_FreeTnodeTree(obj->myDev, fStruct->top, fStruct->topLevel);
+
+	fStruct->topLevel = 0;
+	fStruct->top = yaffs_GetTnode(obj->myDev);
+
+	return fStruct->top ? YAFFS_OK : YAFFS_FAIL;
+}
+
+/*
+ * Drop an object from memory without touching the flash. Used when a
+ * checkpoint delta says the object is gone. Anything still in a
+ * forgotten directory is left for the rest of the delta to deal with.
+ */
+void yaffs_ForgetObject(yaffs_Object *obj)
+{
+	yaffs_Object *child;
+	struct ylist_head *i;
+	struct ylist_head *n;
+
+	switch (obj->variantType) {
+	case YAFFS_OBJECT_TYPE_DIRECTORY:
+		ylist_for_each_safe(i, n, &obj->variant.directoryVariant.children) {
+			child = ylist_entry(i, yaffs_Object, siblings);
+			ylist_del_init(&child->siblings);
+			child->parent = NULL;
+		}
+		ylist_del_init(&obj->variant.directoryVariant.dirty);
+		break;
+	case YAFFS_OBJECT_TYPE_FILE:
+		yaffs_FreeTnodeTree(obj->myDev,
+				obj->variant.fileVariant.top,
+				obj->variant.fileVariant.topLevel);
+		obj->variant.fileVariant.top = NULL;
+		break;
+	case YAFFS_OBJECT_TYPE_SYMLINK:
+		if (obj->variant.symLinkVariant.alias)
+			YFREE(obj->variant.symLinkVariant.alias);
+		obj->variant.symLinkVariant.alias = NULL;
+		break;
+	default:
+		break;
+	}
+
+	ylist_del_init(&obj->hardLinks);
+
+	if (obj->parent)
+		yaffs_RemoveObjectFromDirectory(obj);
+
+	yaffs_FreeObject(obj);
+}
+
 static void yaffs_InitialiseTnodesAndObjects(yaffs_Device *dev)
 {
 	int i;
@@ -1345,6 +1436,8 @@ static void yaffs_InitialiseTnodesAndObjects(yaffs_Device *dev)
 		YINIT_LIST_HEAD(&dev->objectBucket[i].list);
 		dev->objectBucket[i].count = 0;
 	}
+
+	YINIT_LIST_HEAD(&dev->checkpointDirty);
 }
 
 static int yaffs_FindNiceObjectBucket(yaffs_Device *dev)
@@ -2097,7 +2190,7 @@ void yaffs_SkipRestOfBlock(yaffs_Device *dev)
 
 
 static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
-		int wholeBlock)
+		int maxCopies)
 {
 	int oldChunk;
 	int newChunk;
@@ -2106,7 +2199,6 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 	int i;
 	int isCheckpointBlock;
 	int matchingChunk;
-	int maxCopies;
 
 	int chunksBefore = yaffs_GetErasedChunks(dev);
 	int chunksAfter;
@@ -2121,11 +2213,11 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 
 
 	T(YAFFS_TRACE_TRACING,
-			(TSTR("Collecting block %d, in use %d, shrink %d, wholeBlock %d" TENDSTR),
+			(TSTR("Collecting block %d, in use %d, shrink %d, maxCopies %d" TENDSTR),
 			 block,
 			 bi->pagesInUse,
 			 bi->hasShrinkHeader,
-			 wholeBlock));
+			 maxCopies));
 
 	/*yaffs_VerifyFreeChunks(dev); */
 
@@ -2149,7 +2241,6 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 
 		yaffs_VerifyBlock(dev, bi, block);
 
-		maxCopies = (wholeBlock) ? dev->param.nChunksPerBlock : 5;
 		oldChunk = block * dev->param.nChunksPerBlock + dev->gcChunk;
 
 		for (/* init already done */;
@@ -2223,6 +2314,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 					bi->softDeletions--;
 
 					object->nDataChunks--;
+					yaffs2_CheckpointObjectDirty(object);
 
 					if (object->nDataChunks <= 0) {
 						/* remeber to clean up the object */
@@ -2294,6 +2386,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 							/* It's a header */
 							object->hdrChunk =  newChunk;
 							object->serial =   tags.serialNumber;
+							yaffs2_CheckpointObjectDirty(object);
 						} else {
 							/* It's a data chunk */
 							int ok;
@@ -2368,9 +2461,61 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 	return retVal;
 }
 
+/*
+ * Cost-benefit block selection, as used by log structured file systems.
+ * Prefer blocks that give back a lot of space for little copying and whose
+ * live data is old, so is unlikely to be rewritten soon and make the block
+ * dirty again:
+ *	score = free * age / (nChunksPerBlock + inUse)
+ * Only blocks with at most maxInUse chunks in use are considered.
+ */
+static unsigned yaffs_FindCostBenefitBlock(yaffs_Device *dev, int maxInUse)
+{
+	yaffs_BlockInfo *bi;
+	unsigned selected = 0;
+	__u64 bestBenefit = 0;
+	__u32 bestCost = 1;
+	__u64 benefit;
+	__u32 cost;
+	__u32 age;
+	int pagesUsed;
+	int i;
+
+	bi = dev->blockInfo;
+	for (i = dev->internalStartBlock; i <= dev->internalEndBlock; i++, bi++) {
+		if (bi->blockState != YAFFS_BLOCK_STATE_FULL)
+			continue;
+
+		pagesUsed = bi->pagesInUse - bi->softDeletions;
+		if (pagesUsed > maxInUse ||
+			pagesUsed >= dev->param.nChunksPerBlock ||
+			!yaffs2_BlockNotDisqualifiedFromGC(dev, bi))
+			continue;
+
+		age = 1;
+		if (dev->param.isYaffs2 &&
+			dev->sequenceNumber > bi->sequenceNumber)
+			age += dev->sequenceNumber - bi->sequenceNumber;
+		if (age > YAFFS_GC_MAX_AGE)
+			age = YAFFS_GC_MAX_AGE;
+
+		benefit = (__u64)(dev->param.nChunksPerBlock - pagesUsed) * age;
+		cost = dev->param.nChunksPerBlock + pagesUsed;
+
+		/* benefit/cost > bestBenefit/bestCost, without dividing */
+		if (!selected || benefit * bestCost > bestBenefit * cost) {
+			selected = i;
+			bestBenefit = benefit;
+			bestCost = cost;
+		}
+	}
+
+	return selected;
+}
+
 /*
  * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
- * for garbage collection.
+ * for garbage collection. Background gc picks by cost-benefit instead.
  */
 
 static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
@@ -2383,7 +2528,8 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 	int prioritised = 0;
 	int prioritisedExists = 0;
 	yaffs_BlockInfo *bi;
-	int threshold;
+	int threshold = 0;
+	int maxThreshold;
 
 	/* First let's see if we need to grab a prioritised block */
 	if (dev->hasPendingPrioritisedGCs && !aggressive) {
@@ -2432,8 +2578,6 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 			threshold = dev->param.nChunksPerBlock;
 			iterations = nBlocks;
 		} else {
-			int maxThreshold;
-
 			if(background)
 				maxThreshold = dev->param.nChunksPerBlock/2;
 			else
@@ -2452,6 +2596,17 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 			iterations = nBlocks / 16 + 1;
 			if (iterations > 100)
 				iterations = 100;
+
+			/* We have the time to look at every block */
+			if (background) {
+				selected = yaffs_FindCostBenefitBlock(dev, maxThreshold);
+				if (selected) {
+					bi = yaffs_GetBlockInfo(dev, selected);
+					dev->gcPagesInUse = bi->pagesInUse - bi->softDeletions;
+					dev->costBenefitGCs++;
+					iterations = 0;
+				}
+			}
 		}
 
 		for (i = 0;
@@ -2477,7 +2632,7 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 			}
 		}
 
-		if(dev->gcDirtiest > 0 && dev->gcPagesInUse <= threshold)
+		if(!selected && dev->gcDirtiest > 0 && dev->gcPagesInUse <= threshold)
 			selected = dev->gcDirtiest;
 	}
 
@@ -2541,6 +2696,8 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 {
 	int aggressive = 0;
+	int throttle = 0;
+	int maxCopies;
 	int gcOk = YAFFS_OK;
 	int maxTries = 0;
 	int minErased;
@@ -2571,7 +2728,17 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 		/* If we need a block soon then do aggressive gc.*/
 		if (dev->nErasedBlocks < minErased)
 			aggressive = 1;
-		else {
+		else if (!background &&
+			dev->nErasedBlocks < minErased + YAFFS_GC_THROTTLE_BLOCKS &&
+			dev->nFreeChunks - erasedChunks >= dev->param.nChunksPerBlock) {
+			/* Getting close to that, and there is dirt to collect.
+			 * Have writers pay for it a few chunks at a time, more
+			 * the closer we get, so they never have to copy a whole
+			 * block in one go.
+			 */
+			throttle = minErased + YAFFS_GC_THROTTLE_BLOCKS -
+					dev->nErasedBlocks;
+		} else {
 			if(!background && erasedChunks > (dev->nFreeChunks / 4))
 				break;
 
@@ -2591,28 +2758,38 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 
                 /* If we don't already have a block being gc'd then see if we should start another */
 
-		if (dev->gcBlock < 1 && !aggressive) {
+		if (dev->gcBlock < 1 && !aggressive && !throttle) {
 			dev->gcBlock = yaffs2_FindRefreshBlock(dev);
 			dev->gcChunk = 0;
 			dev->nCleanups=0;
 		}
 		if (dev->gcBlock < 1) {
-			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev, aggressive, background);
+			dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev,
+						aggressive || throttle, background);
 			dev->gcChunk = 0;
 			dev->nCleanups=0;
 		}
 
 		if (dev->gcBlock > 0) {
 			dev->allGCs++;
-			if (!aggressive)
+			if (throttle)
+				dev->throttledGCs++;
+			else if (!aggressive)
 				dev->passiveGCs++;
 
 			T(YAFFS_TRACE_GC,
 			  (TSTR
-			   ("yaffs: GC erasedBlocks %d aggressive %d" TENDSTR),
-			   dev->nErasedBlocks, aggressive));
+			   ("yaffs: GC erasedBlocks %d aggressive %d throttle %d" TENDSTR),
+			   dev->nErasedBlocks, aggressive, throttle));
 
-			gcOk = yaffs_GarbageCollectBlock(dev, dev->gcBlock, aggressive);
+			if (aggressive)
+				maxCopies = dev->param.nChunksPerBlock;
+			else if (throttle)
+				maxCopies = YAFFS_GC_PASSIVE_COPIES << (throttle - 1);
+			else
+				maxCopies = YAFFS_GC_PASSIVE_COPIES;
+
+			gcOk = yaffs_GarbageCollectBlock(dev, dev->gcBlock, maxCopies);
 		}
 
 		if (dev->nErasedBlocks < (dev->param.nReservedBlocks) && dev->gcBlock > 0) {
@@ -2843,6 +3020,7 @@ int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 		in->nDataChunks++;
 
 	yaffs_LoadLevel0Tnode(dev, tn, chunkInInode, chunkInNAND);
+	yaffs2_CheckpointObjectDirty(in);
 
 	return YAFFS_OK;
 }
@@ -3115,6 +3293,7 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
 		/* Tags */
 		yaffs_InitialiseTags(&newTags);
 		in->serial++;
+		yaffs2_CheckpointObjectDirty(in);
 		newTags.chunkId = 0;
 		newTags.objectId = in->objectId;
 		newTags.serialNumber = in->serial;
@@ -3176,10 +3355,59 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
  *   In Linux, the page cache provides read buffering aand the short op cache provides write
  *   buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   The number of cache chunks is set at mount time and can run to a few hundred,
+ *   so cached chunks are looked up through a hash on object and chunk id. The
+ *   searches for a chunk to push out are still linear, but they only happen when
+ *   we are about to go to NAND anyway.
+ *
+ *   Files that are read sequentially get the next few chunks read into the cache
+ *   ahead of time.
  */
 
+static int yaffs_ChunkCacheBucket(yaffs_Device *dev, const yaffs_Object *obj,
+				int chunkId)
+{
+	return (obj->objectId * 31 + chunkId) & dev->srCacheHashMask;
+}
+
+/* Take a cache chunk out of the hash and mark it free */
+static void yaffs_ReleaseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	yaffs_ChunkCache **link;
+
+	if (!cache->object)
+		return;
+
+	link = &dev->srCacheHash[yaffs_ChunkCacheBucket(dev, cache->object,
+							cache->chunkId)];
+	while (*link && *link != cache)
+		link = &(*link)->hashNext;
+	if (*link)
+		*link = cache->hashNext;
+
+	cache->hashNext = NULL;
+	cache->object = NULL;
+	cache->readAhead = 0;
+}
+
+/* Give a cache chunk to an object's chunk. Its data still has to be loaded. */
+static void yaffs_AssignChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
+				yaffs_Object *obj, int chunkId)
+{
+	int bucket = yaffs_ChunkCacheBucket(dev, obj, chunkId);
+
+	yaffs_ReleaseChunkCache(dev, cache);
+
+	cache->object = obj;
+	cache->chunkId = chunkId;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->nBytes = 0;
+	cache->readAhead = 0;
+	cache->hashNext = dev->srCacheHash[bucket];
+	dev->srCacheHash[bucket] = cache;
+}
+
 static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
@@ -3198,53 +3426,57 @@ static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 }
 
 
+/* Write out all the dirty chunks of an object.
+ * They are written in one go in chunk order so that a file's chunks land
+ * next to each other on NAND, whatever order they were dirtied in.
+ */
 static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int lowest = -99;	/* Stop compiler whining. */
 	int i;
+	int j;
+	int nDirty = 0;
 	yaffs_ChunkCache *cache;
-	int chunkWritten = 0;
+	int chunkWritten = 1;
 	int nCaches = obj->myDev->param.nShortOpCaches;
 
-	if (nCaches > 0) {
-		do {
-			cache = NULL;
+	if (nCaches < 1)
+		return;
 
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < nCaches; i++) {
-				if (dev->srCache[i].object == obj &&
-				    dev->srCache[i].dirty) {
-					if (!cache
-					    || dev->srCache[i].chunkId <
-					    lowest) {
-						cache = &dev->srCache[i];
-						lowest = cache->chunkId;
-					}
-				}
-			}
+	/* Gather the dirty chunks, sorted by chunk id. There are never
+	 * very many so an insertion sort will do.
+	 */
+	for (i = 0; i < nCaches; i++) {
+		cache = &dev->srCache[i];
+		if (cache->object != obj || !cache->dirty || cache->locked)
+			continue;
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+		for (j = nDirty; j > 0 &&
+			dev->srCacheFlush[j - 1]->chunkId > cache->chunkId; j--)
+			dev->srCacheFlush[j] = dev->srCacheFlush[j - 1];
+		dev->srCacheFlush[j] = cache;
+		nDirty++;
+	}
 
-				chunkWritten =
-				    yaffs_WriteChunkDataToObject(cache->object,
-								 cache->chunkId,
-								 cache->data,
-								 cache->nBytes,
-								 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+	for (i = 0; i < nDirty && chunkWritten > 0; i++) {
+		cache = dev->srCacheFlush[i];
 
-		} while (cache && chunkWritten > 0);
+		/* Write it out and free it up */
+		chunkWritten =
+		    yaffs_WriteChunkDataToObject(cache->object,
+						 cache->chunkId,
+						 cache->data,
+						 cache->nBytes,
+						 1);
+		cache->dirty = 0;
+		yaffs_ReleaseChunkCache(dev, cache);
+	}
 
-		if (cache) {
-			/* Hoosterman, disk full while writing cache out. */
-			T(YAFFS_TRACE_ERROR,
-			  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
+	if (chunkWritten <= 0) {
+		/* Hoosterman, disk full while writing cache out. */
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
 
-		}
 	}
 
 }
@@ -3349,23 +3581,42 @@ static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 
 }
 
+/* Grab a cache chunk without writing anything out: a free one, else the
+ * least recently used clean one. Read-ahead is not worth a flush.
+ */
+static yaffs_ChunkCache *yaffs_GrabCleanChunkCache(yaffs_Device *dev)
+{
+	yaffs_ChunkCache *cache = NULL;
+	yaffs_ChunkCache *c;
+	int i;
+
+	for (i = 0; i < dev->param.nShortOpCaches; i++) {
+		c = &dev->srCache[i];
+		if (!c->object)
+			return c;
+		if (!c->dirty && !c->locked &&
+		    (!cache || c->lastUse < cache->lastUse))
+			cache = c;
+	}
+
+	return cache;
+}
+
 /* Find a cached chunk */
 static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
 					      int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
-	if (dev->param.nShortOpCaches > 0) {
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
-				dev->cacheHits++;
+	yaffs_ChunkCache *cache;
 
-				return &dev->srCache[i];
-			}
-		}
-	}
-	return NULL;
+	if (dev->param.nShortOpCaches < 1)
+		return NULL;
+
+	cache = dev->srCacheHash[yaffs_ChunkCacheBucket(dev, obj, chunkId)];
+	while (cache && (cache->object != obj || cache->chunkId != chunkId))
+		cache = cache->hashNext;
+
+	return cache;
 }
 
 /* Mark the chunk for the least recently used algorithym */
@@ -3402,7 +3653,7 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_ReleaseChunkCache(object->myDev, cache);
 	}
 }
 
@@ -3418,11 +3669,50 @@ static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 		/* Invalidate it. */
 		for (i = 0; i < dev->param.nShortOpCaches; i++) {
 			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
+				yaffs_ReleaseChunkCache(dev, &dev->srCache[i]);
 		}
 	}
 }
 
+/* Read the chunks following lastChunk into the cache, without pushing out
+ * anything dirty. Called once a file is seen to be read sequentially.
+ */
+static void yaffs_ReadAhead(yaffs_Object *in, int lastChunk)
+{
+	yaffs_Device *dev = in->myDev;
+	yaffs_ChunkCache *cache;
+	int nChunks = dev->param.nReadAheadChunks;
+	int endChunk;
+	__u32 endOffset;
+	int chunk;
+
+	/* Leave at least half the cache for everything else */
+	if (nChunks > dev->param.nShortOpCaches / 2)
+		nChunks = dev->param.nShortOpCaches / 2;
+
+	/* Last chunk holding data */
+	yaffs_AddrToChunk(dev, in->variant.fileVariant.fileSize,
+			&endChunk, &endOffset);
+	if (endOffset)
+		endChunk++;
+
+	for (chunk = lastChunk + 1;
+	     chunk <= lastChunk + nChunks && chunk <= endChunk;
+	     chunk++) {
+		if (yaffs_FindChunkCache(in, chunk))
+			continue;
+
+		cache = yaffs_GrabCleanChunkCache(dev);
+		if (!cache)
+			break;
+
+		yaffs_AssignChunkCache(dev, cache, in, chunk);
+		yaffs_ReadChunkDataFromObject(in, chunk, cache->data);
+		yaffs_UseChunkCache(dev, cache, 0);
+		cache->readAhead = 1;
+		dev->readAheadChunks++;
+	}
+}
 
 /*--------------------- File read/write ------------------------
  * Read and write have very similar structures.
@@ -3443,12 +3733,20 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 	int nToCopy;
 	int n = nBytes;
 	int nDone = 0;
+	int sequential;
 	yaffs_ChunkCache *cache;
 
 	yaffs_Device *dev;
 
 	dev = in->myDev;
 
+	/* Picking up in or just after the chunk where the last read left off */
+	yaffs_AddrToChunk(dev, offset, &chunk, &start);
+	chunk++;
+	sequential = in->variant.fileVariant.lastReadChunk > 0 &&
+		(chunk == in->variant.fileVariant.lastReadChunk ||
+		 chunk == in->variant.fileVariant.lastReadChunk + 1);
+
 	while (n > 0) {
 		/* chunk = offset / dev->nDataBytesPerChunk + 1; */
 		/* start = offset % dev->nDataBytesPerChunk; */
@@ -3476,14 +3774,17 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 
 				if (!cache) {
 					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_AssignChunkCache(dev, cache,
+								in, chunk);
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->
 								      data);
-					cache->nBytes = 0;
+					dev->cacheMisses++;
+				} else {
+					dev->cacheHits++;
+					if (cache->readAhead)
+						dev->readAheadHits++;
+					cache->readAhead = 0;
 				}
 
 				yaffs_UseChunkCache(dev, cache, 0);
@@ -3523,6 +3824,12 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 
 	}
 
+	if (nDone > 0) {
+		if (sequential && dev->param.nReadAheadChunks > 0)
+			yaffs_ReadAhead(in, chunk);
+		in->variant.fileVariant.lastReadChunk = chunk;
+	}
+
 	return nDone;
 }
 
@@ -3599,16 +3906,17 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 				yaffs_ChunkCache *cache;
 				/* If we can't find the data in the cache, then load the cache */
 				cache = yaffs_FindChunkCache(in, chunk);
+				if (cache)
+					dev->cacheHits++;
 
 				if (!cache
 				    && yaffs_CheckSpaceForAllocation(dev, 1)) {
 					cache = yaffs_GrabChunkCache(dev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_AssignChunkCache(dev, cache,
+								in, chunk);
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->data);
+					dev->cacheMisses++;
 				} else if (cache &&
 					!cache->dirty &&
 					!yaffs_CheckSpaceForAllocation(dev, 1)) {
@@ -3620,6 +3928,7 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 
 				if (cache) {
 					yaffs_UseChunkCache(dev, cache, 1);
+					cache->readAhead = 0;
 					cache->locked = 1;
 
 
@@ -3694,8 +4003,10 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 
 	/* Update file object */
 
-	if ((startOfWrite + nDone) > in->variant.fileVariant.fileSize)
+	if ((startOfWrite + nDone) > in->variant.fileVariant.fileSize) {
 		in->variant.fileVariant.fileSize = (startOfWrite + nDone);
+		yaffs2_CheckpointObjectDirty(in);
+	}
 
 	in->dirty = 1;
 
@@ -3747,6 +4058,7 @@ static void yaffs_PruneResizedChunks(yaffs_Object *in, int newSize)
 				   chunkId, i));
 			} else {
 				in->nDataChunks--;
+				yaffs2_CheckpointObjectDirty(in);
 				yaffs_DeleteChunk(dev, chunkId, 1, __LINE__);
 			}
 		}
@@ -3781,6 +4093,7 @@ void yaffs_ResizeDown( yaffs_Object *obj, loff_t newSize)
 	}
 
 	obj->variant.fileVariant.fileSize = newSize;
+	yaffs2_CheckpointObjectDirty(obj);
 
 	yaffs_PruneFileStructure(dev, &obj->variant.fileVariant);
 }
@@ -3805,6 +4118,7 @@ int yaffs_ResizeFile(yaffs_Object *in, loff_t newSize)
 	if(newSize > oldFileSize){
 		yaffs2_HandleHole(in,newSize);
 		in->variant.fileVariant.fileSize = newSize;
+		yaffs2_CheckpointObjectDirty(in);
 	} else {
 		/* newSize < oldFileSize */ 
 		yaffs_ResizeDown(in, newSize);
@@ -3917,6 +4231,7 @@ static int yaffs_UnlinkFileIfNeeded(yaffs_Object *in)
 		  (TSTR("yaffs: immediate deletion of file %d" TENDSTR),
 		   in->objectId));
 		in->deleted = 1;
+		yaffs2_CheckpointObjectDirty(in);
 		in->myDev->nDeletedFiles++;
 		if (dev->param.disableSoftDelete || dev->param.isYaffs2)
 			yaffs_ResizeFile(in, 0);
@@ -3951,6 +4266,7 @@ int yaffs_DeleteFile(yaffs_Object *in)
 
 		if (retVal == YAFFS_OK && in->unlinked && !in->deleted) {
 			in->deleted = 1;
+			yaffs2_CheckpointObjectDirty(in);
 			deleted = 1;
 			in->myDev->nDeletedFiles++;
 			yaffs_SoftDeleteFile(in);
@@ -4480,6 +4796,7 @@ static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj)
 
 	ylist_del_init(&obj->siblings);
 	obj->parent = NULL;
+	yaffs2_CheckpointObjectDirty(obj);
 	
 	yaffs_VerifyDirectory(parent);
 }
@@ -4517,6 +4834,7 @@ void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 	/* Now add it */
 	ylist_add(&obj->siblings, &directory->variant.directoryVariant.children);
 	obj->parent = directory;
+	yaffs2_CheckpointObjectDirty(obj);
 
 	if (directory == obj->myDev->unlinkedDir
 			|| directory == obj->myDev->deletedDir) {
@@ -5293,18 +5611,43 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		init_failed = 1;
 
 	dev->srCache = NULL;
+	dev->srCacheHash = NULL;
+	dev->srCacheFlush = NULL;
 	dev->gcCleanupList = NULL;
+	dev->summaryImage = NULL;
+	dev->summaryScan = NULL;
+	dev->scanSummaryBlocks = 0;
+	dev->checkpointDeadList = NULL;
+	dev->nCheckpointDead = 0;
+	dev->maxCheckpointDead = 0;
+	dev->checkpointLogValid = 0;
+	dev->checkpointForceBase = 0;
 
 
 	if (!init_failed &&
 	    dev->param.nShortOpCaches > 0) {
 		int i;
 		void *buf;
-		int srCacheBytes = dev->param.nShortOpCaches * sizeof(yaffs_ChunkCache);
+		int srCacheBytes;
+		int nHash;
 
 		if (dev->param.nShortOpCaches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.nShortOpCaches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		srCacheBytes = dev->param.nShortOpCaches * sizeof(yaffs_ChunkCache);
+
+		/* Keep the hash chains short: at least two buckets per entry */
+		for (nHash = 1; nHash < 2 * dev->param.nShortOpCaches; nHash <<= 1) {}
+		dev->srCacheHashMask = nHash - 1;
+		dev->srCacheHash = YMALLOC(nHash * sizeof(yaffs_ChunkCache *));
+		dev->srCacheFlush = YMALLOC(dev->param.nShortOpCaches *
+					sizeof(yaffs_ChunkCache *));
+		if (dev->srCacheHash)
+			memset(dev->srCacheHash, 0,
+				nHash * sizeof(yaffs_ChunkCache *));
+		if (!dev->srCacheHash || !dev->srCacheFlush)
+			init_failed = 1;
+
 		dev->srCache =  YMALLOC(srCacheBytes);
 
 		buf = (__u8 *) dev->srCache;
@@ -5325,6 +5668,9 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	}
 
 	dev->cacheHits = 0;
+	dev->cacheMisses = 0;
+	dev->readAheadChunks = 0;
+	dev->readAheadHits = 0;
 
 	if (!init_failed) {
 		dev->gcCleanupList = YMALLOC(dev->param.nChunksPerBlock * sizeof(__u32));
@@ -5332,6 +5678,9 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 			init_failed = 1;
 	}
 
+	if (!init_failed && !yaffs_SummaryInit(dev))
+		init_failed = 1;
+
 	if (dev->param.isYaffs2)
 		dev->param.useHeaderFileSize = 1;
 
@@ -5397,6 +5746,9 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		return YAFFS_FAIL;
 	}
 
+	/* Remember what the mount cost before zeroing the stats */
+	dev->scanPageReads = dev->nPageReads;
+
 	/* Zero out stats */
 	dev->nPageReads = 0;
 	dev->nPageWrites = 0;
@@ -5439,7 +5791,22 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 			dev->srCache = NULL;
 		}
 
+		if (dev->srCacheHash)
+			YFREE(dev->srCacheHash);
+		dev->srCacheHash = NULL;
+		if (dev->srCacheFlush)
+			YFREE(dev->srCacheFlush);
+		dev->srCacheFlush = NULL;
+
 		YFREE(dev->gcCleanupList);
+		yaffs_SummaryDeinit(dev);
+
+		if (dev->checkpointDeadList)
+			YFREE(dev->checkpointDeadList);
+		dev->checkpointDeadList = NULL;
+		dev->nCheckpointDead = 0;
+		dev->maxCheckpointDead = 0;
+		dev->checkpointLogValid = 0;
 
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
 			YFREE(dev->tempBuffer[i].buffer);
@@ -64,7 +64,7 @@
 #define YAFFS_OBJECT_SPACE		0x40000
 #define YAFFS_MAX_OBJECT_ID		(YAFFS_OBJECT_SPACE -1)
 
-#define YAFFS_CHECKPOINT_VERSION 	4
+#define YAFFS_CHECKPOINT_VERSION 	5
 
 #ifdef CONFIG_YAFFS_UNICODE
 #define YAFFS_MAX_NAME_LENGTH		127
@@ -84,14 +84,23 @@
 
 /* Pseudo object ids for checkpointing */
 #define YAFFS_OBJECTID_SB_HEADER	0x10
+#define YAFFS_OBJECTID_SUMMARY		0x11
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	256
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Writers start collecting a little at a time this many blocks before
+ * they would otherwise have to collect whole blocks.
+ */
+#define YAFFS_GC_THROTTLE_BLOCKS	4
+
+/* Write latency histogram buckets: <1ms, <2ms, <4ms ... */
+#define YAFFS_N_WRITE_LATENCY_BUCKETS	12
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -112,13 +121,15 @@
 #define YAFFS_SEQUENCE_BAD_BLOCK	0xFFFF0000
 
 /* ChunkCache is used for short read/write operations.*/
-typedef struct {
+typedef struct yaffs_ChunkCacheStruct {
 	struct yaffs_ObjectStruct *object;
 	int chunkId;
 	int lastUse;
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
+	int readAhead;		/* Loaded by read-ahead and not read yet */
+	struct yaffs_ChunkCacheStruct *hashNext; /* Chain while object is set */
 	__u8 *data;
 } yaffs_ChunkCache;
 
@@ -372,6 +383,7 @@ typedef struct {
 	__u32 shrinkSize;
 	int topLevel;
 	yaffs_Tnode *top;
+	int lastReadChunk;	/* For spotting sequential reads */
 } yaffs_FileStructure;
 
 typedef struct {
@@ -421,6 +433,8 @@ struct yaffs_ObjectStruct {
 	__u8 xattrKnown:1;	/* We know if this has object has xattribs or not. */
 	__u8 hasXattr:1;	/* This object has xattribs. Valid if xattrKnown. */
 
+	__u8 inCheckpoint:1;	/* Written to the checkpoint log */
+
 	__u8 serial;		/* serial number of chunk in NAND. Cached here */
 	__u16 sum;		/* sum of the name to speed searching */
 
@@ -442,6 +456,10 @@ struct yaffs_ObjectStruct {
 
 	__u32 objectId;		/* the object id value */
 
+	struct ylist_head checkpointLink; /* On dev->checkpointDirty while
+					   * changed since the last segment.
+					   */
+
 	__u32 yst_mode;
 
 #ifdef CONFIG_YAFFS_SHORT_NAMES_IN_RAM
@@ -537,6 +555,9 @@ struct yaffs_DeviceParamStruct {
 				 * the number of short op caches (don't use too many).
                                  * 10 to 20 is a good bet.
 				 */
+	int nReadAheadChunks;	/* Chunks to read ahead into the short op cache
+				 * when a file is read sequentially, 0 for none.
+				 */
 	int useNANDECC;		/* Flag to decide whether or not to use NANDECC on data (yaffs1) */
 	int noTagsECC;		/* Flag to decide whether or not to do ECC on packed tags (yaffs2) */ 
 
@@ -552,6 +573,8 @@ struct yaffs_DeviceParamStruct {
 
 	int enableXattr;	/* Enable xattribs */
 
+	int enableSummary;	/* Write block summaries to speed up scanning (yaffs2) */
+
 	/* NAND access functions (Must be set before calling YAFFS)*/
 
 	int (*writeChunkToNAND) (struct yaffs_DeviceStruct *dev,
@@ -666,6 +689,21 @@ struct yaffs_DeviceStruct {
 
 	int nCheckpointBlocksRequired; /* Number of blocks needed to store current checkpoint set */
 
+	/* Checkpoint log. Once a full checkpoint is on flash, later
+	 * checkpoints are appended to it as deltas instead of rewriting it.
+	 */
+	int checkpointLogValid;		/* The log plus checkpointDirty is what we have */
+	int checkpointLogBlock;		/* Where the next segment goes */
+	int checkpointLogChunk;
+	int checkpointLogNextBlock;
+	int checkpointLogPageSequence;
+	int checkpointStreamBlocks;	/* Blocks added by this open of the stream */
+	int checkpointForceBase;	/* Lost track of something, write it all */
+	struct ylist_head checkpointDirty; /* Objects changed since the last segment */
+	__u32 *checkpointDeadList;	/* Logged objects freed since the last segment */
+	int nCheckpointDead;
+	int maxCheckpointDead;
+
 	/* Block Info */
 	yaffs_BlockInfo *blockInfo;
 	__u8 *chunkBits;	/* bitmap of chunks in use */
@@ -720,6 +758,9 @@ struct yaffs_DeviceStruct {
 
 	yaffs_ChunkCache *srCache;
 	int srLastUse;
+	yaffs_ChunkCache **srCacheHash;	/* Cache entries by object and chunk */
+	int srCacheHashMask;
+	yaffs_ChunkCache **srCacheFlush; /* Scratch list for flushing in order */
 
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
@@ -747,6 +788,13 @@ struct yaffs_DeviceStruct {
 	/* Dirty directory handling */
 	struct ylist_head dirtyDirectories; /* List of dirty directories */
 
+	/* Block summaries (yaffs2) */
+	int chunksPerSummary;	/* Data chunks per block, nChunksPerBlock if no summaries */
+	int nSummaryChunks;	/* Chunks at the end of each block holding the summary */
+	__u8 *summaryImage;	/* Summary of the block being written */
+	__u8 *summaryScan;	/* Summary of the block being scanned */
+	int summaryBlock;	/* Block summaryImage describes, -1 if none */
+	int summaryNext;	/* Next chunk expected in summaryBlock */
 
 	/* Statistcs */
 	__u32 nPageWrites;
@@ -759,6 +807,8 @@ struct yaffs_DeviceStruct {
 	__u32 oldestDirtyGCs;
 	__u32 nGCBlocks;
 	__u32 backgroundGCs;
+	__u32 costBenefitGCs;
+	__u32 throttledGCs;
 	__u32 nRetriedWrites;
 	__u32 nRetiredBlocks;
 	__u32 eccFixed;
@@ -769,6 +819,25 @@ struct yaffs_DeviceStruct {
 	__u32 nUnmarkedDeletions;
 	__u32 refreshCount;
 	__u32 cacheHits;
+	__u32 cacheMisses;
+	__u32 readAheadChunks;
+	__u32 readAheadHits;
+
+	/* Mount statistics, kept after the counters above are zeroed */
+	__u32 scanPageReads;
+	__u32 scanSummaryBlocks;
+	__u32 mountTimeMs;
+
+	/* Checkpoint statistics */
+	__u32 nCheckpointBases;
+	__u32 nCheckpointDeltas;
+	__u32 nCheckpointCompactions;
+	__u32 checkpointObjectsWritten;	/* by the last checkpoint */
+	__u32 checkpointSaveMs;		/* time taken by the last checkpoint */
+
+	/* Write latency as seen by the OS glue, lock wait included */
+	__u32 writeLatency[YAFFS_N_WRITE_LATENCY_BUCKETS];
+	__u32 maxWriteLatencyUs;
 
 };
 
@@ -957,6 +1026,8 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 			int nBytes, int writeThrough);
 void yaffs_ResizeDown( yaffs_Object *obj, loff_t newSize);
 void yaffs_SkipRestOfBlock(yaffs_Device *dev);
+int yaffs_ResetFileStructure(yaffs_Object *obj);
+void yaffs_ForgetObject(yaffs_Object *obj);
 
 int yaffs_CountFreeChunks(yaffs_Device *dev);
 
@@ -0,0 +1,292 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2010 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Block summaries.
+ *
+ * Without a checkpoint, yaffs2 has to read the tags of every chunk on the
+ * device to rebuild its state. When summaries are enabled the last
+ * nSummaryChunks chunks of each block carry a copy of the tags of the
+ * chunks in front of them, so a full block costs one read at scan time.
+ *
+ * Summary chunks are never allocated. They are written straight after the
+ * last data chunk of a block, the rest of the block is skipped and the
+ * scanner treats them like skipped chunks, so GC never needs to copy them.
+ * A block that was not written start to finish in one go (write failure,
+ * remount while it was being allocated from) just gets no summary and is
+ * scanned chunk by chunk as before.
+ */
+
+#include "yaffs_summary.h"
+#include "yaffs_nand.h"
+#include "yaffs_getblockinfo.h"
+#include "yaffs_tagsvalidity.h"
+#include "yaffs_trace.h"
+
+#define YAFFS_SUMMARY_VERSION	1
+
+typedef struct {
+	__u32 version;
+	__u32 block;
+	__u32 sequenceNumber;
+	__u32 sum;
+} yaffs_SummaryHeader;
+
+typedef struct {
+	__u32 objectId;
+	__u32 chunkId;
+	__u32 byteCount;
+} yaffs_SummaryTags;
+
+static yaffs_SummaryTags *yaffs_SummaryTagsOf(__u8 *image)
+{
+	return (yaffs_SummaryTags *)(image + sizeof(yaffs_SummaryHeader));
+}
+
+static __u32 yaffs_SummarySumBytes(__u32 sum, const __u8 *p, int nBytes)
+{
+	while (nBytes-- > 0)
+		sum = ((sum << 1) | (sum >> 31)) + *p++;
+
+	return sum;
+}
+
+static __u32 yaffs_SummarySum(yaffs_Device *dev, __u8 *image)
+{
+	yaffs_SummaryHeader *hdr = (yaffs_SummaryHeader *)image;
+	__u32 sum;
+
+	/* Everything in the header but the sum itself, then the tags */
+	sum = yaffs_SummarySumBytes(0, (const __u8 *)hdr,
+				3 * sizeof(__u32));
+	return yaffs_SummarySumBytes(sum,
+				(const __u8 *)yaffs_SummaryTagsOf(image),
+				dev->chunksPerSummary *
+				sizeof(yaffs_SummaryTags));
+}
+
+int yaffs_SummaryInit(yaffs_Device *dev)
+{
+	int nChunks = dev->param.nChunksPerBlock;
+	int nBytes;
+	int n;
+
+	dev->summaryBlock = -1;
+	dev->summaryNext = 0;
+	dev->chunksPerSummary = nChunks;
+	dev->nSummaryChunks = 0;
+	dev->summaryImage = NULL;
+	dev->summaryScan = NULL;
+
+	if (!dev->param.isYaffs2 || !dev->param.enableSummary)
+		return YAFFS_OK;
+
+	/* Find the smallest number of chunks that holds the header and the
+	 * tags of all the chunks left over in front of it.
+	 */
+	for (n = 1; n < nChunks; n++) {
+		nBytes = sizeof(yaffs_SummaryHeader) +
+			(nChunks - n) * sizeof(yaffs_SummaryTags);
+		if (nBytes <= n * dev->nDataBytesPerChunk)
+			break;
+	}
+
+	if (n > nChunks / 4) {
+		T(YAFFS_TRACE_ALWAYS,
+		  (TSTR("yaffs: summaries would need %d of %d chunks, disabled"
+		  TENDSTR), n, nChunks));
+		return YAFFS_OK;
+	}
+
+	nBytes = n * dev->nDataBytesPerChunk;
+	dev->summaryImage = YMALLOC(nBytes);
+	dev->summaryScan = YMALLOC(nBytes);
+	if (!dev->summaryImage || !dev->summaryScan) {
+		yaffs_SummaryDeinit(dev);
+		return YAFFS_FAIL;
+	}
+	memset(dev->summaryImage, 0, nBytes);
+
+	dev->nSummaryChunks = n;
+	dev->chunksPerSummary = nChunks - n;
+
+	T(YAFFS_TRACE_SCAN,
+	  (TSTR("yaffs: block summaries in %d chunks for %d chunks" TENDSTR),
+	  dev->nSummaryChunks, dev->chunksPerSummary));
+
+	return YAFFS_OK;
+}
+
+void yaffs_SummaryDeinit(yaffs_Device *dev)
+{
+	if (dev->summaryImage)
+		YFREE(dev->summaryImage);
+	if (dev->summaryScan)
+		YFREE(dev->summaryScan);
+	dev->summaryImage = NULL;
+	dev->summaryScan = NULL;
+	dev->nSummaryChunks = 0;
+	dev->chunksPerSummary = dev->param.nChunksPerBlock;
+	dev->summaryBlock = -1;
+}
+
+static int yaffs_SummaryWrite(yaffs_Device *dev, int blk)
+{
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blk);
+	yaffs_SummaryHeader *hdr = (yaffs_SummaryHeader *)dev->summaryImage;
+	yaffs_ExtendedTags tags;
+	int chunk;
+	int i;
+	int result = YAFFS_OK;
+
+	hdr->version = YAFFS_SUMMARY_VERSION;
+	hdr->block = blk;
+	hdr->sequenceNumber = bi->sequenceNumber;
+	hdr->sum = yaffs_SummarySum(dev, dev->summaryImage);
+
+	chunk = blk * dev->param.nChunksPerBlock + dev->chunksPerSummary;
+
+	for (i = 0; i < dev->nSummaryChunks && result == YAFFS_OK; i++) {
+		yaffs_InitialiseTags(&tags);
+		tags.objectId = YAFFS_OBJECTID_SUMMARY;
+		tags.chunkId = i + 1;
+		tags.byteCount = dev->nDataBytesPerChunk;
+
+		result = yaffs_WriteChunkWithTagsToNAND(dev, chunk + i,
+				dev->summaryImage + i * dev->nDataBytesPerChunk,
+				&tags);
+	}
+
+	/*
+	 * Treat it like any other failed chunk write: the block gets
+	 * collected and retired. The summary left behind fails its tag or
+	 * sum checks, so a scan before then reads the block the slow way.
+	 */
+	if (result != YAFFS_OK) {
+		T(YAFFS_TRACE_ERROR | YAFFS_TRACE_BAD_BLOCKS,
+		  (TSTR("yaffs: failed to write summary for block %d, "
+			"block needs retiring" TENDSTR), blk));
+		yaffs_HandleChunkError(dev, bi);
+		bi->needsRetiring = 1;
+	}
+
+	return result;
+}
+
+/*
+ * Record the tags of a chunk that has just been written. Once the data
+ * part of the block is full, write the summary out and move on to the
+ * next block.
+ */
+void yaffs_SummaryAdd(yaffs_Device *dev, const yaffs_ExtendedTags *tags,
+			int chunkInNAND)
+{
+	int blk = chunkInNAND / dev->param.nChunksPerBlock;
+	int chunkInBlock = chunkInNAND % dev->param.nChunksPerBlock;
+	yaffs_SummaryTags *st;
+
+	if (!dev->nSummaryChunks)
+		return;
+
+	if (chunkInBlock == 0) {
+		dev->summaryBlock = blk;
+		dev->summaryNext = 0;
+	}
+
+	if (blk != dev->summaryBlock || chunkInBlock != dev->summaryNext) {
+		/* Something got written behind our back, no summary here */
+		dev->summaryBlock = -1;
+		return;
+	}
+
+	st = yaffs_SummaryTagsOf(dev->summaryImage) + chunkInBlock;
+	st->objectId = tags->objectId;
+	st->chunkId = tags->chunkId;
+	st->byteCount = tags->byteCount;
+
+	dev->summaryNext++;
+	if (dev->summaryNext < dev->chunksPerSummary)
+		return;
+
+	dev->summaryBlock = -1;
+	if (dev->allocationBlock == blk)
+		yaffs_SummaryWrite(dev, blk);
+	yaffs_SkipRestOfBlock(dev);
+}
+
+/*
+ * Read and check the summary of a block. On success yaffs_SummaryFetch()
+ * can be used to get the tags of each chunk in the block.
+ */
+int yaffs_SummaryRead(yaffs_Device *dev, int blk)
+{
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blk);
+	yaffs_SummaryHeader *hdr = (yaffs_SummaryHeader *)dev->summaryScan;
+	yaffs_ExtendedTags tags;
+	int chunk;
+	int i;
+
+	if (!dev->nSummaryChunks)
+		return YAFFS_FAIL;
+
+	chunk = blk * dev->param.nChunksPerBlock + dev->chunksPerSummary;
+
+	for (i = 0; i < dev->nSummaryChunks; i++) {
+		if (yaffs_ReadChunkWithTagsFromNAND(dev, chunk + i,
+				dev->summaryScan + i * dev->nDataBytesPerChunk,
+				&tags) != YAFFS_OK)
+			return YAFFS_FAIL;
+
+		if (!tags.chunkUsed ||
+		    tags.eccResult == YAFFS_ECC_RESULT_UNFIXED ||
+		    tags.objectId != YAFFS_OBJECTID_SUMMARY ||
+		    tags.chunkId != i + 1 ||
+		    tags.sequenceNumber != bi->sequenceNumber)
+			return YAFFS_FAIL;
+	}
+
+	if (hdr->version != YAFFS_SUMMARY_VERSION ||
+	    hdr->block != blk ||
+	    hdr->sequenceNumber != bi->sequenceNumber ||
+	    hdr->sum != yaffs_SummarySum(dev, dev->summaryScan)) {
+		T(YAFFS_TRACE_SCAN,
+		  (TSTR("yaffs: summary for block %d is bad" TENDSTR), blk));
+		return YAFFS_FAIL;
+	}
+
+	return YAFFS_OK;
+}
+
+void yaffs_SummaryFetch(yaffs_Device *dev, yaffs_ExtendedTags *tags,
+			int chunkInBlock)
+{
+	yaffs_SummaryHeader *hdr = (yaffs_SummaryHeader *)dev->summaryScan;
+	yaffs_SummaryTags *st;
+
+	yaffs_InitialiseTags(tags);
+	tags->chunkUsed = 1;
+	tags->eccResult = YAFFS_ECC_RESULT_NO_ERROR;
+	tags->sequenceNumber = hdr->sequenceNumber;
+
+	if (chunkInBlock >= dev->chunksPerSummary) {
+		tags->objectId = YAFFS_OBJECTID_SUMMARY;
+		tags->chunkId = chunkInBlock - dev->chunksPerSummary + 1;
+		tags->byteCount = dev->nDataBytesPerChunk;
+		return;
+	}
+
+	st = yaffs_SummaryTagsOf(dev->summaryScan) + chunkInBlock;
+	tags->objectId = st->objectId;
+	tags->chunkId = st->chunkId;
+	tags->byteCount = st->byteCount;
+}
@@ -0,0 +1,31 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2010 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Per-block summaries of chunk tags, used to speed up yaffs2 scanning
+ */
+
+#ifndef __YAFFS_SUMMARY_H__
+#define __YAFFS_SUMMARY_H__
+
+#include "yaffs_guts.h"
+
+int yaffs_SummaryInit(yaffs_Device *dev);
+void yaffs_SummaryDeinit(yaffs_Device *dev);
+void yaffs_SummaryAdd(yaffs_Device *dev, const yaffs_ExtendedTags *tags,
+			int chunkInNAND);
+int yaffs_SummaryRead(yaffs_Device *dev, int blk);
+void yaffs_SummaryFetch(yaffs_Device *dev, yaffs_ExtendedTags *tags,
+			int chunkInBlock);
+
+#endif
@@ -78,6 +78,7 @@
 #include <linux/interrupt.h>
 #include <linux/string.h>
 #include <linux/ctype.h>
+#include <linux/ktime.h>
 
 #if (YAFFS_NEW_FOLLOW_LINK == 1)
 #include <linux/namei.h>
@@ -163,6 +164,7 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 #include "yportenv.h"
 #include "yaffs_trace.h"
 #include "yaffs_guts.h"
+#include "yaffs_yaffs2.h"
 
 #include "yaffs_linux.h"
 
@@ -1436,6 +1438,18 @@ struct inode *yaffs_get_inode(struct super_block *sb, int mode, int dev,
 	return inode;
 }
 
+static void yaffs_RecordWriteLatency(yaffs_Device *dev, ktime_t start)
+{
+	__u32 usecs = (__u32)ktime_to_us(ktime_sub(ktime_get(), start));
+	int bucket = fls(usecs / 1000);
+
+	if (bucket >= YAFFS_N_WRITE_LATENCY_BUCKETS)
+		bucket = YAFFS_N_WRITE_LATENCY_BUCKETS - 1;
+	dev->writeLatency[bucket]++;
+	if (usecs > dev->maxWriteLatencyUs)
+		dev->maxWriteLatencyUs = usecs;
+}
+
 static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 				loff_t *pos)
 {
@@ -1443,6 +1457,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 	int nWritten, ipos;
 	struct inode *inode;
 	yaffs_Device *dev;
+	ktime_t start = ktime_get();
 
 	obj = yaffs_DentryToObject(f->f_dentry);
 
@@ -1488,6 +1503,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 		}
 
 	}
+	yaffs_RecordWriteLatency(dev, start);
 	yaffs_GrossUnlock(dev);
 	return (nWritten == 0) && (n > 0) ? -ENOSPC : nWritten;
 }
@@ -2235,8 +2251,12 @@ static void yaffs_FlushSuperBlock(struct super_block *sb, int do_checkpoint)
 	yaffs_FlushInodes(sb);
 	yaffs_UpdateDirtyDirectories(dev);
 	yaffs_FlushEntireDeviceCache(dev);
-	if(do_checkpoint)
+	if(do_checkpoint){
+		unsigned long start = jiffies;
+
 		yaffs_CheckpointSave(dev);
+		dev->checkpointSaveMs = jiffies_to_msecs(jiffies - start);
+	}
 }
 
 
@@ -2253,6 +2273,10 @@ static unsigned yaffs_bg_gc_urgency(yaffs_Device *dev)
 		return 0;
 	else if(scatteredFree < (dev->param.nChunksPerBlock * 2))
 		return 0;
+	else if(dev->nErasedBlocks < dev->param.nReservedBlocks +
+			dev->nCheckpointBlocksRequired +
+			2 * YAFFS_GC_THROTTLE_BLOCKS)
+		return 2; /* keep writers out of the throttle zone */
 	else if(erasedChunks > dev->nFreeChunks/2)
 		return 0;
 	else if(erasedChunks > dev->nFreeChunks/4)
@@ -2319,6 +2343,7 @@ static int yaffs_BackgroundThread(void *data)
 	unsigned long now = jiffies;
 	unsigned long next_dir_update = now;
 	unsigned long next_gc = now;
+	unsigned long next_compact = now + 10 * HZ;
 	unsigned long expires;
 	unsigned int urgency;
 
@@ -2368,6 +2393,19 @@ static int yaffs_BackgroundThread(void *data)
 				*/
 				next_gc = next_dir_update;
 		}
+
+		/* Fold the checkpoint log while nothing else is going on.
+		 * Flush first, as sync does, so the new checkpoint only
+		 * describes chunks that are on NAND.
+		 */
+		if(time_after(now, next_compact) && yaffs_bg_enable){
+			if(dev->param.isYaffs2 && yaffs_bg_gc_urgency(dev) == 0 &&
+			   yaffs2_CheckpointCompactDue(dev)){
+				yaffs_FlushSuperBlock(context->superBlock, 0);
+				yaffs2_CheckpointCompact(dev);
+			}
+			next_compact = now + 10 * HZ;
+		}
 		yaffs_GrossUnlock(dev);
 #if 1
 		expires = next_dir_update;
@@ -2547,6 +2585,13 @@ struct semaphore yaffs_context_lock;
 static void yaffs_put_super(struct super_block *sb)
 {
 	yaffs_Device *dev = yaffs_SuperToDevice(sb);
+	unsigned long start_jiffies = jiffies;
+	char devname_buf[BDEVNAME_SIZE + 1];
+	unsigned saveMs;
+	unsigned objects;
+	unsigned bases;
+	unsigned deltas;
+	const char *kind;
 
 	T(YAFFS_TRACE_OS, (TSTR("yaffs_put_super\n")));
 
@@ -2558,7 +2603,19 @@ static void yaffs_put_super(struct super_block *sb)
 
 	yaffs_GrossLock(dev);
 
+	bases = dev->nCheckpointBases;
+	deltas = dev->nCheckpointDeltas;
 	yaffs_FlushSuperBlock(sb,1);
+	saveMs = dev->checkpointSaveMs;
+	objects = dev->checkpointObjectsWritten;
+	if (dev->nCheckpointBases != bases)
+		kind = "full";
+	else if (dev->nCheckpointDeltas != deltas)
+		kind = "delta";
+	else {
+		kind = "none";
+		objects = 0;
+	}
 
 	if (yaffs_DeviceToLC(dev)->putSuperFunc)
 		yaffs_DeviceToLC(dev)->putSuperFunc(sb);
@@ -2568,6 +2625,13 @@ static void yaffs_put_super(struct super_block *sb)
 
 	yaffs_GrossUnlock(dev);
 
+	printk(KERN_INFO
+		"yaffs: %s unmounted in %u ms, checkpoint %s in %u ms, "
+		"%u objects\n",
+		yaffs_devname(sb, devname_buf),
+		jiffies_to_msecs(jiffies - start_jiffies),
+		kind, saveMs, objects);
+
 	down(&yaffs_context_lock);
 	ylist_del_init(&(yaffs_DeviceToLC(dev)->contextList));
 	up(&yaffs_context_lock);
@@ -2612,6 +2676,12 @@ typedef struct {
 	int lazy_loading_overridden;
 	int empty_lost_and_found;
 	int empty_lost_and_found_overridden;
+	int summary_on;
+	int summary_overridden;
+	int n_caches;
+	int n_caches_overridden;
+	int read_ahead;
+	int read_ahead_overridden;
 } yaffs_options;
 
 #define MAX_OPT_LEN 30
@@ -2658,6 +2728,18 @@ static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 		} else if (!strcmp(cur_opt, "empty-lost-and-found-on")){
 			options->empty_lost_and_found = 1;
 			options->empty_lost_and_found_overridden=1;
+		} else if (!strcmp(cur_opt, "summary-off")){
+			options->summary_on = 0;
+			options->summary_overridden = 1;
+		} else if (!strcmp(cur_opt, "summary-on")){
+			options->summary_on = 1;
+			options->summary_overridden = 1;
+		} else if (!strncmp(cur_opt, "cache=", 6)) {
+			options->n_caches = simple_strtoul(cur_opt + 6, NULL, 0);
+			options->n_caches_overridden = 1;
+		} else if (!strncmp(cur_opt, "readahead=", 10)) {
+			options->read_ahead = simple_strtoul(cur_opt + 10, NULL, 0);
+			options->read_ahead_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache"))
 			options->no_cache = 1;
 		else if (!strcmp(cur_opt, "no-checkpoint-read"))
@@ -2698,6 +2780,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 
 	unsigned mount_id;
 	int found;
+	unsigned long start_jiffies;
 	struct yaffs_LinuxContext *context_iterator;
 	struct ylist_head *l;
 
@@ -2917,6 +3000,11 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	param->totalBytesPerChunk = YAFFS_BYTES_PER_CHUNK;
 	param->nReservedBlocks = 5;
 	param->nShortOpCaches = (options.no_cache) ? 0 : 10;
+	if (options.n_caches_overridden && !options.no_cache)
+		param->nShortOpCaches = options.n_caches;
+	param->nReadAheadChunks = 4;
+	if (options.read_ahead_overridden)
+		param->nReadAheadChunks = options.read_ahead;
 	param->inbandTags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
@@ -2957,6 +3045,12 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	if(options.empty_lost_and_found_overridden)
 		param->emptyLostAndFound = options.empty_lost_and_found;
 
+#ifdef CONFIG_YAFFS_SUMMARY
+	param->enableSummary = 1;
+#endif
+	if(options.summary_overridden)
+		param->enableSummary = options.summary_on;
+
 	/* ... and the functions. */
 	if (yaffsVersion == 2) {
 		param->writeChunkWithTagsToNAND =
@@ -3040,11 +3134,21 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 
 	yaffs_GrossLock(dev);
 
+	start_jiffies = jiffies;
 	err = yaffs_GutsInitialise(dev);
+	dev->mountTimeMs = jiffies_to_msecs(jiffies - start_jiffies);
 
 	T(YAFFS_TRACE_OS,
 	  (TSTR("yaffs_read_super: guts initialised %s\n"),
 	   (err == YAFFS_OK) ? "OK" : "FAILED"));
+
+	if (err == YAFFS_OK)
+		printk(KERN_INFO
+			"yaffs: %s mounted in %u ms from %s, "
+			"%u page reads, %u summary blocks\n",
+			yaffs_devname(sb, devname_buf), dev->mountTimeMs,
+			dev->isCheckpointed ? "checkpoint" : "scan",
+			dev->scanPageReads, dev->scanSummaryBlocks);
 	   
 	if(err == YAFFS_OK)
 		yaffs_BackgroundStart(dev);
@@ -3198,8 +3302,10 @@ static char *yaffs_dump_dev_part0(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "disableLazyLoad.... %d\n", dev->param.disableLazyLoad);
 	buf += sprintf(buf, "refreshPeriod...... %d\n", dev->param.refreshPeriod);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->param.nShortOpCaches);
+	buf += sprintf(buf, "nReadAheadChunks... %d\n", dev->param.nReadAheadChunks);
 	buf += sprintf(buf, "nReservedBlocks.... %d\n", dev->param.nReservedBlocks);
 	buf += sprintf(buf, "alwaysCheckErased.. %d\n", dev->param.alwaysCheckErased);
+	buf += sprintf(buf, "enableSummary...... %d\n", dev->param.enableSummary);
 
 	buf += sprintf(buf, "\n");
 
@@ -3209,11 +3315,23 @@ static char *yaffs_dump_dev_part0(char *buf, yaffs_Device * dev)
 
 static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 {
+	int i;
+
 	buf += sprintf(buf, "nDataBytesPerChunk. %d\n", dev->nDataBytesPerChunk);
 	buf += sprintf(buf, "chunkGroupBits..... %d\n", dev->chunkGroupBits);
 	buf += sprintf(buf, "chunkGroupSize..... %d\n", dev->chunkGroupSize);
 	buf += sprintf(buf, "nErasedBlocks...... %d\n", dev->nErasedBlocks);
 	buf += sprintf(buf, "blocksInCheckpoint. %d\n", dev->blocksInCheckpoint);
+	buf += sprintf(buf, "nSummaryChunks..... %d\n", dev->nSummaryChunks);
+	buf += sprintf(buf, "mountTimeMs........ %u\n", dev->mountTimeMs);
+	buf += sprintf(buf, "scanPageReads...... %u\n", dev->scanPageReads);
+	buf += sprintf(buf, "scanSummaryBlocks.. %u\n", dev->scanSummaryBlocks);
+	buf += sprintf(buf, "checkpointLogValid. %d\n", dev->checkpointLogValid);
+	buf += sprintf(buf, "nCheckpointBases... %u\n", dev->nCheckpointBases);
+	buf += sprintf(buf, "nCheckpointDeltas.. %u\n", dev->nCheckpointDeltas);
+	buf += sprintf(buf, "nCheckpointCompact. %u\n", dev->nCheckpointCompactions);
+	buf += sprintf(buf, "checkpointObjWrites %u\n", dev->checkpointObjectsWritten);
+	buf += sprintf(buf, "checkpointSaveMs... %u\n", dev->checkpointSaveMs);
 	buf += sprintf(buf, "\n");
 	buf += sprintf(buf, "nTnodes............ %d\n", dev->nTnodes);
 	buf += sprintf(buf, "nObjects........... %d\n", dev->nObjects);
@@ -3228,6 +3346,13 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "oldestDirtyGCs..... %u\n", dev->oldestDirtyGCs);
 	buf += sprintf(buf, "nGCBlocks.......... %u\n", dev->nGCBlocks);
 	buf += sprintf(buf, "backgroundGCs...... %u\n", dev->backgroundGCs);
+	buf += sprintf(buf, "costBenefitGCs..... %u\n", dev->costBenefitGCs);
+	buf += sprintf(buf, "throttledGCs....... %u\n", dev->throttledGCs);
+	buf += sprintf(buf, "maxWriteLatencyUs.. %u\n", dev->maxWriteLatencyUs);
+	buf += sprintf(buf, "writeLatencyMs.....");
+	for (i = 0; i < YAFFS_N_WRITE_LATENCY_BUCKETS - 1; i++)
+		buf += sprintf(buf, " <%d:%u", 1 << i, dev->writeLatency[i]);
+	buf += sprintf(buf, " >=%d:%u\n", 1 << (i - 1), dev->writeLatency[i]);
 	buf += sprintf(buf, "nRetriedWrites..... %u\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nRetireBlocks...... %u\n", dev->nRetiredBlocks);
 	buf += sprintf(buf, "eccFixed........... %u\n", dev->eccFixed);
@@ -3235,6 +3360,9 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %u\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %u\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %u\n", dev->cacheHits);
+	buf += sprintf(buf, "cacheMisses........ %u\n", dev->cacheMisses);
+	buf += sprintf(buf, "readAheadChunks.... %u\n", dev->readAheadChunks);
+	buf += sprintf(buf, "readAheadHits...... %u\n", dev->readAheadHits);
 	buf += sprintf(buf, "nDeletedFiles...... %u\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %u\n", dev->nUnlinkedFiles);
 	buf += sprintf(buf, "refreshCount....... %u\n", dev->refreshCount);
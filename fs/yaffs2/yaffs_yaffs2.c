@@ -21,6 +21,7 @@
 #include "yaffs_nand.h"
 #include "yaffs_getblockinfo.h"
 #include "yaffs_verify.h"
+#include "yaffs_summary.h"
 
 /*
  * Checkpoints are really no benefit on very small partitions.
@@ -32,6 +33,18 @@
 
 #define YAFFS_SMALL_HOLE_THRESHOLD 4
 
+/*
+ * The checkpoint is a log of segments. The first is a full checkpoint and
+ * each later one is either a delta (the block info plus the objects that
+ * changed and the ones that went away since the previous segment) or a
+ * stale marker, appended when the file system is first written after a
+ * checkpoint. The log is only usable if it ends with a data segment.
+ * The validity marker heading a segment says which kind it is.
+ */
+#define YAFFS_CHECKPOINT_SEG_TAIL	0
+#define YAFFS_CHECKPOINT_SEG_HEAD	1
+#define YAFFS_CHECKPOINT_SEG_STALE	2
+
 
 /*
  * Oldest Dirty Sequence Number handling.
@@ -259,7 +272,7 @@ static int yaffs2_WriteCheckpointValidityMarker(yaffs_Device *dev, int head)
 	cp.structType = sizeof(cp);
 	cp.magic = YAFFS_MAGIC;
 	cp.version = YAFFS_CHECKPOINT_VERSION;
-	cp.head = (head) ? 1 : 0;
+	cp.head = head;
 
 	return (yaffs2_CheckpointWrite(dev, &cp, sizeof(cp)) == sizeof(cp)) ?
 		1 : 0;
@@ -276,10 +289,30 @@ static int yaffs2_ReadCheckpointValidityMarker(yaffs_Device *dev, int head)
 		ok = (cp.structType == sizeof(cp)) &&
 		     (cp.magic == YAFFS_MAGIC) &&
 		     (cp.version == YAFFS_CHECKPOINT_VERSION) &&
-		     (cp.head == ((head) ? 1 : 0));
+		     (cp.head == head);
 	return ok ? 1 : 0;
 }
 
+/* Returns the kind of segment that follows, or -1 if there is none */
+static int yaffs2_ReadCheckpointSegmentHead(yaffs_Device *dev)
+{
+	yaffs_CheckpointValidity cp;
+
+	if (yaffs2_CheckpointRead(dev, &cp, sizeof(cp)) != sizeof(cp))
+		return -1;
+
+	if (cp.structType != sizeof(cp) ||
+	    cp.magic != YAFFS_MAGIC ||
+	    cp.version != YAFFS_CHECKPOINT_VERSION)
+		return -1;
+
+	if (cp.head != YAFFS_CHECKPOINT_SEG_HEAD &&
+	    cp.head != YAFFS_CHECKPOINT_SEG_STALE)
+		return -1;
+
+	return cp.head;
+}
+
 static void yaffs2_DeviceToCheckpointDevice(yaffs_CheckpointDevice *cp,
 					   yaffs_Device *dev)
 {
@@ -540,7 +573,36 @@ static int yaffs2_ReadCheckpointTnodes(yaffs_Object *obj)
 }
 
 
-static int yaffs2_WriteCheckpointObjects(yaffs_Device *dev)
+static int yaffs2_WriteCheckpointObject(yaffs_Device *dev, yaffs_Object *obj)
+{
+	yaffs_CheckpointObject cp;
+	int ok;
+
+	yaffs2_ObjectToCheckpointObject(&cp, obj);
+	cp.structType = sizeof(cp);
+
+	T(YAFFS_TRACE_CHECKPOINT, (
+		TSTR("Checkpoint write object %d parent %d type %d chunk %d obj addr %p" TENDSTR),
+		cp.objectId, cp.parentId, cp.variantType, cp.hdrChunk, obj));
+
+	ok = (yaffs2_CheckpointWrite(dev, &cp, sizeof(cp)) == sizeof(cp));
+
+	if (ok && obj->variantType == YAFFS_OBJECT_TYPE_FILE)
+		ok = yaffs2_WriteCheckpointTnodes(obj);
+
+	if (ok) {
+		obj->inCheckpoint = 1;
+		dev->checkpointObjectsWritten++;
+	}
+
+	return ok;
+}
+
+/*
+ * A full checkpoint dumps every object, a delta only those on the
+ * checkpointDirty list, ie. changed since the last segment.
+ */
+static int yaffs2_WriteCheckpointObjects(yaffs_Device *dev, int delta)
 {
 	yaffs_Object *obj;
 	yaffs_CheckpointObject cp;
@@ -548,28 +610,28 @@ static int yaffs2_WriteCheckpointObjects(yaffs_Device *dev)
 	int ok = 1;
 	struct ylist_head *lh;
 
+	if (delta) {
+		ylist_for_each(lh, &dev->checkpointDirty) {
+			obj = ylist_entry(lh, yaffs_Object, checkpointLink);
+			if (!obj->deferedFree)
+				ok = yaffs2_WriteCheckpointObject(dev, obj);
+			if (!ok)
+				break;
+		}
+	}
 
 	/* Iterate through the objects in each hash entry,
 	 * dumping them to the checkpointing stream.
 	 */
 
-	for (i = 0; ok &&  i <  YAFFS_NOBJECT_BUCKETS; i++) {
+	for (i = 0; !delta && ok && i < YAFFS_NOBJECT_BUCKETS; i++) {
 		ylist_for_each(lh, &dev->objectBucket[i].list) {
 			if (lh) {
 				obj = ylist_entry(lh, yaffs_Object, hashLink);
-				if (!obj->deferedFree) {
-					yaffs2_ObjectToCheckpointObject(&cp, obj);
-					cp.structType = sizeof(cp);
-
-					T(YAFFS_TRACE_CHECKPOINT, (
-						TSTR("Checkpoint write object %d parent %d type %d chunk %d obj addr %p" TENDSTR),
-						cp.objectId, cp.parentId, cp.variantType, cp.hdrChunk, obj));
-
-					ok = (yaffs2_CheckpointWrite(dev, &cp, sizeof(cp)) == sizeof(cp));
-
-					if (ok && obj->variantType == YAFFS_OBJECT_TYPE_FILE)
-						ok = yaffs2_WriteCheckpointTnodes(obj);
-				}
+				if (!obj->deferedFree)
+					ok = yaffs2_WriteCheckpointObject(dev, obj);
+				if (!ok)
+					break;
 			}
 		}
 	}
@@ -584,6 +646,27 @@ static int yaffs2_WriteCheckpointObjects(yaffs_Device *dev)
 	return ok ? 1 : 0;
 }
 
+/* Everything in memory is now in the log */
+static void yaffs2_CheckpointClean(yaffs_Device *dev)
+{
+	struct ylist_head *lh;
+	struct ylist_head *n;
+
+	ylist_for_each_safe(lh, n, &dev->checkpointDirty)
+		ylist_del_init(lh);
+}
+
+/*
+ * Called wherever an object changes in a way the checkpoint records: its
+ * header, flags, parent, size or tnodes.
+ */
+void yaffs2_CheckpointObjectDirty(yaffs_Object *obj)
+{
+	if (ylist_empty(&obj->checkpointLink))
+		ylist_add_tail(&obj->checkpointLink,
+				&obj->myDev->checkpointDirty);
+}
+
 static int yaffs2_ReadCheckpointObjects(yaffs_Device *dev)
 {
 	yaffs_Object *obj;
@@ -611,9 +694,13 @@ static int yaffs2_ReadCheckpointObjects(yaffs_Device *dev)
 				ok = yaffs2_CheckpointObjectToObject(obj, &cp);
 				if (!ok)
 					break;
+				obj->inCheckpoint = 1;
 				if (obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
-					ok = yaffs2_ReadCheckpointTnodes(obj);
+					/* A delta replaces what we had */
+					ok = yaffs_ResetFileStructure(obj) &&
+						yaffs2_ReadCheckpointTnodes(obj);
 				} else if (obj->variantType == YAFFS_OBJECT_TYPE_HARDLINK) {
+					ylist_del_init(&obj->hardLinks);
 					obj->hardLinks.next =
 						(struct ylist_head *) hardList;
 					hardList = obj;
@@ -629,6 +716,85 @@ static int yaffs2_ReadCheckpointObjects(yaffs_Device *dev)
 	return ok ? 1 : 0;
 }
 
+/*
+ * Called when an object is removed from NAND, whether or not it is freed
+ * yet. If it is in the checkpoint log, the next delta has to say it is gone.
+ */
+void yaffs2_CheckpointObjectGone(yaffs_Object *obj)
+{
+	yaffs_Device *dev = obj->myDev;
+	__u32 *list;
+	int n;
+
+	ylist_del_init(&obj->checkpointLink);
+
+	if (!obj->inCheckpoint)
+		return;
+	obj->inCheckpoint = 0;
+
+	if (!dev->checkpointLogValid || dev->checkpointForceBase)
+		return;
+
+	if (dev->nCheckpointDead >= dev->maxCheckpointDead) {
+		n = dev->maxCheckpointDead ? dev->maxCheckpointDead * 2 : 64;
+		list = YMALLOC(n * sizeof(__u32));
+		if (!list) {
+			/* Can't keep track, the next checkpoint is a full one */
+			dev->checkpointForceBase = 1;
+			return;
+		}
+		if (dev->checkpointDeadList) {
+			memcpy(list, dev->checkpointDeadList,
+				dev->nCheckpointDead * sizeof(__u32));
+			YFREE(dev->checkpointDeadList);
+		}
+		dev->checkpointDeadList = list;
+		dev->maxCheckpointDead = n;
+	}
+
+	dev->checkpointDeadList[dev->nCheckpointDead++] = obj->objectId;
+}
+
+static int yaffs2_WriteCheckpointDead(yaffs_Device *dev)
+{
+	__u32 n = dev->nCheckpointDead;
+	int ok;
+
+	ok = (yaffs2_CheckpointWrite(dev, &n, sizeof(n)) == sizeof(n));
+
+	if (ok && n > 0)
+		ok = (yaffs2_CheckpointWrite(dev, dev->checkpointDeadList,
+				n * sizeof(__u32)) == n * sizeof(__u32));
+
+	return ok ? 1 : 0;
+}
+
+static int yaffs2_ReadCheckpointDead(yaffs_Device *dev)
+{
+	__u32 n;
+	__u32 objectId;
+	yaffs_Object *obj;
+	int ok;
+
+	ok = (yaffs2_CheckpointRead(dev, &n, sizeof(n)) == sizeof(n));
+
+	while (ok && n-- > 0) {
+		ok = (yaffs2_CheckpointRead(dev, &objectId, sizeof(objectId)) ==
+			sizeof(objectId));
+		if (!ok)
+			break;
+
+		obj = yaffs_FindObjectByNumber(dev, objectId);
+		T(YAFFS_TRACE_CHECKPOINT,
+			(TSTR("Checkpoint read dead object %d %s" TENDSTR),
+			objectId, obj ? "dropped" : "not found"));
+		if (obj)
+			yaffs_ForgetObject(obj);
+	}
+
+	return ok ? 1 : 0;
+}
+
 static int yaffs2_WriteCheckpointSum(yaffs_Device *dev)
 {
 	__u32 checkpointSum;
@@ -678,19 +844,26 @@ static int yaffs2_WriteCheckpointData(yaffs_Device *dev)
 
 	if (ok) {
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("write checkpoint validity" TENDSTR)));
-		ok = yaffs2_WriteCheckpointValidityMarker(dev, 1);
+		ok = yaffs2_WriteCheckpointValidityMarker(dev,
+					YAFFS_CHECKPOINT_SEG_HEAD);
 	}
 	if (ok) {
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("write checkpoint device" TENDSTR)));
 		ok = yaffs2_WriteCheckpointDevice(dev);
 	}
+	if (ok) {
+		dev->nCheckpointDead = 0;
+		ok = yaffs2_WriteCheckpointDead(dev);
+	}
 	if (ok) {
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("write checkpoint objects" TENDSTR)));
-		ok = yaffs2_WriteCheckpointObjects(dev);
+		dev->checkpointObjectsWritten = 0;
+		ok = yaffs2_WriteCheckpointObjects(dev, 0);
 	}
 	if (ok) {
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("write checkpoint validity" TENDSTR)));
-		ok = yaffs2_WriteCheckpointValidityMarker(dev, 0);
+		ok = yaffs2_WriteCheckpointValidityMarker(dev,
+					YAFFS_CHECKPOINT_SEG_TAIL);
 	}
 
 	if (ok)
@@ -699,18 +872,134 @@ static int yaffs2_WriteCheckpointData(yaffs_Device *dev)
 	if (!yaffs2_CheckpointClose(dev))
 		ok = 0;
 
+	if (ok) {
+		yaffs2_CheckpointClean(dev);
+		dev->isCheckpointed = 1;
+		dev->checkpointLogValid = 1;
+		dev->checkpointForceBase = 0;
+		dev->nCheckpointBases++;
+	} else {
+		dev->isCheckpointed = 0;
+		dev->checkpointLogValid = 0;
+	}
+
+	return dev->isCheckpointed;
+}
+
+/* Append the objects that changed since the last segment to the log */
+static int yaffs2_WriteCheckpointDelta(yaffs_Device *dev)
+{
+	int ok = 1;
+
+	if (dev->checkpointForceBase) {
+		dev->isCheckpointed = 0;
+		dev->checkpointLogValid = 0;
+		return 0;
+	}
+
+	ok = yaffs2_CheckpointOpenAppend(dev);
+
+	if (ok) {
+		T(YAFFS_TRACE_CHECKPOINT, (TSTR("write checkpoint delta" TENDSTR)));
+		ok = yaffs2_WriteCheckpointValidityMarker(dev,
+					YAFFS_CHECKPOINT_SEG_HEAD);
+	}
 	if (ok)
+		ok = yaffs2_WriteCheckpointDevice(dev);
+	if (ok)
+		ok = yaffs2_WriteCheckpointDead(dev);
+	if (ok) {
+		dev->checkpointObjectsWritten = 0;
+		ok = yaffs2_WriteCheckpointObjects(dev, 1);
+	}
+	if (ok)
+		ok = yaffs2_WriteCheckpointValidityMarker(dev,
+					YAFFS_CHECKPOINT_SEG_TAIL);
+	if (ok)
+		ok = yaffs2_WriteCheckpointSum(dev);
+
+	if (!yaffs2_CheckpointClose(dev))
+		ok = 0;
+
+	T(YAFFS_TRACE_CHECKPOINT,
+		(TSTR("checkpoint delta %d objects %d dead, ok %d" TENDSTR),
+		dev->checkpointObjectsWritten, dev->nCheckpointDead, ok));
+
+	if (ok) {
+		yaffs2_CheckpointClean(dev);
 		dev->isCheckpointed = 1;
-	else
+		dev->nCheckpointDead = 0;
+		dev->nCheckpointDeltas++;
+	} else {
+		/* The log now ends in a mess, start again from scratch */
 		dev->isCheckpointed = 0;
+		dev->checkpointLogValid = 0;
+	}
 
 	return dev->isCheckpointed;
 }
 
+/* Mark the log as out of date without erasing it */
+static int yaffs2_WriteCheckpointStale(yaffs_Device *dev)
+{
+	int ok;
+
+	ok = yaffs2_CheckpointOpenAppend(dev);
+
+	if (ok)
+		ok = yaffs2_WriteCheckpointValidityMarker(dev,
+					YAFFS_CHECKPOINT_SEG_STALE);
+	if (ok)
+		ok = yaffs2_WriteCheckpointSum(dev);
+
+	if (!yaffs2_CheckpointClose(dev))
+		ok = 0;
+
+	T(YAFFS_TRACE_CHECKPOINT,
+		(TSTR("checkpoint marked stale, ok %d" TENDSTR), ok));
+
+	return ok;
+}
+
+/*
+ * The log is worth compacting once it is bigger than a full checkpoint
+ * would be, and it must stay well within what a read will follow.
+ */
+static int yaffs2_CheckpointLogFull(yaffs_Device *dev)
+{
+	int limit;
+
+	if (dev->checkpointForceBase)
+		return 1;
+
+	yaffs2_CalcCheckpointBlocksRequired(dev);
+
+	limit = (dev->internalEndBlock - dev->internalStartBlock) / 32;
+	if (limit > dev->nCheckpointBlocksRequired * 2)
+		limit = dev->nCheckpointBlocksRequired * 2;
+
+	return dev->blocksInCheckpoint >= limit;
+}
+
+/* Keep the log unless we are running out of space */
+static int yaffs2_CheckpointLogKeep(yaffs_Device *dev)
+{
+	return dev->checkpointLogValid &&
+		dev->nErasedBlocks > dev->param.nReservedBlocks + 1;
+}
+
 static int yaffs2_ReadCheckpointData(yaffs_Device *dev)
 {
 	int ok = 1;
-	
+	int head;
+	int end;
+	int stale = 0;
+	int nSegments = 0;
+	int segmentStart = 0;
+	int nextStart = 0;
+
+	dev->checkpointLogValid = 0;
+
 	if(!dev->param.isYaffs2)
 		ok = 0;
 
@@ -722,34 +1011,78 @@ static int yaffs2_ReadCheckpointData(yaffs_Device *dev)
 	if (ok)
 		ok = yaffs2_CheckpointOpen(dev, 0); /* open for read */
 
-	if (ok) {
-		T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint validity" TENDSTR)));
-		ok = yaffs2_ReadCheckpointValidityMarker(dev, 1);
-	}
-	if (ok) {
-		T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint device" TENDSTR)));
-		ok = yaffs2_ReadCheckpointDevice(dev);
-	}
-	if (ok) {
-		T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint objects" TENDSTR)));
-		ok = yaffs2_ReadCheckpointObjects(dev);
-	}
-	if (ok) {
+	/* Replay the log, one segment at a time */
+	while (ok) {
+		yaffs2_CheckpointStartSegment(dev);
+
 		T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint validity" TENDSTR)));
-		ok = yaffs2_ReadCheckpointValidityMarker(dev, 0);
+		head = yaffs2_ReadCheckpointSegmentHead(dev);
+
+		if (head == YAFFS_CHECKPOINT_SEG_STALE) {
+			stale = 1;
+		} else if (head == YAFFS_CHECKPOINT_SEG_HEAD) {
+			/* Blocks from here on are not in this segment's
+			 * free space figures yet.
+			 */
+			segmentStart = nextStart;
+			stale = 0;
+			nSegments++;
+
+			T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint device" TENDSTR)));
+			ok = yaffs2_ReadCheckpointDevice(dev);
+			if (ok)
+				ok = yaffs2_ReadCheckpointDead(dev);
+			if (ok) {
+				T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint objects" TENDSTR)));
+				ok = yaffs2_ReadCheckpointObjects(dev);
+			}
+			if (ok) {
+				T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint validity" TENDSTR)));
+				ok = yaffs2_ReadCheckpointValidityMarker(dev,
+						YAFFS_CHECKPOINT_SEG_TAIL);
+			}
+		} else
+			ok = 0;
+
+		if (ok) {
+			ok = yaffs2_ReadCheckpointSum(dev);
+			T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint checksum %d" TENDSTR), ok));
+		}
+
+		if (!ok)
+			break;
+
+		/* Is there more? */
+		yaffs2_CheckpointMarkAppend(dev);
+		nextStart = dev->checkpointStreamBlocks;
+		end = yaffs2_CheckpointAtEnd(dev, !stale);
+		if (end) {
+			ok = (end > 0);
+			break;
+		}
 	}
 
-	if (ok) {
-		ok = yaffs2_ReadCheckpointSum(dev);
-		T(YAFFS_TRACE_CHECKPOINT, (TSTR("read checkpoint checksum %d" TENDSTR), ok));
+	if (ok && (stale || !nSegments)) {
+		T(YAFFS_TRACE_CHECKPOINT, (TSTR("checkpoint log is stale" TENDSTR)));
+		ok = 0;
 	}
 
+	dev->checkpointStreamBlocks -= segmentStart;
+
 	if (!yaffs2_CheckpointClose(dev))
 		ok = 0;
 
-	if (ok)
+	if (ok) {
+		/* What we have now is what the log holds */
+		yaffs2_CheckpointClean(dev);
+		dev->nCheckpointDead = 0;
+		dev->checkpointForceBase = 0;
+		dev->checkpointLogValid = 1;
 		dev->isCheckpointed = 1;
-	else
+		T(YAFFS_TRACE_CHECKPOINT,
+			(TSTR("checkpoint log of %d segments in %d blocks" TENDSTR),
+			nSegments, dev->blocksInCheckpoint));
+	} else
 		dev->isCheckpointed = 0;
 
 	return ok ? 1 : 0;
@@ -758,9 +1091,14 @@ static int yaffs2_ReadCheckpointData(yaffs_Device *dev)
 
 void yaffs2_InvalidateCheckpoint(yaffs_Device *dev)
 {
-	if (dev->isCheckpointed ||
+	if (yaffs2_CheckpointLogKeep(dev) &&
+	    (!dev->isCheckpointed || yaffs2_WriteCheckpointStale(dev))) {
+		/* The log stays, the next checkpoint just adds to it */
+		dev->isCheckpointed = 0;
+	} else if (dev->isCheckpointed ||
 			dev->blocksInCheckpoint > 0) {
 		dev->isCheckpointed = 0;
+		dev->checkpointLogValid = 0;
 		yaffs2_CheckpointInvalidateStream(dev);
 	}
 	if (dev->param.markSuperBlockDirty)
@@ -777,7 +1115,14 @@ int yaffs_CheckpointSave(yaffs_Device *dev)
 	yaffs_VerifyBlocks(dev);
 	yaffs_VerifyFreeChunks(dev);
 
+	if (!dev->isCheckpointed &&
+	    dev->checkpointLogValid &&
+	    yaffs2_CheckpointRequired(dev) &&
+	    !yaffs2_CheckpointLogFull(dev))
+		yaffs2_WriteCheckpointDelta(dev);
+
 	if (!dev->isCheckpointed) {
+		dev->checkpointLogValid = 0;
 		yaffs2_InvalidateCheckpoint(dev);
 		yaffs2_WriteCheckpointData(dev);
 	}
@@ -787,6 +1132,41 @@ int yaffs_CheckpointSave(yaffs_Device *dev)
 	return dev->isCheckpointed;
 }
 
+/*
+ * Called from the background. Once the deltas add up to more than a full
+ * checkpoint, replace the log with a full checkpoint so that unmount only
+ * has a small delta to write and mount has a short log to replay.
+ */
+int yaffs2_CheckpointCompactDue(yaffs_Device *dev)
+{
+	return dev->checkpointLogValid &&
+		yaffs2_CheckpointRequired(dev) &&
+		yaffs2_CheckpointLogFull(dev);
+}
+
+/*
+ * The caller must have flushed the cache and the dirty directories first,
+ * as for any other checkpoint, or the checkpoint would describe chunks
+ * that are not on NAND yet.
+ */
+int yaffs2_CheckpointCompact(yaffs_Device *dev)
+{
+	if (!yaffs2_CheckpointCompactDue(dev))
+		return 0;
+
+	T(YAFFS_TRACE_CHECKPOINT,
+		(TSTR("compacting checkpoint log of %d blocks" TENDSTR),
+		dev->blocksInCheckpoint));
+
+	dev->nCheckpointCompactions++;
+	dev->checkpointLogValid = 0;
+	dev->isCheckpointed = 0;
+	yaffs2_InvalidateCheckpoint(dev);
+	yaffs2_WriteCheckpointData(dev);
+
+	return 1;
+}
+
 int yaffs2_CheckpointRestore(yaffs_Device *dev)
 {
 	int retval;
@@ -938,6 +1318,7 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 	int foundChunksInBlock;
 	int equivalentObjectId;
 	int alloc_failed = 0;
+	int summaryOk;
 
 
 	yaffs_BlockIndex *blockIndex = NULL;
@@ -950,6 +1331,7 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 
 
 	dev->sequenceNumber = YAFFS_LOWEST_SEQUENCE_NUMBER;
+	dev->scanSummaryBlocks = 0;
 
 	blockIndex = YMALLOC(nBlocks * sizeof(yaffs_BlockIndex));
 
@@ -1063,6 +1445,12 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		/* A block with a good summary only costs us one read */
+		summaryOk = (state == YAFFS_BLOCK_STATE_NEEDS_SCANNING &&
+			yaffs_SummaryRead(dev, blk) == YAFFS_OK);
+		if (summaryOk)
+			dev->scanSummaryBlocks++;
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->param.nChunksPerBlock - 1;
@@ -1075,8 +1463,12 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->param.nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			if (summaryOk) {
+				yaffs_SummaryFetch(dev, &tags, c);
+				result = YAFFS_OK;
+			} else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev,
+							chunk, NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -1142,6 +1534,12 @@ int yaffs2_ScanBackwards(yaffs_Device *dev)
 
 				  dev->nFreeChunks++;
 
+			} else if (tags.objectId == YAFFS_OBJECTID_SUMMARY) {
+				/* Block summary, never allocated so treat it
+				 * like a skipped chunk.
+				 */
+				dev->nFreeChunks++;
+
 			} else if (tags.chunkId > 0) {
 				/* chunkId > 0 so it is a data chunk... */
 				unsigned int endpos;
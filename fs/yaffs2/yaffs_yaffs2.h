@@ -27,6 +27,10 @@ int yaffs2_CalcCheckpointBlocksRequired(yaffs_Device *dev);
 
 
 void yaffs2_InvalidateCheckpoint(yaffs_Device *dev);
+void yaffs2_CheckpointObjectGone(yaffs_Object *obj);
+void yaffs2_CheckpointObjectDirty(yaffs_Object *obj);
+int yaffs2_CheckpointCompactDue(yaffs_Device *dev);
+int yaffs2_CheckpointCompact(yaffs_Device *dev);
 int yaffs2_CheckpointSave(yaffs_Device *dev);
 int yaffs2_CheckpointRestore(yaffs_Device *dev);
 
@@ -33,7 +33,23 @@
  * struct (with offset set to 0). 
  */
 #define PMEM_GET_TOTAL_SIZE	_IOW(PMEM_IOCTL_MAGIC, 7, unsigned int)
+/* Cache maintenance on part of a cached mapping, pass a pmem_region with
+ * the offset and len (0 for the whole allocation) relative to the start of
+ * the file's allocation. FLUSH writes back and invalidates, CLEAN only
+ * writes back (before handing the buffer to a device), INVALIDATE only
+ * discards (before reading what a device wrote). All of them cover the
+ * outer (L2) cache too, and do nothing on uncached mappings.
+ */
 #define PMEM_CACHE_FLUSH	_IOW(PMEM_IOCTL_MAGIC, 8, unsigned int)
+#define PMEM_CACHE_INVALIDATE	_IOW(PMEM_IOCTL_MAGIC, 9, unsigned int)
+#define PMEM_CACHE_CLEAN	_IOW(PMEM_IOCTL_MAGIC, 10, unsigned int)
+
+/* allocator_type values. The buddy allocator rounds every allocation up to
+ * a power of two pages; the bitmap allocator hands out exact page counts
+ * from the best fitting free run and can compact unmapped allocations.
+ */
+#define PMEM_ALLOCATORTYPE_BUDDY	0
+#define PMEM_ALLOCATORTYPE_BITMAP	1
 
 struct android_pmem_platform_data
 {
@@ -50,6 +66,8 @@ struct android_pmem_platform_data
 	unsigned cached;
 	/* The MSM7k has bits to enable a write buffer in the bus controller*/
 	unsigned buffered;
+	/* one of PMEM_ALLOCATORTYPE_*, ignored with no_allocator */
+	unsigned allocator_type;
 };
 
 struct pmem_region {
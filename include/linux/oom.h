@@ -14,6 +14,7 @@
 
 struct zonelist;
 struct notifier_block;
+struct signal_struct;
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -43,5 +44,20 @@ static inline void oom_killer_enable(void)
 {
 	oom_killer_disabled = false;
 }
+
+/*
+ * Keep the Android lowmemorykiller's per-oom_adj process index in sync.
+ * Called with tasklist_lock write-held (fork) or ->siglock held (exit,
+ * oom_adj writes).
+ */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_index_add(struct signal_struct *sig);
+extern void lowmem_index_del(struct signal_struct *sig);
+extern void lowmem_index_adj(struct signal_struct *sig, int oom_adj);
+#else
+static inline void lowmem_index_add(struct signal_struct *sig) {}
+static inline void lowmem_index_del(struct signal_struct *sig) {}
+static inline void lowmem_index_adj(struct signal_struct *sig, int oom_adj) {}
+#endif
 #endif /* __KERNEL__*/
 #endif /* _INCLUDE_LINUX_OOM_H */
@@ -629,6 +629,9 @@ struct signal_struct {
 #endif
 
 	int oom_adj;	/* OOM kill score adjustment (bit shift) */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct list_head lowmem_node;	/* lowmemorykiller oom_adj bucket */
+#endif
 };
 
 /* Context switch must be unlocked if interrupts are to be enabled */
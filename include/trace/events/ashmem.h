@@ -0,0 +1,43 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ashmem
+
+#if !defined(_TRACE_ASHMEM_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_ASHMEM_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Emitted once per ashmem_shrink() call that purged pages.
+ * runs is the number of vmtruncate_range() calls it took to purge
+ * 'reclaimed' pages.
+ */
+TRACE_EVENT(ashmem_shrink,
+
+	TP_PROTO(int nr_to_scan, unsigned long reclaimed, unsigned int runs,
+		 s64 latency_ns),
+
+	TP_ARGS(nr_to_scan, reclaimed, runs, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(	int,		nr_to_scan	)
+		__field(	unsigned long,	reclaimed	)
+		__field(	unsigned int,	runs		)
+		__field(	s64,		latency_ns	)
+	),
+
+	TP_fast_assign(
+		__entry->nr_to_scan	= nr_to_scan;
+		__entry->reclaimed	= reclaimed;
+		__entry->runs		= runs;
+		__entry->latency_ns	= latency_ns;
+	),
+
+	TP_printk("nr_to_scan=%d reclaimed=%lu runs=%u latency=%lld ns",
+		  __entry->nr_to_scan, __entry->reclaimed, __entry->runs,
+		  (long long)__entry->latency_ns)
+);
+
+#endif /* _TRACE_ASHMEM_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
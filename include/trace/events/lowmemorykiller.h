@@ -0,0 +1,56 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Emitted once per lowmem_shrink() pass that looked for a victim.
+ * pid is 0 when nothing at or above min_adj could be killed; scanned
+ * is the number of processes whose RSS had to be sampled.
+ */
+TRACE_EVENT(lowmem_select,
+
+	TP_PROTO(struct task_struct *p, int min_adj, int oom_adj,
+		 int tasksize, int scanned, s64 latency_ns),
+
+	TP_ARGS(p, min_adj, oom_adj, tasksize, scanned, latency_ns),
+
+	TP_STRUCT__entry(
+		__array(	char,	comm,	TASK_COMM_LEN	)
+		__field(	pid_t,	pid			)
+		__field(	int,	min_adj			)
+		__field(	int,	oom_adj			)
+		__field(	int,	tasksize		)
+		__field(	int,	scanned			)
+		__field(	s64,	latency_ns		)
+	),
+
+	TP_fast_assign(
+		if (p) {
+			memcpy(__entry->comm, p->comm, TASK_COMM_LEN);
+			__entry->pid = p->pid;
+		} else {
+			__entry->comm[0] = '\0';
+			__entry->pid = 0;
+		}
+		__entry->min_adj	= min_adj;
+		__entry->oom_adj	= oom_adj;
+		__entry->tasksize	= tasksize;
+		__entry->scanned	= scanned;
+		__entry->latency_ns	= latency_ns;
+	),
+
+	TP_printk("comm=%s pid=%d min_adj=%d adj=%d size=%d scanned=%d latency=%lld ns",
+		  __entry->comm, __entry->pid, __entry->min_adj,
+		  __entry->oom_adj, __entry->tasksize, __entry->scanned,
+		  (long long)__entry->latency_ns)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
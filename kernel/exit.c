@@ -50,6 +50,7 @@
 #include <linux/perf_event.h>
 #include <trace/events/sched.h>
 #include <linux/hw_breakpoint.h>
+#include <linux/oom.h>
 
 #include <asm/uaccess.h>
 #include <asm/unistd.h>
@@ -91,6 +92,7 @@ static void __exit_signal(struct task_struct *tsk)
 	posix_cpu_timers_exit(tsk);
 	if (group_dead) {
 		posix_cpu_timers_exit_group(tsk);
+		lowmem_index_del(sig);
 		tty = sig->tty;
 		sig->tty = NULL;
 	} else {
@@ -14,10 +14,13 @@
  */
 
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/platform_device.h>
 #include <linux/rtc.h>
+#include <linux/slab.h>
 #include <linux/suspend.h>
 #include <linux/syscalls.h> /* sys_sync */
+#include <linux/vmalloc.h>
 #include <linux/wakelock.h>
 #ifdef CONFIG_WAKELOCK_STAT
 #include <linux/proc_fs.h>
@@ -43,6 +46,9 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+/* Active locks with a timeout, ordered by expiry, and a count of the rest */
+static struct rb_root timeout_locks[WAKE_LOCK_TYPE_COUNT];
+static int no_timeout_count[WAKE_LOCK_TYPE_COUNT];
 static int current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct workqueue_struct *sync_work_queue;
@@ -145,22 +151,24 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 {
 	ktime_t duration;
 	ktime_t now;
+	ktime_t end;
 	if (!(lock->flags & WAKE_LOCK_ACTIVE))
 		return;
-	if (get_expired_time(lock, &now))
+	now = ktime_get();
+	if (get_expired_time(lock, &end))
 		expired = 1;
 	else
-		now = ktime_get();
+		end = now;
 	lock->stat.count++;
 	if (expired)
 		lock->stat.expire_count++;
-	duration = ktime_sub(now, lock->stat.last_time);
+	duration = ktime_sub(end, lock->stat.last_time);
 	lock->stat.total_time = ktime_add(lock->stat.total_time, duration);
 	if (ktime_to_ns(duration) > ktime_to_ns(lock->stat.max_time))
 		lock->stat.max_time = duration;
-	lock->stat.last_time = ktime_get();
+	lock->stat.last_time = now;
 	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-		duration = ktime_sub(now, last_sleep_time_update);
+		duration = ktime_sub(end, last_sleep_time_update);
 		lock->stat.prevent_suspend_time = ktime_add(
 			lock->stat.prevent_suspend_time, duration);
 		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
@@ -194,12 +202,46 @@ static void update_sleep_wait_stats_locked(int done)
 }
 #endif
 
+/* Caller must acquire the list_lock spinlock */
+static void insert_timeout_lock(struct wake_lock *lock, int type)
+{
+	struct rb_node **p = &timeout_locks[type].rb_node;
+	struct rb_node *parent = NULL;
+	struct wake_lock *l;
+
+	while (*p) {
+		parent = *p;
+		l = rb_entry(parent, struct wake_lock, node);
+		if (time_before(lock->expires, l->expires))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&lock->node, parent, p);
+	rb_insert_color(&lock->node, &timeout_locks[type]);
+}
+
+/* Caller must acquire the list_lock spinlock, and then either requeue the
+ * lock or clear WAKE_LOCK_ACTIVE.
+ */
+static void deactivate_wake_lock(struct wake_lock *lock)
+{
+	int type = lock->flags & WAKE_LOCK_TYPE_MASK;
+
+	if (!(lock->flags & WAKE_LOCK_ACTIVE))
+		return;
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		rb_erase(&lock->node, &timeout_locks[type]);
+	else
+		no_timeout_count[type]--;
+}
 
 static void expire_wake_lock(struct wake_lock *lock)
 {
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_unlock_stat_locked(lock, 1);
 #endif
+	deactivate_wake_lock(lock);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -232,21 +274,23 @@ static void print_active_locks(int type)
 
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct wake_lock *lock;
+	struct rb_node *n;
+	unsigned long now = jiffies;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	if (no_timeout_count[type])
+		return -1;
+	while ((n = rb_first(&timeout_locks[type]))) {
+		lock = rb_entry(n, struct wake_lock, node);
+		if ((long)(lock->expires - now) > 0)
+			break;
+		expire_wake_lock(lock);
 	}
-	return max_timeout;
+	n = rb_last(&timeout_locks[type]);
+	if (!n)
+		return 0;
+	return rb_entry(n, struct wake_lock, node)->expires - now;
 }
 
 long has_wake_lock(int type)
@@ -358,6 +402,7 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	lock->flags = (type & WAKE_LOCK_TYPE_MASK) | WAKE_LOCK_INITIALIZED;
 
 	INIT_LIST_HEAD(&lock->link);
+	RB_CLEAR_NODE(&lock->node);
 	spin_lock_irqsave(&list_lock, irqflags);
 	list_add(&lock->link, &inactive_locks);
 	spin_unlock_irqrestore(&list_lock, irqflags);
@@ -370,7 +415,9 @@ void wake_lock_destroy(struct wake_lock *lock)
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
 	spin_lock_irqsave(&list_lock, irqflags);
-	lock->flags &= ~WAKE_LOCK_INITIALIZED;
+	deactivate_wake_lock(lock);
+	lock->flags &= ~(WAKE_LOCK_INITIALIZED | WAKE_LOCK_ACTIVE |
+			 WAKE_LOCK_AUTO_EXPIRE);
 #ifdef CONFIG_WAKELOCK_STAT
 	if (lock->stat.count) {
 		deleted_wake_locks.stat.count += lock->stat.count;
@@ -410,11 +457,10 @@ static void wake_lock_internal(
 		lock->stat.wakeup_count++;
 	}
 	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
-	    (long)(lock->expires - jiffies) <= 0) {
+	    (long)(lock->expires - jiffies) <= 0)
 		wake_unlock_stat_locked(lock, 0);
-		lock->stat.last_time = ktime_get();
-	}
 #endif
+	deactivate_wake_lock(lock);
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
 #ifdef CONFIG_WAKELOCK_STAT
@@ -430,12 +476,14 @@ static void wake_lock_internal(
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
 		list_add_tail(&lock->link, &active_wake_locks[type]);
+		insert_timeout_lock(lock, type);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
 		lock->expires = LONG_MAX;
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
 		list_add(&lock->link, &active_wake_locks[type]);
+		no_timeout_count[type]++;
 	}
 	if (type == WAKE_LOCK_SUSPEND) {
 		current_event_num++;
@@ -489,6 +537,7 @@ void wake_unlock(struct wake_lock *lock)
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
+	deactivate_wake_lock(lock);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -525,6 +574,93 @@ int wake_lock_active(struct wake_lock *lock)
 }
 EXPORT_SYMBOL(wake_lock_active);
 
+#ifdef CONFIG_DEBUG_BENCH
+/* Writing N to the bench parameter holds N timeout wake locks and times
+ * BENCH_LOOPS lock/unlock pairs on one more lock, with and without a
+ * timeout. N must be at least one: a held timeout lock sends every unlock
+ * in the loops to the expire timer instead of queueing suspend_work.
+ * Leave DEBUG_WAKE_LOCK off while it runs.
+ */
+#define BENCH_LOOPS		10000
+#define BENCH_MAX_LOCKS		4096
+#define BENCH_HELD_TIMEOUT	(60 * HZ)
+
+static DEFINE_MUTEX(bench_lock);
+static int bench_held;
+static s64 bench_timeout_ns;
+static s64 bench_no_timeout_ns;
+
+static int bench_set(const char *val, struct kernel_param *kp)
+{
+	struct wake_lock *held = NULL;
+	struct wake_lock lock;
+	unsigned long n;
+	ktime_t start;
+	int i;
+
+	if (!suspend_work_queue)
+		return -EBUSY;
+	if (strict_strtoul(val, 0, &n) || !n || n > BENCH_MAX_LOCKS)
+		return -EINVAL;
+	/* too big to ask kmalloc for in one piece */
+	held = vmalloc(n * sizeof(*held));
+	if (!held)
+		return -ENOMEM;
+	memset(held, 0, n * sizeof(*held));
+
+	mutex_lock(&bench_lock);
+	for (i = 0; i < n; i++) {
+		wake_lock_init(&held[i], WAKE_LOCK_SUSPEND, "bench_held");
+		wake_lock_timeout(&held[i], BENCH_HELD_TIMEOUT + i);
+	}
+	wake_lock_init(&lock, WAKE_LOCK_SUSPEND, "bench");
+
+	start = ktime_get();
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		wake_lock_timeout(&lock, HZ);
+		wake_unlock(&lock);
+	}
+	bench_timeout_ns = div_s64(ktime_to_ns(ktime_sub(ktime_get(), start)),
+				   BENCH_LOOPS);
+
+	start = ktime_get();
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		wake_lock(&lock);
+		wake_unlock(&lock);
+	}
+	bench_no_timeout_ns = div_s64(ktime_to_ns(ktime_sub(ktime_get(),
+							    start)),
+				      BENCH_LOOPS);
+
+	wake_lock_destroy(&lock);
+	for (i = 0; i < n; i++) {
+		wake_unlock(&held[i]);
+		wake_lock_destroy(&held[i]);
+	}
+	bench_held = n;
+	mutex_unlock(&bench_lock);
+	vfree(held);
+
+	pr_info("wakelock bench: %d held, lock_timeout/unlock %lld ns, "
+		"lock/unlock %lld ns\n", bench_held, bench_timeout_ns,
+		bench_no_timeout_ns);
+	return 0;
+}
+
+static int bench_get(char *buffer, struct kernel_param *kp)
+{
+	int ret;
+
+	mutex_lock(&bench_lock);
+	ret = sprintf(buffer, "%d held, lock_timeout/unlock %lld ns, "
+		      "lock/unlock %lld ns", bench_held, bench_timeout_ns,
+		      bench_no_timeout_ns);
+	mutex_unlock(&bench_lock);
+	return ret;
+}
+module_param_call(bench, bench_set, bench_get, NULL, S_IRUGO | S_IWUSR);
+#endif /* CONFIG_DEBUG_BENCH */
+
 static int wakelock_stats_open(struct inode *inode, struct file *file)
 {
 	return single_open(file, wakelock_stats_show, NULL);
@@ -543,8 +679,10 @@ static int __init wakelocks_init(void)
 	int ret;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
+	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++) {
 		INIT_LIST_HEAD(&active_wake_locks[i]);
+		timeout_locks[i] = RB_ROOT;
+	}
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
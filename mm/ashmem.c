@@ -27,9 +27,17 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/ashmem.h>
+
 #define ASHMEM_NAME_PREFIX "dev/ashmem/"
 #define ASHMEM_NAME_PREFIX_LEN (sizeof(ASHMEM_NAME_PREFIX) - 1)
 #define ASHMEM_FULL_NAME_LEN (ASHMEM_NAME_LEN + ASHMEM_NAME_PREFIX_LEN)
@@ -37,12 +45,13 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its own `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
 	char name[ASHMEM_FULL_NAME_LEN];/* optional name for /proc/pid/maps */
-	struct list_head unpinned_list;	/* list of all ashmem areas */
+	struct rb_root unpinned;	/* unpinned ranges, by pgstart */
+	struct mutex mutex;		/* protects everything here */
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
@@ -51,29 +60,42 @@ struct ashmem_area {
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex'; `lru' and `purged' also
+ * by `ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
-	struct list_head unpinned;	/* entry in its area's unpinned list */
+	struct rb_node node;		/* entry in its area's unpinned tree */
 	struct ashmem_area *asma;	/* associated area */
 	size_t pgstart;			/* starting page, inclusive */
 	size_t pgend;			/* ending page, inclusive */
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and lru_count
+ *
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock
+ *		  asma->mutex -> i_mutex -> i_alloc_sem
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * The shrinker walks the LRU under ashmem_lru_lock and only trylocks
+ * the areas it finds there, so it never waits on pinning. Ranges of areas
+ * it finds busy wait on a private list until the walk ends; lru_del() works
+ * on them there just the same.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/* Shrinker totals, protected by ashmem_lru_lock */
+static unsigned long purge_calls;
+static unsigned long purge_pages;
+static unsigned long purge_runs;
+static unsigned long purge_time_us;
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -90,45 +112,77 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 #define page_range_subsumed_by_range(range, start, end) \
   (((range)->pgstart <= (start)) && ((range)->pgend >= (end)))
 
-#define page_in_range(range, page) \
- (((range)->pgstart <= (page)) && ((range)->pgend >= (page)))
-
-#define page_range_in_range(range, start, end) \
-  (page_in_range(range, start) || page_in_range(range, end) || \
-   page_range_subsumes_range(range, start, end))
-
-#define range_before_page(range, page) \
-  ((range)->pgend < (page))
-
 #define PROT_MASK		(PROT_EXEC | PROT_READ | PROT_WRITE)
 
+/* Caller must hold ashmem_lru_lock */
 static inline void lru_add(struct ashmem_range *range)
 {
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
 }
 
+/* Caller must hold ashmem_lru_lock */
 static inline void lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
 	lru_count -= range_size(range);
 }
 
+/*
+ * range_first - the lowest unpinned range ending at or after 'pgstart'
+ *
+ * An area's unpinned ranges never overlap, so ordering them by pgstart
+ * orders them by pgend as well and a plain rbtree descent finds it.
+ *
+ * Caller must hold asma->mutex.
+ */
+static struct ashmem_range *range_first(struct ashmem_area *asma,
+					size_t pgstart)
+{
+	struct rb_node *node = asma->unpinned.rb_node;
+	struct ashmem_range *range, *found = NULL;
+
+	while (node) {
+		range = rb_entry(node, struct ashmem_range, node);
+		if (range->pgend >= pgstart) {
+			found = range;
+			node = node->rb_left;
+		} else
+			node = node->rb_right;
+	}
+
+	return found;
+}
+
+static inline struct ashmem_range *range_next(struct ashmem_range *range)
+{
+	struct rb_node *node = rb_next(&range->node);
+
+	return node ? rb_entry(node, struct ashmem_range, node) : NULL;
+}
+
+static inline struct ashmem_range *range_prev(struct ashmem_range *range)
+{
+	struct rb_node *node = rb_prev(&range->node);
+
+	return node ? rb_entry(node, struct ashmem_range, node) : NULL;
+}
+
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
  * 'asma' - associated ashmem_area
- * 'prev_range' - the previous ashmem_range in the sorted asma->unpinned list
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
-static int range_alloc(struct ashmem_area *asma,
-		       struct ashmem_range *prev_range, unsigned int purged,
+static int range_alloc(struct ashmem_area *asma, unsigned int purged,
 		       size_t start, size_t end)
 {
+	struct rb_node **p = &asma->unpinned.rb_node;
+	struct rb_node *parent = NULL;
 	struct ashmem_range *range;
 
 	range = kmem_cache_zalloc(ashmem_range_cachep, GFP_KERNEL);
@@ -140,26 +194,43 @@ static int range_alloc(struct ashmem_area *asma,
 	range->pgend = end;
 	range->purged = purged;
 
-	list_add_tail(&range->unpinned, &prev_range->unpinned);
+	while (*p) {
+		parent = *p;
+		if (start < rb_entry(parent, struct ashmem_range, node)->pgstart)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&range->node, parent, p);
+	rb_insert_color(&range->node, &asma->unpinned);
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_add(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 
 	return 0;
 }
 
+/* Caller must hold asma->mutex */
 static void range_del(struct ashmem_range *range)
 {
-	list_del(&range->unpinned);
-	if (range_on_lru(range))
+	rb_erase(&range->node, &range->asma->unpinned);
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_del(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 	kmem_cache_free(ashmem_range_cachep, range);
 }
 
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Shrinking within its own bounds keeps the range's place in the tree.
+ *
+ * Caller must hold asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -169,8 +240,11 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -186,7 +260,8 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	if (unlikely(!asma))
 		return -ENOMEM;
 
-	INIT_LIST_HEAD(&asma->unpinned_list);
+	asma->unpinned = RB_ROOT;
+	mutex_init(&asma->mutex);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -197,12 +272,12 @@ static int ashmem_open(struct inode *inode, struct file *file)
 static int ashmem_release(struct inode *ignored, struct file *file)
 {
 	struct ashmem_area *asma = file->private_data;
-	struct ashmem_range *range, *next;
+	struct rb_node *node;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
-		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
+	while ((node = rb_first(&asma->unpinned)))
+		range_del(rb_entry(node, struct ashmem_range, node));
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -217,7 +292,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -238,7 +313,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -247,7 +322,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -268,7 +343,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -285,7 +360,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -328,10 +403,61 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
+/* Take 'range' off the LRU for good. Caller holds both locks. */
+static inline void range_purge(struct ashmem_range *range)
+{
+	range->purged = ASHMEM_WAS_PURGED;
+	lru_del(range);
+}
+
+/*
+ * ashmem_purge_run - purge 'range' together with any of its neighbours
+ * that are also still on the LRU and directly adjacent to it, stopping
+ * once 'budget' pages are covered. Unpinning a buffer chunk by chunk
+ * leaves runs of touching ranges, and a run of them needs just one
+ * vmtruncate_range() call.
+ *
+ * Caller must hold range->asma->mutex and ashmem_lru_lock; the latter
+ * is dropped before truncating. Returns the number of pages purged.
+ */
+static unsigned long ashmem_purge_run(struct ashmem_range *range, long budget)
+{
+	struct inode *inode = range->asma->file->f_dentry->d_inode;
+	struct ashmem_range *first = range, *last = range, *r;
+	unsigned long pages = range_size(range);
+
+	range_purge(range);
+
+	while (pages < budget) {
+		r = range_prev(first);
+		if (!r || !range_on_lru(r) || r->pgend + 1 != first->pgstart)
+			break;
+		range_purge(r);
+		pages += range_size(r);
+		first = r;
+	}
+
+	while (pages < budget) {
+		r = range_next(last);
+		if (!r || !range_on_lru(r) || last->pgend + 1 != r->pgstart)
+			break;
+		range_purge(r);
+		pages += range_size(r);
+		last = r;
+	}
+
+	spin_unlock(&ashmem_lru_lock);
+
+	vmtruncate_range(inode, first->pgstart * PAGE_SIZE,
+			 (last->pgend + 1) * PAGE_SIZE - 1);
+
+	return pages;
+}
+
 /*
  * ashmem_shrink - our cache shrinker, called from mm/vmscan.c :: shrink_slab
  *
@@ -344,12 +470,21 @@ out:
  * proceed without risk of deadlock (due to gfp_mask).
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
- * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * chunks of ashmem regions LRU-wise, each together with the unpinned chunks
+ * adjacent to it, until we hit 'nr_to_scan' pages freed. Areas whose lock is
+ * held are skipped rather than waited for, so a direct reclaimer never
+ * stalls behind a pinner. Skipped ranges are set aside and put back at the
+ * head of the LRU afterwards, so each range is looked at once per call.
  */
 static int ashmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *range;
+	LIST_HEAD(busy);
+	unsigned long pages, reclaimed = 0;
+	unsigned int runs = 0;
+	long budget = nr_to_scan;
+	ktime_t start;
+	s64 latency;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
@@ -357,21 +492,52 @@ static int ashmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	if (!nr_to_scan)
 		return lru_count;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+	start = ktime_get();
 
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+	spin_lock(&ashmem_lru_lock);
+	while (budget > 0 && !list_empty(&ashmem_lru_list)) {
+		struct ashmem_area *asma;
 
-		nr_to_scan -= range_size(range);
-		if (nr_to_scan <= 0)
-			break;
+		range = list_first_entry(&ashmem_lru_list, struct ashmem_range,
+					 lru);
+		asma = range->asma;
+
+		/*
+		 * Skip areas being pinned, unpinned or released; their
+		 * ranges go back on the LRU for next time. The area can't
+		 * go away while one of its ranges is listed and we hold
+		 * ashmem_lru_lock.
+		 */
+		if (!mutex_trylock(&asma->mutex)) {
+			list_move_tail(&range->lru, &busy);
+			continue;
+		}
+
+		pages = ashmem_purge_run(range, budget);
+		mutex_unlock(&asma->mutex);
+
+		reclaimed += pages;
+		runs++;
+		budget -= pages;
+
+		spin_lock(&ashmem_lru_lock);
 	}
-	mutex_unlock(&ashmem_mutex);
+	list_splice(&busy, &ashmem_lru_list);
+	spin_unlock(&ashmem_lru_lock);
+
+	/* calls that found every area busy purged nothing: leave them out */
+	if (!reclaimed)
+		return lru_count;
+
+	latency = ktime_to_ns(ktime_sub(ktime_get(), start));
+	trace_ashmem_shrink(nr_to_scan, reclaimed, runs, latency);
+
+	spin_lock(&ashmem_lru_lock);
+	purge_calls++;
+	purge_pages += reclaimed;
+	purge_runs += runs;
+	purge_time_us += (unsigned long)div_s64(latency, NSEC_PER_USEC);
+	spin_unlock(&ashmem_lru_lock);
 
 	return lru_count;
 }
@@ -385,7 +551,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -400,7 +566,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -408,7 +574,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -422,7 +588,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -431,7 +597,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -448,7 +614,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -457,17 +623,17 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	int ret = ASHMEM_NOT_PURGED;
 
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* moved past last applicable page; we can short circuit */
-		if (range_before_page(range, pgstart))
-			break;
+	/* only ranges from range_first() up to pgend can overlap */
+	for (range = range_first(asma, pgstart);
+	     range && range->pgstart <= pgend; range = next) {
+		next = range_next(range);
 
 		/*
 		 * The user can ask us to pin pages that span multiple ranges,
@@ -484,37 +650,34 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 		 *    so we have to update one side of the range and then
 		 *    create a new range for the other side.
 		 */
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret |= range->purged;
-
-			/* Case #1: Easy. Just nuke the whole thing. */
-			if (page_range_subsumes_range(range, pgstart, pgend)) {
-				range_del(range);
-				continue;
-			}
-
-			/* Case #2: We overlap from the start, so adjust it */
-			if (range->pgstart >= pgstart) {
-				range_shrink(range, pgend + 1, range->pgend);
-				continue;
-			}
-
-			/* Case #3: We overlap from the rear, so adjust it */
-			if (range->pgend <= pgend) {
-				range_shrink(range, range->pgstart, pgstart-1);
-				continue;
-			}
-
-			/*
-			 * Case #4: We eat a chunk out of the middle. A bit
-			 * more complicated, we allocate a new range for the
-			 * second half and adjust the first chunk's endpoint.
-			 */
-			range_alloc(asma, range, range->purged,
-				    pgend + 1, range->pgend);
+		ret |= range->purged;
+
+		/* Case #1: Easy. Just nuke the whole thing. */
+		if (page_range_subsumes_range(range, pgstart, pgend)) {
+			range_del(range);
+			continue;
+		}
+
+		/* Case #2: We overlap from the start, so adjust it */
+		if (range->pgstart >= pgstart) {
+			range_shrink(range, pgend + 1, range->pgend);
+			continue;
+		}
+
+		/* Case #3: We overlap from the rear, so adjust it */
+		if (range->pgend <= pgend) {
 			range_shrink(range, range->pgstart, pgstart - 1);
-			break;
+			continue;
 		}
+
+		/*
+		 * Case #4: We eat a chunk out of the middle. A bit
+		 * more complicated, we allocate a new range for the
+		 * second half and adjust the first chunk's endpoint.
+		 */
+		range_alloc(asma, range->purged, pgend + 1, range->pgend);
+		range_shrink(range, range->pgstart, pgstart - 1);
+		break;
 	}
 
 	return ret;
@@ -523,18 +686,16 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	unsigned int purged = ASHMEM_NOT_PURGED;
 
-restart:
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* short circuit: this is our insertion point */
-		if (range_before_page(range, pgstart))
-			break;
+	for (range = range_first(asma, pgstart);
+	     range && range->pgstart <= pgend; range = next) {
+		next = range_next(range);
 
 		/*
 		 * The user can ask us to unpin pages that are already entirely
@@ -542,40 +703,32 @@ restart:
 		 */
 		if (page_range_subsumed_by_range(range, pgstart, pgend))
 			return 0;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			pgstart = min_t(size_t, range->pgstart, pgstart),
-			pgend = max_t(size_t, range->pgend, pgend);
-			purged |= range->purged;
-			range_del(range);
-			goto restart;
-		}
+
+		/* anything after this range starts past the merged pgend */
+		pgstart = min_t(size_t, range->pgstart, pgstart);
+		pgend = max_t(size_t, range->pgend, pgend);
+		purged |= range->purged;
+		range_del(range);
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	return range_alloc(asma, purged, pgstart, pgend);
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
 {
-	struct ashmem_range *range;
-	int ret = ASHMEM_IS_PINNED;
+	struct ashmem_range *range = range_first(asma, pgstart);
 
-	list_for_each_entry(range, &asma->unpinned_list, unpinned) {
-		if (range_before_page(range, pgstart))
-			break;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret = ASHMEM_IS_UNPINNED;
-			break;
-		}
-	}
+	if (range && range->pgstart <= pgend)
+		return ASHMEM_IS_UNPINNED;
 
-	return ret;
+	return ASHMEM_IS_PINNED;
 }
 
 static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
@@ -607,7 +760,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -621,7 +774,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -640,10 +793,12 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	case ASHMEM_SET_SIZE:
 		ret = -EINVAL;
+		mutex_lock(&asma->mutex);
 		if (!asma->file) {
 			ret = 0;
 			asma->size = (size_t) arg;
 		}
+		mutex_unlock(&asma->mutex);
 		break;
 	case ASHMEM_GET_SIZE:
 		ret = asma->size;
@@ -671,6 +826,181 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+#ifdef CONFIG_DEBUG_BENCH
+/*
+ * Writing N to the bench parameter runs N kernel threads, each on a slice
+ * of BENCH_AREA_PAGES pages with every other page unpinned, that pin and
+ * unpin one page at a time BENCH_LOOPS times. The slices are areas of
+ * their own, or with bench_shared set, parts of one area whose mutex all
+ * threads then contend on. The aggregate pin/unpin ops/sec is reported.
+ */
+#define BENCH_LOOPS		20000
+#define BENCH_MAX_THREADS	16
+#define BENCH_AREA_PAGES	1024
+
+struct ashmem_bench {
+	struct ashmem_area *asma;
+	size_t pgstart;			/* first page of this thread's slice */
+};
+
+static DEFINE_MUTEX(bench_lock);
+static DECLARE_COMPLETION(bench_done);
+static atomic_t bench_running;
+static int bench_shared;
+static int bench_threads;
+static unsigned long bench_rate;
+
+static struct ashmem_area *ashmem_bench_area(size_t pages)
+{
+	struct ashmem_area *asma;
+	struct file *file;
+	size_t pg;
+
+	asma = kmem_cache_zalloc(ashmem_area_cachep, GFP_KERNEL);
+	if (unlikely(!asma))
+		return NULL;
+
+	asma->unpinned = RB_ROOT;
+	mutex_init(&asma->mutex);
+	asma->size = pages * PAGE_SIZE;
+
+	/* the shrinker may purge our ranges, so give them a backing file */
+	file = shmem_file_setup("ashmem_bench", asma->size, VM_NORESERVE);
+	if (IS_ERR(file)) {
+		kmem_cache_free(ashmem_area_cachep, asma);
+		return NULL;
+	}
+	asma->file = file;
+
+	mutex_lock(&asma->mutex);
+	for (pg = 1; pg < pages; pg += 2)
+		ashmem_unpin(asma, pg, pg);
+	mutex_unlock(&asma->mutex);
+
+	return asma;
+}
+
+static void ashmem_bench_free(struct ashmem_area *asma)
+{
+	struct rb_node *node;
+
+	mutex_lock(&asma->mutex);
+	while ((node = rb_first(&asma->unpinned)))
+		range_del(rb_entry(node, struct ashmem_range, node));
+	mutex_unlock(&asma->mutex);
+
+	fput(asma->file);
+	kmem_cache_free(ashmem_area_cachep, asma);
+}
+
+static int ashmem_bench_thread(void *data)
+{
+	struct ashmem_bench *bench = data;
+	struct ashmem_area *asma = bench->asma;
+	size_t pg;
+	int i;
+
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		pg = bench->pgstart + (i * 2) % BENCH_AREA_PAGES + 1;
+
+		mutex_lock(&asma->mutex);
+		ashmem_pin(asma, pg, pg);
+		mutex_unlock(&asma->mutex);
+
+		mutex_lock(&asma->mutex);
+		ashmem_unpin(asma, pg, pg);
+		mutex_unlock(&asma->mutex);
+	}
+
+	if (atomic_dec_and_test(&bench_running))
+		complete(&bench_done);
+	return 0;
+}
+
+static int bench_set(const char *val, struct kernel_param *kp)
+{
+	struct ashmem_bench *bench;
+	struct task_struct **tasks;
+	unsigned long n;
+	ktime_t start;
+	s64 ns;
+	int i, shared, ret = 0;
+
+	if (strict_strtoul(val, 0, &n) || !n || n > BENCH_MAX_THREADS)
+		return -EINVAL;
+
+	bench = kcalloc(n, sizeof(*bench), GFP_KERNEL);
+	tasks = kcalloc(n, sizeof(*tasks), GFP_KERNEL);
+	if (!bench || !tasks) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	mutex_lock(&bench_lock);
+	shared = bench_shared;
+	for (i = 0; i < n; i++) {
+		if (shared && i) {
+			bench[i].asma = bench[0].asma;
+			bench[i].pgstart = i * BENCH_AREA_PAGES;
+			continue;
+		}
+		bench[i].asma = ashmem_bench_area(shared ?
+				n * BENCH_AREA_PAGES : BENCH_AREA_PAGES);
+		if (!bench[i].asma) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		tasks[i] = kthread_create(ashmem_bench_thread, &bench[i],
+					  "ashmem_bench/%d", i);
+		if (IS_ERR(tasks[i])) {
+			ret = PTR_ERR(tasks[i]);
+			while (--i >= 0)
+				kthread_stop(tasks[i]);
+			goto out_free;
+		}
+	}
+
+	atomic_set(&bench_running, n);
+	INIT_COMPLETION(bench_done);
+	start = ktime_get();
+	for (i = 0; i < n; i++)
+		wake_up_process(tasks[i]);
+	wait_for_completion(&bench_done);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	bench_threads = n;
+	bench_rate = div64_u64((u64) n * 2 * BENCH_LOOPS * NSEC_PER_SEC,
+			       ns ? ns : 1);
+	printk(KERN_INFO "ashmem: bench %d threads on %s, "
+	       "%lu pin/unpin ops/sec\n", bench_threads,
+	       shared ? "one area" : "own areas", bench_rate);
+
+out_free:
+	for (i = 0; i < (shared ? 1 : n); i++)
+		if (bench[i].asma)
+			ashmem_bench_free(bench[i].asma);
+	mutex_unlock(&bench_lock);
+out:
+	kfree(tasks);
+	kfree(bench);
+	return ret;
+}
+
+static int bench_get(char *buffer, struct kernel_param *kp)
+{
+	int ret;
+
+	mutex_lock(&bench_lock);
+	ret = sprintf(buffer, "%d threads, %lu pin/unpin ops/sec",
+		      bench_threads, bench_rate);
+	mutex_unlock(&bench_lock);
+	return ret;
+}
+#endif /* CONFIG_DEBUG_BENCH */
+
 static struct file_operations ashmem_fops = {
 	.owner = THIS_MODULE,
 	.open = ashmem_open,
@@ -740,4 +1070,19 @@ static void __exit ashmem_exit(void)
 module_init(ashmem_init);
 module_exit(ashmem_exit);
 
+module_param(purge_calls, ulong, S_IRUGO);
+MODULE_PARM_DESC(purge_calls, "Shrinker calls that purged pages");
+module_param(purge_pages, ulong, S_IRUGO);
+MODULE_PARM_DESC(purge_pages, "Unpinned pages purged by the shrinker");
+module_param(purge_runs, ulong, S_IRUGO);
+MODULE_PARM_DESC(purge_runs, "Contiguous runs truncated by the shrinker");
+module_param(purge_time_us, ulong, S_IRUGO);
+MODULE_PARM_DESC(purge_time_us, "Total time spent purging, in microseconds");
+#ifdef CONFIG_DEBUG_BENCH
+module_param_call(bench, bench_set, bench_get, NULL, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bench, "Write N to time pin/unpin with N threads");
+module_param(bench_shared, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bench_shared, "Run the bench threads on a single area");
+#endif
+
 MODULE_LICENSE("GPL");